@@ -30,6 +30,24 @@
 // All delays are in microseconds.
 #define DELAY_SETTLE    50      // Delay for lines to settle for power off/on
 
+// The I2C signals are normally bit-banged on the CLOCK and DATA pins.
+// If the socket is wired to the hardware TWI pins of an ATmega168/328
+// instead (SDA on A4 = 18, SCL on A5 = 19), then set PIN_DATA to 18 and
+// PIN_CLOCK to 19, and fit 2.2K pull-up resistors to SDA and SCL.  The
+// activity LED moves from A5 to A3.  The TWI peripheral then runs the bus
+// at 400kHz, which all of the supported devices can handle and which is
+// the most that the ATmega's TWI is rated for.
+#if (defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)) && \
+        PIN_CLOCK == 19 && PIN_DATA == 18
+#define I2C_TWI         1
+#define I2C_TWI_KHZ     400     // Bus speed for the TWI peripheral
+#define I2C_TWBR_MIN    10      // Smallest TWBR for reliable master mode
+#define I2C_TWI_TIMEOUT 2000    // Longest TWI step before giving up (us)
+#undef PIN_ACTIVITY
+#define PIN_ACTIVITY    A3      // A5 is SCL
+#include <util/twi.h>
+#endif
+
 // States this application may be in.
 #define STATE_IDLE      0       // Idle, device is held in the reset state
 #define STATE_PROGRAM   1       // Active, reading and writing memory
@@ -48,6 +66,24 @@ byte eepromI2CAddress;
 byte eepromBlockSelectMode;
 unsigned int eepromPageSize;
 
+// Several EEPROMs of the same type can share the bus in sockets that
+// differ only in their A0-A2 chip select pins, and be written at the
+// same time.  "chipAddress" is the control byte for the selected socket.
+#define SOCKETS_MAX     8
+byte socketCount = 1;
+byte readSocket = 0;
+byte chipAddress = 0xA0;
+
+// Page that is being collected for writing to all of the sockets.
+#define PAGE_MAX        128
+byte pageBuffer[PAGE_MAX];
+unsigned int pageFill = 0;
+
+// Number of pages that have been written, and that were skipped because
+// the EEPROM already held them, since the device was selected.
+unsigned long pagesWritten = 0;
+unsigned long pagesSkipped = 0;
+
 // Device names, forced out into PROGMEM.
 const char s_24lc00[]   PROGMEM = "24lc00";
 const char s_24lc01[]   PROGMEM = "24lc01";
@@ -132,14 +168,33 @@ struct deviceInfo const devices[] PROGMEM = {
 #define BINARY_TRANSFER_MAX 64
 #define BUFFER_MAX (BINARY_TRANSFER_MAX + 1)
 char buffer[BUFFER_MAX];
+
+// Number of bytes that the serial receive buffer in the Arduino core
+// can hold, which limits how far ahead the host can send packets
+// with "WRITEBIN WINDOW".  The ring buffer holds one less than its size.
+#if defined(SERIAL_RX_BUFFER_SIZE)
+#define SERIAL_RX_MAX (SERIAL_RX_BUFFER_SIZE - 1)
+#else
+#define SERIAL_RX_MAX 63
+#endif
 int buflen = 0;
 
 unsigned long lastActive = 0;
 
+// Current speed of the serial link to the host, and the speeds that
+// the host can select with the "SPEED" command.
+unsigned long serialSpeed = 9600;
+const unsigned long serialSpeeds[] PROGMEM = {
+    9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000, 0
+};
+
+// Number of milliseconds to wait for the host to confirm a new speed.
+#define SPEED_CONFIRM_TIMEOUT   500
+
 void setup()
 {
     // Need a serial link to the host.
-    Serial.begin(9600);
+    Serial.begin(serialSpeed);
 
     // Initialize the defaults for the 24LC256.
     setDefaultDeviceInfo();
@@ -205,6 +260,12 @@ void printHex1(unsigned int value)
         Serial.print((char)('0' + value));
 }
 
+void printHex2(unsigned int value)
+{
+    printHex1((value >> 4) & 0x0F);
+    printHex1(value & 0x0F);
+}
+
 void printHex4(unsigned int word)
 {
     printHex1((word >> 12) & 0x0F);
@@ -235,7 +296,7 @@ void printProgString(const prog_char *str)
 // PROGRAM_PIC_VERSION command.
 void cmdVersion(const char *args)
 {
-    Serial.println("ProgramPIC 1.0");
+    Serial.println("ProgramPIC 1.6");
 }
 
 // Set the defaults for the 24LC256.
@@ -247,6 +308,8 @@ void setDefaultDeviceInfo()
     eepromI2CAddress = 0xA0;
     eepromBlockSelectMode = BSEL_NONE;
     eepromPageSize = 64;
+    resetSockets();
+    resetPageCounts();
 }
 
 // Print the device information.
@@ -259,6 +322,10 @@ void printDeviceInfo()
     printHex8(eepromEnd);
     Serial.println();
     Serial.println("DataBits: 16");
+    if (eepromPageSize >= 2) {
+        Serial.print("PageSize: ");
+        Serial.println(eepromPageSize / 2, DEC);
+    }
 }
 
 // Initialize device properties from the "devices" list.
@@ -271,6 +338,8 @@ void initDevice(const struct deviceInfo *dev)
     eepromI2CAddress = pgm_read_byte(&(dev->address));
     eepromBlockSelectMode = pgm_read_byte(&(dev->blockSelect));
     eepromPageSize = pgm_read_word(&(dev->pageSize));
+    resetSockets();
+    resetPageCounts();
 }
 
 // DEVICE command.
@@ -313,8 +382,7 @@ void cmdDevices(const char *args)
                 Serial.print(' ');
         }
         printProgString(name);
-        unsigned long size = pgm_read_dword(&(devices[index].size));
-        if (size == 32768UL)    // 24LC256 is the default
+        if (name == s_24lc256)  // 24LC256 is the default
             Serial.print('*');
         ++index;
     }
@@ -364,6 +432,50 @@ void cmdSetDevice(const char *args)
     Serial.println("ERROR");
 }
 
+// SOCKETS command.
+void cmdSockets(const char *args)
+{
+    unsigned long count;
+    unsigned long read = 0;
+    int size = parseHex(args, &count);
+    if (size) {
+        args += size;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+        if (*args != '\0')
+            size = parseHex(args, &read);
+    }
+    if (!size || !count || count > maxSockets() || read >= count) {
+        resetSockets();
+        Serial.println("ERROR");
+        return;
+    }
+
+    // Every socket must have an EEPROM in it.
+    for (byte socket = 0; socket < count; ++socket) {
+        selectSocket(socket);
+        if (!probeDevice()) {
+            resetSockets();
+            Serial.println("ERROR");
+            return;
+        }
+    }
+    socketCount = (byte)count;
+    readSocket = (byte)read;
+    selectSocket(0);
+    Serial.println("OK");
+}
+
+// PAGES command.
+void cmdPages(const char *args)
+{
+    Serial.print("OK ");
+    printHex8(pagesWritten);
+    Serial.print(' ');
+    printHex8(pagesSkipped);
+    Serial.println();
+}
+
 int parseHex(const char *args, unsigned long *value)
 {
     int size = 0;
@@ -443,6 +555,8 @@ void cmdRead(const char *args)
     bool activity = true;
     while (start <= end) {
         unsigned int word = readWord(start == end);
+        if (!i2cOk())
+            break;      // Stop short, which the host reports as an error.
         if (count > 0) {
             if ((count % 8) == 0)
                 Serial.println();
@@ -465,11 +579,60 @@ void cmdRead(const char *args)
     Serial.println(".");
 }
 
+#define RLE_RUN         0x80    // READBIN RLE packet type for a run of words.
+#define RLE_RUN_MIN     3       // Shorter runs are smaller as literal words.
+#define RLE_RUN_MAX     1024    // Keeps each packet inside the host's timeout.
+
+const char s_rle[] PROGMEM = "RLE";
+
+// Sends the literal words in "buffer" to the host as a READBIN packet.
+void flushPacket(size_t *offset)
+{
+    if (*offset > 0) {
+        buffer[0] = (char)(*offset);
+        Serial.write((const uint8_t *)buffer, *offset + 1);
+        *offset = 0;
+    }
+}
+
+// Sends "count" copies of "word" during READBIN, as a single run packet
+// if the run is long enough or as literal words otherwise.
+void sendRun(unsigned int word, unsigned int count, size_t *offset)
+{
+    if (count >= RLE_RUN_MIN) {
+        flushPacket(offset);
+        Serial.write((uint8_t)RLE_RUN);
+        Serial.write((uint8_t)count);
+        Serial.write((uint8_t)(count >> 8));
+        Serial.write((uint8_t)word);
+        Serial.write((uint8_t)(word >> 8));
+        return;
+    }
+    while (count-- > 0) {
+        buffer[++(*offset)] = (char)word;
+        buffer[++(*offset)] = (char)(word >> 8);
+        if (*offset >= BINARY_TRANSFER_MAX) {
+            // Buffer is full - flush it to the host.
+            flushPacket(offset);
+        }
+    }
+}
+
 // READBIN command.
 void cmdReadBinary(const char *args)
 {
     unsigned long start;
     unsigned long end;
+    // Was the "RLE" option given to compress runs of identical words?
+    int len = 0;
+    while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
+        ++len;
+    bool rle = matchString(s_rle, args, len);
+    if (rle) {
+        args += len;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
     if (!parseCheckedRange(args, &start, &end)) {
         Serial.println("ERROR");
         return;
@@ -483,16 +646,19 @@ void cmdReadBinary(const char *args)
     int count = 0;
     bool activity = true;
     size_t offset = 0;
+    unsigned int runWord = 0;
+    unsigned int runCount = 0;
+    unsigned int runMax = rle ? RLE_RUN_MAX : 1;
     while (start <= end) {
         unsigned int word = readWord(start == end);
-        buffer[++offset] = (char)word;
-        buffer[++offset] = (char)(word >> 8);
-        if (offset >= BINARY_TRANSFER_MAX) {
-            // Buffer is full - flush it to the host.
-            buffer[0] = (char)offset;
-            Serial.write((const uint8_t *)buffer, offset + 1);
-            offset = 0;
+        if (!i2cOk())
+            break;
+        if (runCount > 0 && (word != runWord || runCount >= runMax)) {
+            sendRun(runWord, runCount, &offset);
+            runCount = 0;
         }
+        runWord = word;
+        ++runCount;
         ++start;
         ++count;
         if ((count % 64) == 0) {
@@ -504,15 +670,117 @@ void cmdReadBinary(const char *args)
                 digitalWrite(PIN_ACTIVITY, LOW);
         }
     }
-    if (offset > 0) {
-        // Flush the final packet before the terminator.
-        buffer[0] = (char)offset;
-        Serial.write((const uint8_t *)buffer, offset + 1);
-    }
+    // Flush the final run and packet before the terminator.
+    if (runCount > 0)
+        sendRun(runWord, runCount, &offset);
+    flushPacket(&offset);
     // Write the terminator (a zero-length packet).
     Serial.write((uint8_t)0x00);
 }
 
+// Adds a byte to a CRC-32 (IEEE 802.3) checksum.
+unsigned long crc32Update(unsigned long crc, unsigned char value)
+{
+    crc ^= value;
+    for (int bit = 0; bit < 8; ++bit) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ 0xEDB88320UL;
+        else
+            crc >>= 1;
+    }
+    return crc;
+}
+
+// Skips over a range of addresses of the form START or START-END.
+const char *skipRange(const char *args)
+{
+    unsigned long value;
+    args += parseHex(args, &value);
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (*args == '-') {
+        ++args;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+        args += parseHex(args, &value);
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
+    return args;
+}
+
+void printCRC(unsigned long crc)
+{
+    printHex4((unsigned int)(crc >> 16));
+    printHex4((unsigned int)crc);
+}
+
+// CHECKSUM command.
+void cmdChecksum(const char *args)
+{
+    unsigned long start;
+    unsigned long end;
+    unsigned long blockSize = 0;
+    if (!parseCheckedRange(args, &start, &end)) {
+        Serial.println("ERROR");
+        return;
+    }
+    args = skipRange(args);
+    if (*args != '\0' && (!parseHex(args, &blockSize) || !blockSize)) {
+        Serial.println("ERROR");
+        return;
+    }
+    if (!startRead(start)) {
+        // No device on the bus.
+        Serial.println("ERROR");
+        return;
+    }
+    if (blockSize)
+        Serial.println("OK");
+    unsigned long startTime = millis();
+    unsigned long crc = 0xFFFFFFFFUL;
+    int count = 0;
+    bool activity = true;
+    while (start <= end) {
+        unsigned int word = readWord(start == end);
+        if (!i2cOk())
+            break;
+        crc = crc32Update(crc, (unsigned char)word);
+        crc = crc32Update(crc, (unsigned char)(word >> 8));
+        if (blockSize && (start == end || ((start + 1) % blockSize) == 0)) {
+            // End of a block: send its CRC and start the next one.
+            printCRC(crc ^ 0xFFFFFFFFUL);
+            Serial.println();
+            crc = 0xFFFFFFFFUL;
+        }
+        ++start;
+        ++count;
+        if ((count % 64) == 0) {
+            // Toggle the activity LED to make it blink during long reads.
+            activity = !activity;
+            if (activity)
+                digitalWrite(PIN_ACTIVITY, HIGH);
+            else
+                digitalWrite(PIN_ACTIVITY, LOW);
+            unsigned long currentTime = millis();
+            if ((currentTime - startTime) >= 2000) {
+                // Large ranges take a while, so ask the host to wait.
+                Serial.println("PENDING");
+                startTime = currentTime;
+            }
+        }
+    }
+    if (blockSize) {
+        Serial.println(".");
+    } else if (!i2cOk()) {
+        Serial.println("ERROR");
+    } else {
+        Serial.print("OK ");
+        printCRC(crc ^ 0xFFFFFFFFUL);
+        Serial.println();
+    }
+}
+
 // WRITE command.
 void cmdWrite(const char *args)
 {
@@ -567,9 +835,8 @@ void cmdWrite(const char *args)
         ++addr;
         ++count;
     }
-    stopWrite();
-    if (!count) {
-        // Missing word argument.
+    if (!stopWrite() || !count) {
+        // Missing word argument, or the last page could not be written.
         Serial.println("ERROR");
     } else {
         Serial.println("OK");
@@ -584,12 +851,41 @@ int readBlocking()
     return Serial.read();
 }
 
+const char s_window[] PROGMEM = "WINDOW";
+
+// Sends the response to a packet during "WRITEBIN WINDOW".
+void printPacketAck(bool ok, unsigned char seq)
+{
+    Serial.print(ok ? "OK " : "ERROR ");
+    printHex2(seq);
+    Serial.println();
+}
+
 // WRITEBIN command.
 void cmdWriteBinary(const char *args)
 {
     unsigned long addr;
     unsigned long limit;
     int size;
+
+    // Were the "WINDOW" or "RLE" options given?
+    bool window = false;
+    bool rle = false;
+    for (;;) {
+        int len = 0;
+        while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
+            ++len;
+        if (matchString(s_window, args, len))
+            window = true;
+        else if (matchString(s_rle, args, len))
+            rle = true;
+        else
+            break;
+        args += len;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
+
     size = parseHex(args, &addr);
     if (!size) {
         Serial.println("ERROR");
@@ -604,22 +900,43 @@ void cmdWriteBinary(const char *args)
         return;
     }
     startWrite(addr);
-    Serial.println("OK");
+    if (window) {
+        // Tell the host how much it can send ahead of the acks.
+        Serial.print("OK ");
+        printHex4(SERIAL_RX_MAX);
+        Serial.println();
+    } else {
+        Serial.println("OK");
+    }
     int count = 0;
     bool activity = true;
+    bool first = true;
+    bool failed = false;
+    unsigned char seq = 0;
     for (;;) {
         // Read in the next binary packet.
         int len = readBlocking();
-        while (len == 0x0A && count == 0) {
+        while (len == 0x0A && first) {
             // Skip 0x0A bytes before the first packet as they are
             // probably part of a CRLF pair rather than a packet length.
             len = readBlocking();
         }
+        first = false;
 
         // Stop if we have a zero packet length - end of upload.
         if (!len)
             break;
 
+        // With "RLE", the top bit of the length marks a compressed packet.
+        bool compressed = (rle && (len & 0x80) != 0);
+        if (compressed)
+            len &= 0x7F;
+
+        // In window mode, the length is followed by a sequence number.
+        unsigned char pktseq = seq;
+        if (window)
+            pktseq = (unsigned char)readBlocking();
+
         // Read the contents of the packet from the serial input stream.
         int offset = 0;
         while (offset < len) {
@@ -631,22 +948,72 @@ void cmdWriteBinary(const char *args)
             }
         }
 
-        // Write the words to memory.
-        for (int posn = 0; posn < (len - 1); posn += 2) {
+        // Only the first 64 bytes were kept.  A plain packet is cut
+        // short, but a compressed one cannot be decoded without the rest.
+        bool overflow = (compressed && len > BINARY_TRANSFER_MAX);
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+
+        // After an error in window mode, discard the packets that the
+        // host had already sent until we see the terminating packet.
+        if (failed)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+        if (overflow)
+            failed = true;      // Compressed packet too long to decode.
+
+        // Write the words to memory.  A compressed packet is a sequence
+        // of opcodes: 0x00-0x7F is followed by 1 to 128 literal words,
+        // and 0x80-0xFF is followed by one word to write 1 to 128 times.
+        int posn = 0;
+        unsigned char repeat = 0;
+        bool fill = false;
+        unsigned int value = 0;
+        while (!failed) {
+            if (!repeat) {
+                if (!compressed) {
+                    repeat = 1;
+                } else if (posn < len) {
+                    unsigned char op = (unsigned char)buffer[posn++];
+                    repeat = (op & 0x7F) + 1;
+                    fill = ((op & 0x80) != 0);
+                } else {
+                    break;
+                }
+                if (fill) {
+                    if (posn >= (len - 1)) {
+                        // The fill value runs past the end of the packet.
+                        failed = true;
+                        break;
+                    }
+                    value = (((unsigned int)buffer[posn]) & 0xFF) |
+                            ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
+                    posn += 2;
+                }
+            }
+            if (!fill) {
+                if (posn >= (len - 1)) {
+                    // A literal run that is cut short is an error, but
+                    // an odd trailing byte in a plain packet is ignored.
+                    if (compressed)
+                        failed = true;
+                    break;
+                }
+                value = (((unsigned int)buffer[posn]) & 0xFF) |
+                        ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
+                posn += 2;
+            }
+            --repeat;
             if (addr > limit) {
                 // We've reached the limit of this memory area, so fail.
-                stopWrite();
-                Serial.println("ERROR");
-                return;
+                failed = true;
+                break;
             }
-            unsigned int value =
-                (((unsigned int)buffer[posn]) & 0xFF) |
-                ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
             if (!writeWord((unsigned int)value)) {
                 // The actual write to the device failed.
-                stopWrite();
-                Serial.println("ERROR");
-                return;
+                failed = true;
+                break;
             }
             ++addr;
             ++count;
@@ -659,12 +1026,147 @@ void cmdWriteBinary(const char *args)
                     digitalWrite(PIN_ACTIVITY, LOW);
             }
         }
+        if (failed)
+            stopWrite();
 
-        // All words in this packet have been written successfully.
+        // Report the result for this packet.  Without a window, the host
+        // stops sending after an error so we can return immediately.
+        if (window) {
+            printPacketAck(!failed, pktseq);
+        } else if (failed) {
+            Serial.println("ERROR");
+            return;
+        } else {
+            Serial.println("OK");
+        }
+        ++seq;
+    }
+    if (failed || !stopWrite())
+        Serial.println("ERROR");
+    else
         Serial.println("OK");
+}
+
+// VERIFYBIN command.
+void cmdVerifyBinary(const char *args)
+{
+    unsigned long addr;
+    unsigned long limit;
+    int size;
+
+    size = parseHex(args, &addr);
+    if (!size) {
+        Serial.println("ERROR");
+        return;
     }
-    stopWrite();
-    Serial.println("OK");
+    if (addr <= eepromEnd) {
+        limit = eepromEnd;
+    } else {
+        // Address is not within one of the valid ranges.
+        Serial.println("ERROR");
+        return;
+    }
+
+    // Packets are always sent as for "WRITEBIN WINDOW".
+    Serial.print("OK ");
+    printHex4(SERIAL_RX_MAX);
+    Serial.println();
+    int count = 0;
+    bool activity = true;
+    bool first = true;
+    bool failed = false;
+    bool mismatch = false;
+    unsigned char seq = 0;
+    for (;;) {
+        // Read in the next binary packet.
+        int len = readBlocking();
+        while (len == 0x0A && first) {
+            // Skip 0x0A bytes before the first packet as they are
+            // probably part of a CRLF pair rather than a packet length.
+            len = readBlocking();
+        }
+        first = false;
+
+        // Stop if we have a zero packet length - end of upload.
+        if (!len)
+            break;
+
+        // Read the sequence number and contents of the packet.
+        unsigned char pktseq = (unsigned char)readBlocking();
+        int offset = 0;
+        while (offset < len) {
+            if (offset < BINARY_TRANSFER_MAX) {
+                buffer[offset++] = (char)readBlocking();
+            } else {
+                readBlocking();     // Packet is too big - discard extra bytes.
+                ++offset;
+            }
+        }
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+
+        // After an error, discard the packets that the host had already
+        // sent until we see the terminating packet.
+        if (failed)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+
+        // Read the words for this packet in one sequential read.
+        if (!failed && len > 1 && addr <= limit && !startRead(addr))
+            failed = true;
+
+        // Compare the words with memory.  The first mismatch in the packet
+        // starts a "MISMATCH" acknowledgement, which lists the address and
+        // actual value of each word that did not match.
+        bool reported = false;
+        for (int posn = 0; posn < (len - 1) && !failed; posn += 2) {
+            if (addr > limit) {
+                // We've reached the limit of this memory area, so fail.
+                failed = true;
+                break;
+            }
+            unsigned int value =
+                (((unsigned int)buffer[posn]) & 0xFF) |
+                ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
+            unsigned int actual = readWord(posn >= (len - 3) || addr == limit);
+            if (!i2cOk()) {
+                failed = true;
+                break;
+            }
+            if (actual != value) {
+                if (!reported) {
+                    Serial.print("MISMATCH ");
+                    printHex2(pktseq);
+                    reported = true;
+                }
+                Serial.print(' ');
+                printHex4((unsigned int)addr);
+                Serial.print(':');
+                printHex4(actual);
+                mismatch = true;
+            }
+            ++addr;
+            ++count;
+            if ((count % 64) == 0) {
+                // Toggle the activity LED to make it blink during long reads.
+                activity = !activity;
+                if (activity)
+                    digitalWrite(PIN_ACTIVITY, HIGH);
+                else
+                    digitalWrite(PIN_ACTIVITY, LOW);
+            }
+        }
+        if (reported)
+            Serial.println();
+        if (failed || !reported)
+            printPacketAck(!failed, pktseq);
+        ++seq;
+    }
+    if (failed || mismatch)
+        Serial.println("ERROR");
+    else
+        Serial.println("OK");
 }
 
 // ERASE command.
@@ -699,6 +1201,11 @@ const char s_cmdReadArgs[] PROGMEM = "STARTADDR[-ENDADDR]";
 const char s_cmdReadBinary[] PROGMEM = "READBIN";
 const char s_cmdReadBinaryDesc[] PROGMEM =
     "Reads program and data words from device memory (binary)";
+const char s_cmdReadBinaryArgs[] PROGMEM = "[RLE] STARTADDR[-ENDADDR]";
+const char s_cmdChecksum[] PROGMEM = "CHECKSUM";
+const char s_cmdChecksumDesc[] PROGMEM =
+    "Returns the CRC-32 of program and data words in device memory";
+const char s_cmdChecksumArgs[] PROGMEM = "STARTADDR-ENDADDR [BLOCKSIZE]";
 const char s_cmdWrite[] PROGMEM = "WRITE";
 const char s_cmdWriteDesc[] PROGMEM =
     "Writes program and data words to device memory (text)";
@@ -707,6 +1214,10 @@ const char s_cmdWriteBinary[] PROGMEM = "WRITEBIN";
 const char s_cmdWriteBinaryDesc[] PROGMEM =
     "Writes program and data words to device memory (binary)";
 const char s_cmdWriteBinaryArgs[] PROGMEM = "STARTADDR";
+const char s_cmdVerifyBinary[] PROGMEM = "VERIFYBIN";
+const char s_cmdVerifyBinaryDesc[] PROGMEM =
+    "Compares program and data words with device memory (binary)";
+const char s_cmdVerifyBinaryArgs[] PROGMEM = "STARTADDR";
 const char s_cmdErase[] PROGMEM = "ERASE";
 const char s_cmdEraseDesc[] PROGMEM =
     "Erases the contents of program, configuration, and data memory";
@@ -720,26 +1231,42 @@ const char s_cmdSetDevice[] PROGMEM = "SETDEVICE";
 const char s_cmdSetDeviceDesc[] PROGMEM =
     "Sets a specific device type manually";
 const char s_cmdSetDeviceArgs[] PROGMEM = "DEVTYPE";
+const char s_cmdSockets[] PROGMEM = "SOCKETS";
+const char s_cmdSocketsDesc[] PROGMEM =
+    "Sets the number of EEPROMs to write, and the one to read";
+const char s_cmdSocketsArgs[] PROGMEM = "COUNT [READ]";
+const char s_cmdPages[] PROGMEM = "PAGES";
+const char s_cmdPagesDesc[] PROGMEM =
+    "Returns the number of pages written and skipped as unchanged";
 const char s_cmdPowerOff[] PROGMEM = "PWROFF";
 const char s_cmdPowerOffDesc[] PROGMEM =
     "Powers off the device in the programming socket";
 const char s_cmdVersion[] PROGMEM = "PROGRAM_PIC_VERSION";
 const char s_cmdVersionDesc[] PROGMEM =
     "Prints the version of ProgramPIC";
+const char s_cmdSpeed[] PROGMEM = "SPEED";
+const char s_cmdSpeedDesc[] PROGMEM =
+    "Changes the speed of the serial link to the host";
+const char s_cmdSpeedArgs[] PROGMEM = "BAUD";
 const char s_cmdHelp[] PROGMEM = "HELP";
 const char s_cmdHelpDesc[] PROGMEM =
     "Prints this help message";
 const command_t commands[] PROGMEM = {
     {s_cmdRead, cmdRead, s_cmdReadDesc, s_cmdReadArgs},
-    {s_cmdReadBinary, cmdReadBinary, s_cmdReadBinaryDesc, s_cmdReadArgs},
+    {s_cmdReadBinary, cmdReadBinary, s_cmdReadBinaryDesc, s_cmdReadBinaryArgs},
+    {s_cmdChecksum, cmdChecksum, s_cmdChecksumDesc, s_cmdChecksumArgs},
     {s_cmdWrite, cmdWrite, s_cmdWriteDesc, s_cmdWriteArgs},
     {s_cmdWriteBinary, cmdWriteBinary, s_cmdWriteBinaryDesc, s_cmdWriteBinaryArgs},
+    {s_cmdVerifyBinary, cmdVerifyBinary, s_cmdVerifyBinaryDesc, s_cmdVerifyBinaryArgs},
     {s_cmdErase, cmdErase, s_cmdEraseDesc, 0},
     {s_cmdDevice, cmdDevice, s_cmdDeviceDesc, 0},
     {s_cmdDevices, cmdDevices, s_cmdDevicesDesc, 0},
     {s_cmdSetDevice, cmdSetDevice, s_cmdSetDeviceDesc, s_cmdSetDeviceArgs},
+    {s_cmdSockets, cmdSockets, s_cmdSocketsDesc, s_cmdSocketsArgs},
+    {s_cmdPages, cmdPages, s_cmdPagesDesc, 0},
     {s_cmdPowerOff, cmdPowerOff, s_cmdPowerOffDesc, 0},
     {s_cmdVersion, cmdVersion, s_cmdVersionDesc, 0},
+    {s_cmdSpeed, cmdSpeed, s_cmdSpeedDesc, s_cmdSpeedArgs},
     {s_cmdHelp, cmdHelp, s_cmdHelpDesc, 0},
     {0, 0}
 };
@@ -772,6 +1299,63 @@ void cmdHelp(const char *args)
     Serial.println(".");
 }
 
+// "SPEED" command.
+void cmdSpeed(const char *args)
+{
+    // Parse the decimal speed and check that it is one we support.
+    unsigned long speed = 0;
+    while (*args >= '0' && *args <= '9')
+        speed = speed * 10 + (*args++ - '0');
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (*args != '\0') {
+        Serial.println("ERROR");
+        return;
+    }
+    int index = 0;
+    for (;;) {
+        unsigned long supported = pgm_read_dword(&(serialSpeeds[index]));
+        if (!supported) {
+            Serial.println("ERROR");
+            return;
+        }
+        if (supported == speed)
+            break;
+        ++index;
+    }
+
+    // Switch speeds once "OK" has been transmitted at the old speed.
+    Serial.println("OK");
+    Serial.flush();
+    Serial.begin(speed);
+
+    // The host must send "PROGRAM_PIC_VERSION" at the new speed to confirm
+    // that the link is working.  If we see anything else, or nothing at
+    // all, then go back to the old speed.
+    unsigned long start = millis();
+    int len = 0;
+    bool confirmed = false;
+    while ((millis() - start) < SPEED_CONFIRM_TIMEOUT) {
+        if (!Serial.available())
+            continue;
+        int ch = Serial.read();
+        if (ch == 0x0A || ch == 0x0D) {
+            if (!len)
+                continue;
+            confirmed = matchString(s_cmdVersion, buffer, len);
+            break;
+        } else if (len < (BUFFER_MAX - 1)) {
+            buffer[len++] = ch;
+        }
+    }
+    if (confirmed) {
+        serialSpeed = speed;
+        cmdVersion(buffer);
+    } else {
+        Serial.begin(serialSpeed);
+    }
+}
+
 // Match a data-space string where the name comes from PROGMEM.
 bool matchString(const prog_char *name, const char *str, int len)
 {
@@ -861,6 +1445,7 @@ void enterProgramMode()
     // Raise VDD.
     digitalWrite(PIN_VDD, HIGH);
     delayMicroseconds(DELAY_SETTLE);
+    i2cEnable();
 
     // Now in program mode, address not set yet.
     state = STATE_PROGRAM;
@@ -874,6 +1459,7 @@ void exitProgramMode()
         return;
 
     // Lower VDD.
+    i2cDisable();
     digitalWrite(PIN_VDD, LOW);
 
     // Return the CLOCK and DATA lines to the pulled-high state.
@@ -889,10 +1475,120 @@ void exitProgramMode()
 // Details of the I2C protocol here: http://en.wikipedia.org/wiki/I2C
 // Assumptions: only one master, no arbitration, and no clock stretching.
 
+#define I2C_ACK     false
+#define I2C_NACK    true
+
+#if defined(I2C_TWI)
+
+// Set when a TWI step did not finish, which happens if SDA or SCL is
+// held low or a pull-up resistor is missing.  Every later operation fails
+// straight away until the bus is powered up again.
+bool i2cHung = false;
+
+// Sets the bus speed and hands the pins to the TWI peripheral.
+// SCL = F_CPU / (16 + 2 * TWBR) with a prescaler of 1.
+void i2cEnable()
+{
+    unsigned long divider = F_CPU / (I2C_TWI_KHZ * 1000UL);
+    unsigned long twbr = divider > 16 ? (divider - 16) / 2 : 0;
+    if (twbr < I2C_TWBR_MIN)
+        twbr = I2C_TWBR_MIN;    // Slower than 400kHz on slow clocks.
+    TWSR = 0;
+    TWBR = (byte)twbr;
+    TWCR = _BV(TWEN);
+    i2cHung = false;
+}
+
+void i2cDisable()
+{
+    TWCR = 0;
+}
+
+bool i2cOk()
+{
+    return !i2cHung;
+}
+
+// Waits for the TWI control register to match "mask" and "value".  If it
+// takes too long, the TWI is reset and the bus is marked as hung.
+bool i2cWaitFor(byte mask, byte value)
+{
+    unsigned long start = micros();
+    while ((TWCR & mask) != value) {
+        if ((micros() - start) >= I2C_TWI_TIMEOUT) {
+            TWCR = 0;
+            TWCR = _BV(TWEN);
+            i2cHung = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Waits for the TWI peripheral to finish the current operation.
+bool i2cWait()
+{
+    return i2cWaitFor(_BV(TWINT), _BV(TWINT));
+}
+
+void i2cStart()
+{
+    if (i2cHung)
+        return;
+    // Sends a repeated start if the bus is already ours.
+    TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
+    i2cWait();
+}
+
+void i2cStop()
+{
+    if (i2cHung)
+        return;
+    TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+    i2cWaitFor(_BV(TWSTO), 0);  // Wait for the stop condition to be sent.
+}
+
+bool i2cWrite(byte value)
+{
+    if (i2cHung)
+        return I2C_NACK;
+    TWDR = value;
+    TWCR = _BV(TWINT) | _BV(TWEN);
+    if (!i2cWait())
+        return I2C_NACK;
+    byte status = TW_STATUS;
+    if (status == TW_MT_SLA_ACK || status == TW_MT_DATA_ACK ||
+            status == TW_MR_SLA_ACK)
+        return I2C_ACK;
+    else
+        return I2C_NACK;
+}
+
+byte i2cRead(bool nack)
+{
+    if (i2cHung)
+        return 0xFF;
+    if (nack)
+        TWCR = _BV(TWINT) | _BV(TWEN);
+    else
+        TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN);
+    if (!i2cWait())
+        return 0xFF;
+    return TWDR;
+}
+
+#else   // !I2C_TWI
+
 #define i2cDelay()  delayMicroseconds(5)
 
 bool started = false;
 
+// The bit-banged bus needs no setup, runs at well under 100kHz, and
+// cannot hang because it never waits for the lines.
+void i2cEnable() {}
+void i2cDisable() {}
+bool i2cOk() { return true; }
+
 void i2cStart()
 {
     pinMode(PIN_DATA, OUTPUT);
@@ -946,9 +1642,6 @@ inline bool i2cReadBit()
     return bit;
 }
 
-#define I2C_ACK     false
-#define I2C_NACK    true
-
 bool i2cWrite(byte value)
 {
     byte mask = 0x80;
@@ -968,34 +1661,73 @@ byte i2cRead(bool nack)
     return value;
 }
 
+#endif  // !I2C_TWI
+
 #define I2C_READ    0x01
 #define I2C_WRITE   0x00
 
+// Returns the number of sockets that can be told apart by the chip
+// select pins that the device does not use for block selection.
+byte maxSockets()
+{
+    switch (eepromBlockSelectMode) {
+    case BSEL_NONE:             return SOCKETS_MAX;
+    case BSEL_17BIT_ADDR:       return SOCKETS_MAX / 2;
+    case BSEL_17BIT_ADDR_ALT:   return SOCKETS_MAX / 2;
+    default:                    return 1;
+    }
+}
+
+// Selects the EEPROM in a socket for the following transfers.  The
+// 24LC1026 uses A1 and A2, and everything else starts at A0.
+void selectSocket(byte socket)
+{
+    if (eepromBlockSelectMode == BSEL_17BIT_ADDR)
+        chipAddress = eepromI2CAddress | (socket << 2);
+    else
+        chipAddress = eepromI2CAddress | (socket << 1);
+}
+
+// Goes back to writing and reading a single EEPROM.
+void resetSockets()
+{
+    socketCount = 1;
+    readSocket = 0;
+    selectSocket(0);
+}
+
+// Clears the page counters for the "PAGES" command.
+void resetPageCounts()
+{
+    pagesWritten = 0;
+    pagesSkipped = 0;
+}
+
 bool writeAddress(unsigned long byteAddr)
 {
     byte ctrl;
     switch (eepromBlockSelectMode) {
     case BSEL_NONE:
-        if (i2cWrite(eepromI2CAddress | I2C_WRITE) == I2C_NACK)
+        if (i2cWrite(chipAddress | I2C_WRITE) == I2C_NACK)
             return false;
         i2cWrite((byte)(byteAddr >> 8));
         i2cWrite((byte)byteAddr);
         break;
     case BSEL_8BIT_ADDR:
-        ctrl = eepromI2CAddress | ((byte)(byteAddr >> 7) & 0x0E) | I2C_WRITE;
+        ctrl = chipAddress | ((byte)(byteAddr >> 7) & 0x0E) | I2C_WRITE;
         if (i2cWrite(ctrl) == I2C_NACK)
             return false;
         i2cWrite((byte)byteAddr);
         break;
     case BSEL_17BIT_ADDR:
-        ctrl = eepromI2CAddress | ((byte)(byteAddr >> 15) & 0x02) | I2C_WRITE;
+        ctrl = chipAddress | ((byte)(byteAddr >> 15) & 0x02) | I2C_WRITE;
         if (i2cWrite(ctrl) == I2C_NACK)
             return false;
         i2cWrite((byte)(byteAddr >> 8));
         i2cWrite((byte)byteAddr);
         break;
     case BSEL_17BIT_ADDR_ALT:
-        ctrl = eepromI2CAddress | ((byte)(byteAddr >> 13) & 0x08) | I2C_WRITE;
+        ctrl = chipAddress | ((byte)(byteAddr >> 13) & 0x08) | I2C_WRITE;
         if (i2cWrite(ctrl) == I2C_NACK)
             return false;
         i2cWrite((byte)(byteAddr >> 8));
@@ -1009,11 +1741,12 @@ bool writeAddress(unsigned long byteAddr)
 bool startRead(unsigned long addr)
 {
     enterProgramMode();
+    selectSocket(readSocket);
     i2cStart();
     if (!writeAddress(addr * 2))
         return false;
     i2cStart();
-    return i2cWrite(eepromI2CAddress | I2C_READ) == I2C_ACK;
+    return i2cWrite(chipAddress | I2C_READ) == I2C_ACK;
 }
 
 // Read the next 16-bit word from the EEPROM during a bulk read operation.
@@ -1028,101 +1761,154 @@ unsigned int readWord(bool last)
 }
 
 unsigned long writeByteAddr;
-bool writeAddrNeeded;
+byte socketsBusy = 0;   // Sockets that are in a write cycle, one bit each.
 
-// Start a bulk write operation.
-void startWrite(unsigned long addr)
+// Waits for the selected EEPROM to finish its write cycle by polling
+// until it acknowledges its address again.
+void waitForWrite()
 {
-    enterProgramMode();
-    writeByteAddr = addr * 2;
-    writeAddrNeeded = true;
+    for (;;) {
+        i2cStart();
+        if (i2cWrite(chipAddress | I2C_WRITE) == I2C_ACK)
+            break;
+        if (!i2cOk())
+            return;     // The bus has hung, so the EEPROM will never answer.
+    }
+    i2cStop();
 }
 
-// Write a 16-bit word during a bulk write operation.
-bool writeWord(unsigned int word)
+// Waits for all of the sockets to finish their write cycles.
+void waitForSockets()
 {
-    if (writeAddrNeeded) {
-        i2cStart();
-        if (!writeAddress(writeByteAddr)) {
-            i2cStop();
-            return false;
+    for (byte socket = 0; socket < socketCount; ++socket) {
+        if (socketsBusy & (1 << socket)) {
+            selectSocket(socket);
+            waitForWrite();
         }
-        writeAddrNeeded = false;
     }
-    i2cWrite((byte)word);
-    if (eepromPageSize == 1) {
-        // 24LC00 needs a flush after every byte that is written.
+    socketsBusy = 0;
+}
+
+// Determine if the selected EEPROM already holds the first "len" bytes
+// of the page buffer at "byteAddr".  Reading stops at the first byte
+// that is different, so a page that needs writing costs little extra.
+bool pageMatches(unsigned long byteAddr, unsigned int len)
+{
+    i2cStart();
+    if (!writeAddress(byteAddr)) {
+        i2cStop();
+        return false;
+    }
+    i2cStart();
+    if (i2cWrite(chipAddress | I2C_READ) == I2C_NACK) {
         i2cStop();
-        for (;;) {
-            // Poll until we get an acknowledgement from the EEPROM.
-            i2cStart();
-            if (i2cWrite(eepromI2CAddress | I2C_WRITE) == I2C_ACK)
-                break;
+        return false;
+    }
+    unsigned int posn = 0;
+    while (posn < len) {
+        bool last = (posn == (len - 1));
+        if (i2cRead(last) != pageBuffer[posn]) {
+            if (!last)
+                i2cRead(I2C_NACK);  // NACK a byte to end the read.
+            break;
+        }
+        ++posn;
+    }
+    i2cStop();
+    return posn == len;
+}
+
+// Writes the page buffer to every socket, unless a socket already holds
+// it.  Each EEPROM is only waited for just before it is given its next
+// page, so that its write cycle overlaps with the other sockets.
+bool writeSockets(unsigned long byteAddr, unsigned int len)
+{
+    for (byte socket = 0; socket < socketCount; ++socket) {
+        selectSocket(socket);
+        if (socketsBusy & (1 << socket))
+            waitForWrite();
+        socketsBusy &= ~(1 << socket);
+        if (pageMatches(byteAddr, len)) {
+            ++pagesSkipped;
+            continue;
         }
-        i2cStop();
         i2cStart();
-        if (!writeAddress(writeByteAddr + 1)) {
+        if (!writeAddress(byteAddr)) {
             i2cStop();
             return false;
         }
-    }
-    i2cWrite((byte)(word >> 8));
-    writeByteAddr += 2;
-    if ((writeByteAddr % eepromPageSize) == 0) {
-        // Overflow into the next page, so need to flush and send a new address.
-        i2cStop();
-        for (;;) {
-            // Poll until we get an acknowledgement from the EEPROM.
-            i2cStart();
-            if (i2cWrite(eepromI2CAddress | I2C_WRITE) == I2C_ACK)
-                break;
-        }
+        for (unsigned int posn = 0; posn < len; ++posn)
+            i2cWrite(pageBuffer[posn]);
         i2cStop();
-        writeAddrNeeded = true;
+        if (!i2cOk())
+            return false;
+        socketsBusy |= (1 << socket);
+        ++pagesWritten;
     }
     return true;
 }
 
-// Stop a bulk write operation.
-void stopWrite()
+// Start a bulk write operation.
+void startWrite(unsigned long addr)
 {
-    if (!writeAddrNeeded) {
-        // Flush the final page write operation.
-        i2cStop();
-        for (;;) {
-            // Poll until we get an acknowledgement from the EEPROM.
-            i2cStart();
-            if (i2cWrite(eepromI2CAddress | I2C_WRITE) == I2C_ACK)
-                break;
-        }
-        i2cStop();
+    enterProgramMode();
+    writeByteAddr = addr * 2;
+    pageFill = 0;
+}
+
+// Write the collected page, which may be a partial page.
+bool flushPage()
+{
+    unsigned int len = pageFill;
+    pageFill = 0;
+    return writeSockets(writeByteAddr - len, len);
+}
+
+// Write a 16-bit word during a bulk write operation.  The bytes are
+// collected until the end of the page, and then written all at once.
+bool writeWord(unsigned int word)
+{
+    pageBuffer[pageFill++] = (byte)word;
+    if ((++writeByteAddr % eepromPageSize) == 0) {
+        // 24LC00 has a page size of 1, so the bytes are written separately.
+        if (!flushPage())
+            return false;
     }
+    pageBuffer[pageFill++] = (byte)(word >> 8);
+    if ((++writeByteAddr % eepromPageSize) == 0)
+        return flushPage();
+    return true;
+}
+
+// Stop a bulk write operation.  Returns false if the final partial
+// page could not be written.
+bool stopWrite()
+{
+    bool ok = true;
+    if (pageFill > 0)
+        ok = flushPage();
+    waitForSockets();
+    return ok && i2cOk();
 }
 
 // Erases all bytes within the EEPROM by setting them to 0xFF.
+// Pages that are already blank are left alone.
 bool eraseAll()
 {
     enterProgramMode();
 
-    // Fill the bytes a page at a time.
+    // Fill the bytes a page at a time, in all of the sockets.
     unsigned long startTime = millis();
     unsigned long currentTime;
     unsigned long addr = 0;
     bool activity = true;
+    for (unsigned int posn = 0; posn < eepromPageSize; ++posn)
+        pageBuffer[posn] = 0xFF;
     while (addr < eepromSize) {
-        i2cStart();
-        if (!writeAddress(addr))
+        if (!writeSockets(addr, eepromPageSize)) {
+            waitForSockets();
             return false;   // No device on the bus.
-        for (unsigned int count = 0; count < eepromPageSize; ++count)
-            i2cWrite(0xFF);
-        i2cStop();
-        for (;;) {
-            // Poll until we get an acknowledgement from the EEPROM.
-            i2cStart();
-            if (i2cWrite(eepromI2CAddress | I2C_WRITE) == I2C_ACK)
-                break;
         }
-        i2cStop();
         addr += eepromPageSize;
         if ((addr % 512) == 0) {
             activity = !activity;
@@ -1138,7 +1924,8 @@ bool eraseAll()
             startTime = currentTime;
         }
     }
-    return true;
+    waitForSockets();
+    return i2cOk();
 }
 
 // Probe the device to see if it is present on the bus.  We do this by
@@ -1147,7 +1934,7 @@ bool probeDevice()
 {
     enterProgramMode();
     i2cStart();
-    if (i2cWrite(eepromI2CAddress | I2C_READ) == I2C_NACK)
+    if (i2cWrite(chipAddress | I2C_READ) == I2C_NACK)
         return false;
     i2cRead(I2C_NACK);
     i2cStop();
@@ -48,10 +48,38 @@ typedef uint32_t prog_uint32_t;
 #define DELAY_TPROG     4000    // Time for a program memory write to complete
 #define DELAY_TDPROG    6000    // Time for a data memory write to complete
 #define DELAY_TERA      6000    // Time for a word erase to complete
-#define DELAY_TPROG5    1000    // Time for program write on FLASH5 systems
 #define DELAY_TFULLERA  50000   // Time for a full chip erase
 #define DELAY_TFULL84   20000   // Intermediate wait for PIC16F84/PIC16F84A
 
+// Bit-level access to the CLOCK and DATA pins.  digitalWrite(),
+// digitalRead(), and pinMode() take several microseconds each on AVR,
+// which is far longer than the ICSP timings need.  On ATmega168/328
+// boards, digital pins 0 to 7 are bits 0 to 7 of PORTD, so the pins are
+// resolved at compile time and each access is a single instruction.
+// At 16MHz, two instructions are enough for TSET1 and THLD1 (100ns min)
+// and TDLY3 (80ns max), so only TDLY2 needs delayMicroseconds().
+// Other boards fall back to the Arduino pin functions.
+#if (defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)) && \
+        PIN_CLOCK < 8 && PIN_DATA < 8
+#define CLOCK_HIGH()        (PORTD |= _BV(PIN_CLOCK))
+#define CLOCK_LOW()         (PORTD &= ~_BV(PIN_CLOCK))
+#define DATA_HIGH()         (PORTD |= _BV(PIN_DATA))
+#define DATA_LOW()          (PORTD &= ~_BV(PIN_DATA))
+#define DATA_READ()         ((PIND & _BV(PIN_DATA)) != 0)
+#define DATA_INPUT()        (DDRD &= ~_BV(PIN_DATA))
+#define DATA_OUTPUT()       (DDRD |= _BV(PIN_DATA))
+#define DELAY_BIT(us)       __asm__ __volatile__ ("nop\n\tnop\n\t")
+#else
+#define CLOCK_HIGH()        digitalWrite(PIN_CLOCK, HIGH)
+#define CLOCK_LOW()         digitalWrite(PIN_CLOCK, LOW)
+#define DATA_HIGH()         digitalWrite(PIN_DATA, HIGH)
+#define DATA_LOW()          digitalWrite(PIN_DATA, LOW)
+#define DATA_READ()         digitalRead(PIN_DATA)
+#define DATA_INPUT()        pinMode(PIN_DATA, INPUT)
+#define DATA_OUTPUT()       pinMode(PIN_DATA, OUTPUT)
+#define DELAY_BIT(us)       delayMicroseconds(us)
+#endif
+
 // Commands that may be sent to the device.
 #define CMD_LOAD_CONFIG         0x00    // Load (write) to config memory
 #define CMD_LOAD_PROGRAM_MEMORY 0x02    // Load to program memory
@@ -92,6 +120,10 @@ unsigned long reservedEnd   = 0x07FF;
 unsigned int  configSave    = 0x0000;
 byte progFlashType          = FLASH4;
 byte dataFlashType          = EEPROM;
+unsigned int  progTime      = DELAY_TPROG;
+unsigned int  dataTime      = DELAY_TDPROG + DELAY_TERA;
+unsigned int  eraseTime     = DELAY_TFULLERA;
+byte rowSize                = 1;
 
 // Device names, forced out into PROGMEM.
 const char s_pic12f629[]  PROGMEM = "pic12f629";
@@ -129,53 +161,76 @@ struct deviceInfo
     prog_uint16_t configSave;   // Bits in config word to be saved.
     prog_uint8_t progFlashType; // Type of flash for program memory.
     prog_uint8_t dataFlashType; // Type of flash for data memory.
+    prog_uint16_t progTime;     // Program memory write time (microseconds).
+    prog_uint16_t dataTime;     // Data memory write time (microseconds).
+    prog_uint16_t eraseTime;    // Bulk erase time (microseconds).
+    prog_uint8_t rowSize;       // Program words written in one cycle.
 
 };
 struct deviceInfo const devices[] PROGMEM = {
     // http://ww1.microchip.com/downloads/en/DeviceDoc/41191D.pdf
-    {s_pic12f629,  0x0F80, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM},
-    {s_pic12f675,  0x0FC0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM},
-    {s_pic16f630,  0x10C0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM},
-    {s_pic16f676,  0x10E0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM},
+    {s_pic12f629,  0x0F80, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {s_pic12f675,  0x0FC0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {s_pic16f630,  0x10C0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {s_pic16f676,  0x10E0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
 
     // http://ww1.microchip.com/downloads/en/DeviceDoc/30262e.pdf
-    {s_pic16f84,   -1,     1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM},
-    {s_pic16f84a,  0x0560, 1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM},
+    {s_pic16f84,   -1,     1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {s_pic16f84a,  0x0560, 1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
 
     // http://ww1.microchip.com/downloads/en/DeviceDoc/39607c.pdf
-    {s_pic16f87,   0x0720, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM},
-    {s_pic16f88,   0x0760, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM},
+    {s_pic16f87,   0x0720, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM, 1000, 12000, 50000, 4},
+    {s_pic16f88,   0x0760, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM, 1000, 12000, 50000, 4},
 
     // 627/628:  http://ww1.microchip.com/downloads/en/DeviceDoc/30034d.pdf
     // A series: http://ww1.microchip.com/downloads/en/DeviceDoc/41196g.pdf
-    {s_pic16f627,  0x07A0, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM},
-    {s_pic16f627a, 0x1040, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM},
-    {s_pic16f628,  0x07C0, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM},
-    {s_pic16f628a, 0x1060, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM},
-    {s_pic16f648a, 0x1100, 4096, 0x2000, 0x2100, 8, 256, 0, 0, FLASH4, EEPROM},
+    {s_pic16f627,  0x07A0, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {s_pic16f627a, 0x1040, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {s_pic16f628,  0x07C0, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {s_pic16f628a, 0x1060, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {s_pic16f648a, 0x1100, 4096, 0x2000, 0x2100, 8, 256, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
 
     // http://ww1.microchip.com/downloads/en/DeviceDoc/41287D.pdf
-    {s_pic16f882,  0x2000, 2048, 0x2000, 0x2100, 9, 128, 0, 0, FLASH4, EEPROM},
-    {s_pic16f883,  0x2020, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM},
-    {s_pic16f884,  0x2040, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM},
-    {s_pic16f886,  0x2060, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM},
-    {s_pic16f887,  0x2080, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM},
+    {s_pic16f882,  0x2000, 2048, 0x2000, 0x2100, 9, 128, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 4},
+    {s_pic16f883,  0x2020, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {s_pic16f884,  0x2040, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {s_pic16f886,  0x2060, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {s_pic16f887,  0x2080, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
 
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
 };
 
 // Buffer for command-line character input and READBIN data packets.
 #define BINARY_TRANSFER_MAX 64
 #define BUFFER_MAX (BINARY_TRANSFER_MAX + 1)
 char buffer[BUFFER_MAX];
+
+// Number of bytes that the serial receive buffer in the Arduino core
+// can hold, which limits how far ahead the host can send packets
+// with "WRITEBIN WINDOW".  The ring buffer holds one less than its size.
+#if defined(SERIAL_RX_BUFFER_SIZE)
+#define SERIAL_RX_MAX (SERIAL_RX_BUFFER_SIZE - 1)
+#else
+#define SERIAL_RX_MAX 63
+#endif
 int buflen = 0;
 
 unsigned long lastActive = 0;
 
+// Current speed of the serial link to the host, and the speeds that
+// the host can select with the "SPEED" command.
+unsigned long serialSpeed = 9600;
+const unsigned long serialSpeeds[] PROGMEM = {
+    9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000, 0
+};
+
+// Number of milliseconds to wait for the host to confirm a new speed.
+#define SPEED_CONFIRM_TIMEOUT   500
+
 void setup()
 {
     // Need a serial link to the host.
-    Serial.begin(9600);
+    Serial.begin(serialSpeed);
 
     // Hold the PIC in the powered down/reset state until we are ready for it.
     pinMode(PIN_MCLR, OUTPUT);
@@ -236,6 +291,12 @@ void printHex1(unsigned int value)
         Serial.print((char)('0' + value));
 }
 
+void printHex2(unsigned int value)
+{
+    printHex1((value >> 4) & 0x0F);
+    printHex1(value & 0x0F);
+}
+
 void printHex4(unsigned int word)
 {
     printHex1((word >> 12) & 0x0F);
@@ -266,7 +327,7 @@ void printProgString(const prog_char *str)
 // PROGRAM_PIC_VERSION command.
 void cmdVersion(const char *args)
 {
-    Serial.println("ProgramPIC 1.0");
+    Serial.println("ProgramPIC 1.6");
 }
 
 // Initialize device properties from the "devices" list and
@@ -284,6 +345,10 @@ void initDevice(const struct deviceInfo *dev)
     configSave = pgm_read_word(&(dev->configSave));
     progFlashType = pgm_read_byte(&(dev->progFlashType));
     dataFlashType = pgm_read_byte(&(dev->dataFlashType));
+    progTime = pgm_read_word(&(dev->progTime));
+    dataTime = pgm_read_word(&(dev->dataTime));
+    eraseTime = pgm_read_word(&(dev->eraseTime));
+    rowSize = pgm_read_byte(&(dev->rowSize));
 
     // Print the extra device information.
     Serial.print("DeviceName: ");
@@ -314,6 +379,12 @@ void initDevice(const struct deviceInfo *dev)
         printHex8(reservedEnd);
         Serial.println();
     }
+    Serial.print("ProgramTime: ");
+    Serial.println(progTime);
+    Serial.print("DataTime: ");
+    Serial.println(dataTime);
+    Serial.print("EraseTime: ");
+    Serial.println(eraseTime);
 }
 
 // Offsets of interesting config locations that contain device information.
@@ -400,6 +471,10 @@ void cmdDevice(const char *args)
         configSave    = 0x0000;
         progFlashType = FLASH4;
         dataFlashType = EEPROM;
+        progTime      = DELAY_TPROG;
+        dataTime      = DELAY_TDPROG + DELAY_TERA;
+        eraseTime     = DELAY_TFULLERA;
+        rowSize       = 1;
     }
 
     Serial.print("ConfigWord: ");
@@ -572,11 +647,60 @@ void cmdRead(const char *args)
     Serial.println(".");
 }
 
+#define RLE_RUN         0x80    // READBIN RLE packet type for a run of words.
+#define RLE_RUN_MIN     3       // Shorter runs are smaller as literal words.
+#define RLE_RUN_MAX     1024    // Keeps each packet inside the host's timeout.
+
+const char s_rle[] PROGMEM = "RLE";
+
+// Sends the literal words in "buffer" to the host as a READBIN packet.
+void flushPacket(size_t *offset)
+{
+    if (*offset > 0) {
+        buffer[0] = (char)(*offset);
+        Serial.write((const uint8_t *)buffer, *offset + 1);
+        *offset = 0;
+    }
+}
+
+// Sends "count" copies of "word" during READBIN, as a single run packet
+// if the run is long enough or as literal words otherwise.
+void sendRun(unsigned int word, unsigned int count, size_t *offset)
+{
+    if (count >= RLE_RUN_MIN) {
+        flushPacket(offset);
+        Serial.write((uint8_t)RLE_RUN);
+        Serial.write((uint8_t)count);
+        Serial.write((uint8_t)(count >> 8));
+        Serial.write((uint8_t)word);
+        Serial.write((uint8_t)(word >> 8));
+        return;
+    }
+    while (count-- > 0) {
+        buffer[++(*offset)] = (char)word;
+        buffer[++(*offset)] = (char)(word >> 8);
+        if (*offset >= BINARY_TRANSFER_MAX) {
+            // Buffer is full - flush it to the host.
+            flushPacket(offset);
+        }
+    }
+}
+
 // READBIN command.
 void cmdReadBinary(const char *args)
 {
     unsigned long start;
     unsigned long end;
+    // Was the "RLE" option given to compress runs of identical words?
+    int len = 0;
+    while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
+        ++len;
+    bool rle = matchString(s_rle, args, len);
+    if (rle) {
+        args += len;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
     if (!parseCheckedRange(args, &start, &end)) {
         Serial.println("ERROR");
         return;
@@ -585,16 +709,17 @@ void cmdReadBinary(const char *args)
     int count = 0;
     bool activity = true;
     size_t offset = 0;
+    unsigned int runWord = 0;
+    unsigned int runCount = 0;
+    unsigned int runMax = rle ? RLE_RUN_MAX : 1;
     while (start <= end) {
         unsigned int word = readWord(start);
-        buffer[++offset] = (char)word;
-        buffer[++offset] = (char)(word >> 8);
-        if (offset >= BINARY_TRANSFER_MAX) {
-            // Buffer is full - flush it to the host.
-            buffer[0] = (char)offset;
-            Serial.write((const uint8_t *)buffer, offset + 1);
-            offset = 0;
+        if (runCount > 0 && (word != runWord || runCount >= runMax)) {
+            sendRun(runWord, runCount, &offset);
+            runCount = 0;
         }
+        runWord = word;
+        ++runCount;
         ++start;
         ++count;
         if ((count % 64) == 0) {
@@ -606,15 +731,108 @@ void cmdReadBinary(const char *args)
                 digitalWrite(PIN_ACTIVITY, LOW);
         }
     }
-    if (offset > 0) {
-        // Flush the final packet before the terminator.
-        buffer[0] = (char)offset;
-        Serial.write((const uint8_t *)buffer, offset + 1);
-    }
+    // Flush the final run and packet before the terminator.
+    if (runCount > 0)
+        sendRun(runWord, runCount, &offset);
+    flushPacket(&offset);
     // Write the terminator (a zero-length packet).
     Serial.write((uint8_t)0x00);
 }
 
+// Adds a byte to a CRC-32 (IEEE 802.3) checksum.
+unsigned long crc32Update(unsigned long crc, unsigned char value)
+{
+    crc ^= value;
+    for (int bit = 0; bit < 8; ++bit) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ 0xEDB88320UL;
+        else
+            crc >>= 1;
+    }
+    return crc;
+}
+
+// Skips over a range of addresses of the form START or START-END.
+const char *skipRange(const char *args)
+{
+    unsigned long value;
+    args += parseHex(args, &value);
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (*args == '-') {
+        ++args;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+        args += parseHex(args, &value);
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
+    return args;
+}
+
+void printCRC(unsigned long crc)
+{
+    printHex4((unsigned int)(crc >> 16));
+    printHex4((unsigned int)crc);
+}
+
+// CHECKSUM command.
+void cmdChecksum(const char *args)
+{
+    unsigned long start;
+    unsigned long end;
+    unsigned long blockSize = 0;
+    if (!parseCheckedRange(args, &start, &end)) {
+        Serial.println("ERROR");
+        return;
+    }
+    args = skipRange(args);
+    if (*args != '\0' && (!parseHex(args, &blockSize) || !blockSize)) {
+        Serial.println("ERROR");
+        return;
+    }
+    if (blockSize)
+        Serial.println("OK");
+    unsigned long startTime = millis();
+    unsigned long crc = 0xFFFFFFFFUL;
+    int count = 0;
+    bool activity = true;
+    while (start <= end) {
+        unsigned int word = readWord(start);
+        crc = crc32Update(crc, (unsigned char)word);
+        crc = crc32Update(crc, (unsigned char)(word >> 8));
+        if (blockSize && (start == end || ((start + 1) % blockSize) == 0)) {
+            // End of a block: send its CRC and start the next one.
+            printCRC(crc ^ 0xFFFFFFFFUL);
+            Serial.println();
+            crc = 0xFFFFFFFFUL;
+        }
+        ++start;
+        ++count;
+        if ((count % 64) == 0) {
+            // Toggle the activity LED to make it blink during long reads.
+            activity = !activity;
+            if (activity)
+                digitalWrite(PIN_ACTIVITY, HIGH);
+            else
+                digitalWrite(PIN_ACTIVITY, LOW);
+            unsigned long currentTime = millis();
+            if ((currentTime - startTime) >= 2000) {
+                // Large ranges take a while, so ask the host to wait.
+                Serial.println("PENDING");
+                startTime = currentTime;
+            }
+        }
+    }
+    if (blockSize) {
+        Serial.println(".");
+    } else {
+        Serial.print("OK ");
+        printCRC(crc ^ 0xFFFFFFFFUL);
+        Serial.println();
+    }
+}
+
 const char s_force[] PROGMEM = "FORCE";
 
 // WRITE command.
@@ -706,6 +924,74 @@ int readBlocking()
     return Serial.read();
 }
 
+// Second buffer for WRITEBIN.  The next packet is received into it
+// while the words from the current packet are being programmed, as
+// waitMicros() calls receivePacket() whenever "receiving" is set.
+char packet[BINARY_TRANSFER_MAX];
+int packetLen = -1;         // Length byte, or -1 if not received yet.
+int packetSize = 0;         // Number of payload bytes that follow.
+int packetSeq = -1;         // Sequence number, or -1 if not received yet.
+int packetOffset = 0;       // Number of payload bytes received so far.
+bool packetWindow = false;
+bool packetRle = false;
+bool packetFirst = false;
+bool receiving = false;
+
+// Prepares to receive the next WRITEBIN packet.
+void startPacket()
+{
+    packetLen = -1;
+    packetSize = 0;
+    packetSeq = -1;
+    packetOffset = 0;
+}
+
+// Receives as much of the next WRITEBIN packet as has arrived without
+// waiting for more.  Returns true once the whole packet is in "packet".
+bool receivePacket()
+{
+    for (;;) {
+        if (!packetLen || (packetSeq >= 0 && packetOffset >= packetSize))
+            return true;
+        if (!Serial.available())
+            return false;
+        int ch = Serial.read();
+        if (packetLen < 0) {
+            // Skip 0x0A bytes before the first packet as they are
+            // probably part of a CRLF pair rather than a packet length.
+            if (ch == 0x0A && packetFirst)
+                continue;
+            packetFirst = false;
+            packetLen = ch;
+            if (packetRle && (ch & 0x80) != 0)
+                packetSize = ch & 0x7F;
+            else
+                packetSize = ch;
+
+            // In window mode, the length is followed by a sequence number.
+            if (!packetWindow)
+                packetSeq = 0;
+        } else if (packetSeq < 0) {
+            packetSeq = ch;
+        } else {
+            // Discard the extra bytes if the packet is too big.
+            if (packetOffset < BINARY_TRANSFER_MAX)
+                packet[packetOffset] = (char)ch;
+            ++packetOffset;
+        }
+    }
+}
+
+const char s_window[] PROGMEM = "WINDOW";
+
+// Sends the response to a packet during "WRITEBIN WINDOW".
+void printPacketAck(bool ok, unsigned char seq)
+{
+    Serial.print(ok ? "OK " : "ERROR ");
+    printHex2(seq);
+    Serial.println();
+}
+
 // WRITEBIN command.
 void cmdWriteBinary(const char *args)
 {
@@ -713,6 +999,215 @@ void cmdWriteBinary(const char *args)
     unsigned long limit;
     int size;
 
+    // Were the "FORCE", "WINDOW", or "RLE" options given?
+    bool force = false;
+    bool window = false;
+    bool rle = false;
+    for (;;) {
+        int len = 0;
+        while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
+            ++len;
+        if (matchString(s_force, args, len))
+            force = true;
+        else if (matchString(s_window, args, len))
+            window = true;
+        else if (matchString(s_rle, args, len))
+            rle = true;
+        else
+            break;
+        args += len;
+        while (*args == ' ' || *args == '\t')
+            ++args;
+    }
+
+    size = parseHex(args, &addr);
+    if (!size) {
+        Serial.println("ERROR");
+        return;
+    }
+    args += size;
+    if (addr <= programEnd) {
+        limit = programEnd;
+    } else if (addr >= configStart && addr <= configEnd) {
+        limit = configEnd;
+    } else if (addr >= dataStart && addr <= dataEnd) {
+        limit = dataEnd;
+    } else {
+        // Address is not within one of the valid ranges.
+        Serial.println("ERROR");
+        return;
+    }
+    if (window) {
+        // Tell the host how much it can send ahead of the acks.
+        Serial.print("OK ");
+        printHex4(SERIAL_RX_MAX);
+        Serial.println();
+    } else {
+        Serial.println("OK");
+    }
+    rowCount = 0;
+    verifyPending = false;
+    int count = 0;
+    bool activity = true;
+    bool failed = false;
+    bool reported = false;
+    unsigned char seq = 0;
+    packetWindow = window;
+    packetRle = rle;
+    packetFirst = true;
+    startPacket();
+    for (;;) {
+        // Wait for the rest of the next binary packet, if it did not
+        // arrive while the previous packet was being programmed.
+        while (!receivePacket())
+            ;   // Do nothing.
+
+        // Stop if we have a zero packet length - end of upload.
+        int len = packetLen;
+        if (!len)
+            break;
+
+        // With "RLE", the top bit of the length marks a compressed packet.
+        bool compressed = (rle && (len & 0x80) != 0);
+        // Only the first 64 bytes were kept.  A plain packet is cut
+        // short, but a compressed one cannot be decoded without the rest.
+        len = packetSize;
+        bool overflow = (compressed && len > BINARY_TRANSFER_MAX);
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+        unsigned char pktseq = seq;
+        if (window)
+            pktseq = (unsigned char)packetSeq;
+        memcpy(buffer, packet, len);
+        startPacket();
+
+        // After an error in window mode, discard the packets that the
+        // host had already sent until we see the terminating packet.
+        if (failed && reported)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+        if (overflow)
+            failed = true;      // Compressed packet too long to decode.
+
+        // Acknowledge the packet before writing it so that the host can
+        // send the next one while we are busy.  A failure to write the
+        // previous packet is reported in this acknowledgement instead.
+        // Without a window, the host stops sending after an error so
+        // we can return immediately.
+        if (window) {
+            printPacketAck(!failed, pktseq);
+        } else if (failed) {
+            Serial.println("ERROR");
+            return;
+        } else {
+            Serial.println("OK");
+        }
+        ++seq;
+        if (failed) {
+            reported = true;
+            continue;
+        }
+
+        // Write the words to memory.  A compressed packet is a sequence
+        // of opcodes: 0x00-0x7F is followed by 1 to 128 literal words,
+        // and 0x80-0xFF is followed by one word to write 1 to 128 times.
+        int posn = 0;
+        unsigned char repeat = 0;
+        bool fill = false;
+        unsigned int value = 0;
+        receiving = true;
+        while (!failed) {
+            if (!repeat) {
+                if (!compressed) {
+                    repeat = 1;
+                } else if (posn < len) {
+                    unsigned char op = (unsigned char)buffer[posn++];
+                    repeat = (op & 0x7F) + 1;
+                    fill = ((op & 0x80) != 0);
+                } else {
+                    break;
+                }
+                if (fill) {
+                    if (posn >= (len - 1)) {
+                        // The fill value runs past the end of the packet.
+                        failed = true;
+                        break;
+                    }
+                    value = (((unsigned int)buffer[posn]) & 0xFF) |
+                            ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
+                    posn += 2;
+                }
+            }
+            if (!fill) {
+                if (posn >= (len - 1)) {
+                    // A literal run that is cut short is an error, but
+                    // an odd trailing byte in a plain packet is ignored.
+                    if (compressed)
+                        failed = true;
+                    break;
+                }
+                value = (((unsigned int)buffer[posn]) & 0xFF) |
+                        ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
+                posn += 2;
+            }
+            --repeat;
+            if (addr > limit) {
+                // We've reached the limit of this memory area, so fail.
+                failed = true;
+                break;
+            }
+            if (!queueWord(addr, value, force)) {
+                // The actual write to the device failed.
+                failed = true;
+                break;
+            }
+            ++addr;
+            ++count;
+            if ((count % 24) == 0) {
+                // Toggle the activity LED to make it blink during long writes.
+                activity = !activity;
+                if (activity)
+                    digitalWrite(PIN_ACTIVITY, HIGH);
+                else
+                    digitalWrite(PIN_ACTIVITY, LOW);
+            }
+        }
+        receiving = false;
+    }
+
+    // Write the last partial row and check the rows that were written.
+    if (!failed && !flushRow(force))
+        failed = true;
+    if (!failed && !verifyRows())
+        failed = true;
+    if (failed)
+        Serial.println("ERROR");
+    else
+        Serial.println("OK");
+}
+
+// Determines if "actual" is the value that writeWord() would have left in
+// the device after being asked to write "value".
+bool verifyMatch(unsigned long addr, unsigned int value, unsigned int actual, bool force)
+{
+    unsigned int mask;
+    if (addr >= dataStart && addr <= dataEnd)
+        mask = 0x00FF;
+    else if (force || !configSave || addr != (configStart + DEV_CONFIG_WORD))
+        mask = 0x3FFF;
+    else
+        mask = 0x3FFF & ~configSave;
+    return ((value ^ actual) & mask) == 0;
+}
+
+// VERIFYBIN command.
+void cmdVerifyBinary(const char *args)
+{
+    unsigned long addr;
+    unsigned long limit;
+    int size;
+
     // Was the "FORCE" option given?
     int len = 0;
     while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
@@ -729,7 +1224,6 @@ void cmdWriteBinary(const char *args)
         Serial.println("ERROR");
         return;
     }
-    args += size;
     if (addr <= programEnd) {
         limit = programEnd;
     } else if (addr >= configStart && addr <= configEnd) {
@@ -741,23 +1235,33 @@ void cmdWriteBinary(const char *args)
         Serial.println("ERROR");
         return;
     }
-    Serial.println("OK");
+
+    // Packets are always sent as for "WRITEBIN WINDOW".
+    Serial.print("OK ");
+    printHex4(SERIAL_RX_MAX);
+    Serial.println();
     int count = 0;
     bool activity = true;
+    bool first = true;
+    bool failed = false;
+    bool mismatch = false;
+    unsigned char seq = 0;
     for (;;) {
         // Read in the next binary packet.
         int len = readBlocking();
-        while (len == 0x0A && count == 0) {
+        while (len == 0x0A && first) {
             // Skip 0x0A bytes before the first packet as they are
             // probably part of a CRLF pair rather than a packet length.
             len = readBlocking();
         }
+        first = false;
 
         // Stop if we have a zero packet length - end of upload.
         if (!len)
             break;
 
-        // Read the contents of the packet from the serial input stream.
+        // Read the sequence number and contents of the packet.
+        unsigned char pktseq = (unsigned char)readBlocking();
         int offset = 0;
         while (offset < len) {
             if (offset < BINARY_TRANSFER_MAX) {
@@ -767,34 +1271,46 @@ void cmdWriteBinary(const char *args)
                 ++offset;
             }
         }
-
-        // Write the words to memory.
-        for (int posn = 0; posn < (len - 1); posn += 2) {
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+
+        // After an error, discard the packets that the host had already
+        // sent until we see the terminating packet.
+        if (failed)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+
+        // Compare the words with memory.  The first mismatch in the packet
+        // starts a "MISMATCH" acknowledgement, which lists the address and
+        // actual value of each word that did not match.
+        bool reported = false;
+        for (int posn = 0; posn < (len - 1) && !failed; posn += 2) {
             if (addr > limit) {
                 // We've reached the limit of this memory area, so fail.
-                Serial.println("ERROR");
-                return;
+                failed = true;
+                break;
             }
             unsigned int value =
                 (((unsigned int)buffer[posn]) & 0xFF) |
                 ((((unsigned int)buffer[posn + 1]) & 0xFF) << 8);
-            if (!force) {
-                if (!writeWord(addr, (unsigned int)value)) {
-                    // The actual write to the device failed.
-                    Serial.println("ERROR");
-                    return;
-                }
-            } else {
-                if (!writeWordForced(addr, (unsigned int)value)) {
-                    // The actual write to the device failed.
-                    Serial.println("ERROR");
-                    return;
+            unsigned int actual = readWord(addr);
+            if (!verifyMatch(addr, value, actual, force)) {
+                if (!reported) {
+                    Serial.print("MISMATCH ");
+                    printHex2(pktseq);
+                    reported = true;
                 }
+                Serial.print(' ');
+                printHex4((unsigned int)addr);
+                Serial.print(':');
+                printHex4(actual);
+                mismatch = true;
             }
             ++addr;
             ++count;
-            if ((count % 24) == 0) {
-                // Toggle the activity LED to make it blink during long writes.
+            if ((count % 64) == 0) {
+                // Toggle the activity LED to make it blink during long reads.
                 activity = !activity;
                 if (activity)
                     digitalWrite(PIN_ACTIVITY, HIGH);
@@ -802,11 +1318,16 @@ void cmdWriteBinary(const char *args)
                     digitalWrite(PIN_ACTIVITY, LOW);
             }
         }
-
-        // All words in this packet have been written successfully.
-        Serial.println("OK");
+        if (reported)
+            Serial.println();
+        if (failed || !reported)
+            printPacketAck(!failed, pktseq);
+        ++seq;
     }
-    Serial.println("OK");
+    if (failed || mismatch)
+        Serial.println("ERROR");
+    else
+        Serial.println("OK");
 }
 
 const char s_noPreserve[] PROGMEM = "NOPRESERVE";
@@ -869,7 +1390,7 @@ void cmdErase(const char *args)
         sendSimpleCommand(0x01);    // Command 1
         sendSimpleCommand(0x07);    // Command 7
         sendSimpleCommand(CMD_BEGIN_PROGRAM);
-        delayMicroseconds(DELAY_TFULL84);
+        waitMicros(DELAY_TFULL84);
         sendSimpleCommand(0x01);    // Command 1
         sendSimpleCommand(0x07);    // Command 7
 
@@ -881,7 +1402,7 @@ void cmdErase(const char *args)
     }
 
     // Wait until the chip is fully erased.
-    delayMicroseconds(DELAY_TFULLERA);
+    waitMicros(eraseTime);
 
     // Force the device to reset after it has been erased.
     exitProgramMode();
@@ -940,6 +1461,11 @@ const char s_cmdReadArgs[] PROGMEM = "STARTADDR[-ENDADDR]";
 const char s_cmdReadBinary[] PROGMEM = "READBIN";
 const char s_cmdReadBinaryDesc[] PROGMEM =
     "Reads program and data words from device memory (binary)";
+const char s_cmdReadBinaryArgs[] PROGMEM = "[RLE] STARTADDR[-ENDADDR]";
+const char s_cmdChecksum[] PROGMEM = "CHECKSUM";
+const char s_cmdChecksumDesc[] PROGMEM =
+    "Returns the CRC-32 of program and data words in device memory";
+const char s_cmdChecksumArgs[] PROGMEM = "STARTADDR-ENDADDR [BLOCKSIZE]";
 const char s_cmdWrite[] PROGMEM = "WRITE";
 const char s_cmdWriteDesc[] PROGMEM =
     "Writes program and data words to device memory (text)";
@@ -948,6 +1474,10 @@ const char s_cmdWriteBinary[] PROGMEM = "WRITEBIN";
 const char s_cmdWriteBinaryDesc[] PROGMEM =
     "Writes program and data words to device memory (binary)";
 const char s_cmdWriteBinaryArgs[] PROGMEM = "STARTADDR";
+const char s_cmdVerifyBinary[] PROGMEM = "VERIFYBIN";
+const char s_cmdVerifyBinaryDesc[] PROGMEM =
+    "Compares program and data words with device memory (binary)";
+const char s_cmdVerifyBinaryArgs[] PROGMEM = "[FORCE] STARTADDR";
 const char s_cmdErase[] PROGMEM = "ERASE";
 const char s_cmdEraseDesc[] PROGMEM =
     "Erases the contents of program, configuration, and data memory";
@@ -967,20 +1497,27 @@ const char s_cmdPowerOffDesc[] PROGMEM =
 const char s_cmdVersion[] PROGMEM = "PROGRAM_PIC_VERSION";
 const char s_cmdVersionDesc[] PROGMEM =
     "Prints the version of ProgramPIC";
+const char s_cmdSpeed[] PROGMEM = "SPEED";
+const char s_cmdSpeedDesc[] PROGMEM =
+    "Changes the speed of the serial link to the host";
+const char s_cmdSpeedArgs[] PROGMEM = "BAUD";
 const char s_cmdHelp[] PROGMEM = "HELP";
 const char s_cmdHelpDesc[] PROGMEM =
     "Prints this help message";
 const command_t commands[] PROGMEM = {
     {s_cmdRead, cmdRead, s_cmdReadDesc, s_cmdReadArgs},
-    {s_cmdReadBinary, cmdReadBinary, s_cmdReadBinaryDesc, s_cmdReadArgs},
+    {s_cmdReadBinary, cmdReadBinary, s_cmdReadBinaryDesc, s_cmdReadBinaryArgs},
+    {s_cmdChecksum, cmdChecksum, s_cmdChecksumDesc, s_cmdChecksumArgs},
     {s_cmdWrite, cmdWrite, s_cmdWriteDesc, s_cmdWriteArgs},
     {s_cmdWriteBinary, cmdWriteBinary, s_cmdWriteBinaryDesc, s_cmdWriteBinaryArgs},
+    {s_cmdVerifyBinary, cmdVerifyBinary, s_cmdVerifyBinaryDesc, s_cmdVerifyBinaryArgs},
     {s_cmdErase, cmdErase, s_cmdEraseDesc, 0},
     {s_cmdDevice, cmdDevice, s_cmdDeviceDesc, 0},
     {s_cmdDevices, cmdDevices, s_cmdDevicesDesc, 0},
     {s_cmdSetDevice, cmdSetDevice, s_cmdSetDeviceDesc, s_cmdSetDeviceArgs},
     {s_cmdPowerOff, cmdPowerOff, s_cmdPowerOffDesc, 0},
     {s_cmdVersion, cmdVersion, s_cmdVersionDesc, 0},
+    {s_cmdSpeed, cmdSpeed, s_cmdSpeedDesc, s_cmdSpeedArgs},
     {s_cmdHelp, cmdHelp, s_cmdHelpDesc, 0},
     {0, 0}
 };
@@ -1013,6 +1550,63 @@ void cmdHelp(const char *args)
     Serial.println(".");
 }
 
+// "SPEED" command.
+void cmdSpeed(const char *args)
+{
+    // Parse the decimal speed and check that it is one we support.
+    unsigned long speed = 0;
+    while (*args >= '0' && *args <= '9')
+        speed = speed * 10 + (*args++ - '0');
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (*args != '\0') {
+        Serial.println("ERROR");
+        return;
+    }
+    int index = 0;
+    for (;;) {
+        unsigned long supported = pgm_read_dword(&(serialSpeeds[index]));
+        if (!supported) {
+            Serial.println("ERROR");
+            return;
+        }
+        if (supported == speed)
+            break;
+        ++index;
+    }
+
+    // Switch speeds once "OK" has been transmitted at the old speed.
+    Serial.println("OK");
+    Serial.flush();
+    Serial.begin(speed);
+
+    // The host must send "PROGRAM_PIC_VERSION" at the new speed to confirm
+    // that the link is working.  If we see anything else, or nothing at
+    // all, then go back to the old speed.
+    unsigned long start = millis();
+    int len = 0;
+    bool confirmed = false;
+    while ((millis() - start) < SPEED_CONFIRM_TIMEOUT) {
+        if (!Serial.available())
+            continue;
+        int ch = Serial.read();
+        if (ch == 0x0A || ch == 0x0D) {
+            if (!len)
+                continue;
+            confirmed = matchString(s_cmdVersion, buffer, len);
+            break;
+        } else if (len < (BUFFER_MAX - 1)) {
+            buffer[len++] = ch;
+        }
+    }
+    if (confirmed) {
+        serialSpeed = speed;
+        cmdVersion(buffer);
+    } else {
+        Serial.begin(serialSpeed);
+    }
+}
+
 // Match a data-space string where the name comes from PROGMEM.
 bool matchString(const prog_char *name, const char *str, int len)
 {
@@ -1080,6 +1674,24 @@ void processCommand(const char *buf)
     Serial.println("NOTSUPPORTED");
 }
 
+// Waits for a device timing.  delayMicroseconds() is only accurate up
+// to about 16ms, so the whole milliseconds are waited with delay().
+// During WRITEBIN, the next packet is received while we wait.
+void waitMicros(unsigned int period)
+{
+    if (receiving) {
+        unsigned long start = micros();
+        while ((micros() - start) < period)
+            receivePacket();
+        return;
+    }
+    if (period >= 1000) {
+        delay(period / 1000);
+        period %= 1000;
+    }
+    delayMicroseconds(period);
+}
+
 // Enter high voltage programming mode.
 void enterProgramMode()
 {
@@ -1138,14 +1750,14 @@ void exitProgramMode()
 void sendCommand(byte cmd)
 {
     for (byte bit = 0; bit < 6; ++bit) {
-        digitalWrite(PIN_CLOCK, HIGH);
+        CLOCK_HIGH();
         if (cmd & 1)
-            digitalWrite(PIN_DATA, HIGH);
+            DATA_HIGH();
         else
-            digitalWrite(PIN_DATA, LOW);
-        delayMicroseconds(DELAY_TSET1);
-        digitalWrite(PIN_CLOCK, LOW);
-        delayMicroseconds(DELAY_THLD1);
+            DATA_LOW();
+        DELAY_BIT(DELAY_TSET1);
+        CLOCK_LOW();
+        DELAY_BIT(DELAY_THLD1);
         cmd >>= 1;
     }
 }
@@ -1163,14 +1775,14 @@ void sendWriteCommand(byte cmd, unsigned int data)
     sendCommand(cmd);
     delayMicroseconds(DELAY_TDLY2);
     for (byte bit = 0; bit < 16; ++bit) {
-        digitalWrite(PIN_CLOCK, HIGH);
+        CLOCK_HIGH();
         if (data & 1)
-            digitalWrite(PIN_DATA, HIGH);
+            DATA_HIGH();
         else
-            digitalWrite(PIN_DATA, LOW);
-        delayMicroseconds(DELAY_TSET1);
-        digitalWrite(PIN_CLOCK, LOW);
-        delayMicroseconds(DELAY_THLD1);
+            DATA_LOW();
+        DELAY_BIT(DELAY_TSET1);
+        CLOCK_LOW();
+        DELAY_BIT(DELAY_THLD1);
         data >>= 1;
     }
     delayMicroseconds(DELAY_TDLY2);
@@ -1181,19 +1793,19 @@ unsigned int sendReadCommand(byte cmd)
 {
     unsigned int data = 0;
     sendCommand(cmd);
-    digitalWrite(PIN_DATA, LOW);
-    pinMode(PIN_DATA, INPUT);
+    DATA_LOW();
+    DATA_INPUT();
     delayMicroseconds(DELAY_TDLY2);
     for (byte bit = 0; bit < 16; ++bit) {
         data >>= 1;
-        digitalWrite(PIN_CLOCK, HIGH);
-        delayMicroseconds(DELAY_TDLY3);
-        if (digitalRead(PIN_DATA))
+        CLOCK_HIGH();
+        DELAY_BIT(DELAY_TDLY3);
+        if (DATA_READ())
             data |= 0x8000;
-        digitalWrite(PIN_CLOCK, LOW);
-        delayMicroseconds(DELAY_THLD1);
+        CLOCK_LOW();
+        DELAY_BIT(DELAY_THLD1);
     }
-    pinMode(PIN_DATA, OUTPUT);
+    DATA_OUTPUT();
     delayMicroseconds(DELAY_TDLY2);
     return data;
 }
@@ -1301,19 +1913,17 @@ unsigned int readConfigWord(unsigned long addr)
 // Begin a programming cycle, depending upon the type of flash being written.
 void beginProgramCycle(unsigned long addr, bool isData)
 {
+    unsigned int time = (isData ? dataTime : progTime);
     switch (isData ? dataFlashType : progFlashType) {
     case FLASH:
     case EEPROM:
-        sendSimpleCommand(CMD_BEGIN_PROGRAM);
-        delayMicroseconds(DELAY_TDPROG + DELAY_TERA);
-        break;
     case FLASH4:
         sendSimpleCommand(CMD_BEGIN_PROGRAM);
-        delayMicroseconds(DELAY_TPROG);
+        waitMicros(time);
         break;
     case FLASH5:
         sendSimpleCommand(CMD_BEGIN_PROGRAM_ONLY);
-        delayMicroseconds(DELAY_TPROG5);
+        waitMicros(time);
         sendSimpleCommand(CMD_END_PROGRAM_ONLY);
         break;
     }
@@ -1371,3 +1981,110 @@ bool writeWordForced(unsigned long addr, unsigned int word)
     }
     return readBack == word;
 }
+
+// Program words that are waiting to be written as a row by queueWord().
+#define ROW_MAX 8
+unsigned int rowBuffer[ROW_MAX];
+unsigned long rowStart = 0;
+byte rowCount = 0;
+
+// Words that have been written since the first row of a WRITEBIN
+// transfer.  Reading a row back would need the PC to go backwards,
+// which means resetting the device, so verifyRows() reads all of
+// them back at the end of the transfer and compares the CRC-32.
+unsigned long verifyStart = 0;
+unsigned long verifyEnd = 0;
+unsigned long verifyCrc = 0;
+bool verifyPending = false;
+
+// Adds a word that was written without being read back to the words
+// that verifyRows() will check.
+void addVerifyWord(unsigned long addr, unsigned int word)
+{
+    if (!verifyPending) {
+        verifyStart = addr;
+        verifyCrc = 0xFFFFFFFFUL;
+        verifyPending = true;
+    }
+    verifyCrc = crc32Update(verifyCrc, (unsigned char)word);
+    verifyCrc = crc32Update(verifyCrc, (unsigned char)(word >> 8));
+    verifyEnd = addr;
+}
+
+// Loads a row of program words into the device's write latches and
+// then programs them all in a single cycle.
+void writeRow(unsigned long addr, const unsigned int *words)
+{
+    for (byte index = 0; index < rowSize; ++index) {
+        setPC(addr + index);
+        sendWriteCommand(CMD_LOAD_PROGRAM_MEMORY, words[index] << 1);
+        addVerifyWord(addr + index, words[index]);
+    }
+    beginProgramCycle(addr + rowSize - 1, false);
+}
+
+// Writes a word during WRITEBIN.  On devices that can program several
+// words at once, program words are collected into aligned rows and each
+// row is written in one cycle.  Other words are written one at a time.
+bool queueWord(unsigned long addr, unsigned int word, bool force)
+{
+    if (rowSize > 1 && addr <= programEnd &&
+            (rowCount > 0 || (addr % rowSize) == 0)) {
+        if (!rowCount)
+            rowStart = addr;
+        rowBuffer[rowCount++] = word & 0x3FFF;
+        if (rowCount >= rowSize) {
+            writeRow(rowStart, rowBuffer);
+            rowCount = 0;
+        }
+        return true;
+    }
+    return writeSingle(addr, word, force);
+}
+
+// Writes a single word and reads it back immediately.
+bool writeSingle(unsigned long addr, unsigned int word, bool force)
+{
+    if (verifyPending && addr <= programEnd)
+        addVerifyWord(addr, word & 0x3FFF);
+    if (force)
+        return writeWordForced(addr, word);
+    else
+        return writeWord(addr, word);
+}
+
+// Writes the words of a partial row one at a time at the end of WRITEBIN.
+bool flushRow(bool force)
+{
+    byte count = rowCount;
+    rowCount = 0;
+    for (byte index = 0; index < count; ++index) {
+        if (!writeSingle(rowStart + index, rowBuffer[index], force))
+            return false;
+    }
+    return true;
+}
+
+// Reads back the words that were written since the first row and
+// compares them with the words that were sent.
+bool verifyRows()
+{
+    if (!verifyPending)
+        return true;
+    verifyPending = false;
+    unsigned long startTime = millis();
+    unsigned long crc = 0xFFFFFFFFUL;
+    for (unsigned long addr = verifyStart; addr <= verifyEnd; ++addr) {
+        unsigned int word = readWord(addr);
+        crc = crc32Update(crc, (unsigned char)word);
+        crc = crc32Update(crc, (unsigned char)(word >> 8));
+        unsigned long currentTime = millis();
+        if ((currentTime - startTime) >= 2000) {
+            // Reading back a large write takes a while, so ask the
+            // host to wait for the final response.
+            Serial.println("PENDING");
+            startTime = currentTime;
+        }
+    }
+    return crc == verifyCrc;
+}
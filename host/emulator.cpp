@@ -0,0 +1,2296 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Emulates an Arduino running ProgramPIC or ProgramEEPROM on the slave
+// side of a pseudo-terminal, so that ardpicprog can be run and timed
+// without any hardware.  The device in the emulated programming socket
+// is a blank PIC or 24LCxx EEPROM from the sketches' device tables.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+static struct option long_options[] = {
+    {"baud", no_argument, 0, 'B'},
+    {"boot-delay", required_argument, 0, 'b'},
+    {"device", required_argument, 0, 'd'},
+    {"help", no_argument, 0, 'h'},
+    {"link", required_argument, 0, 'L'},
+    {"rx-buffer", required_argument, 0, 'r'},
+    {"sockets", required_argument, 0, 'S'},
+    {"timing", no_argument, 0, 't'},
+    {"twi", no_argument, 0, 'T'},
+    {"verbose", no_argument, 0, 'v'},
+    {"write-delay", required_argument, 0, 'W'},
+    {0, 0, 0, 0}
+};
+
+// Flash types.  Uses the same values as ProgramPIC.pde.
+#define EEPROM          0
+#define FLASH           1
+#define FLASH4          4
+#define FLASH5          5
+
+// Programming delays from ProgramPIC.pde, in microseconds.
+#define DELAY_SETTLE    50      // Delay for lines to settle for reset
+#define DELAY_TPROG     4000    // Time for a program memory write to complete
+#define DELAY_TDPROG    6000    // Time for a data memory write to complete
+#define DELAY_TERA      6000    // Time for a word erase to complete
+#define DELAY_TFULLERA  50000   // Time for a full chip erase
+#define DELAY_TFULL84   20000   // Intermediate wait for PIC16F84/PIC16F84A
+
+// Write cycle time for a 24LCxx page, in microseconds.
+#define DELAY_TWC       5000
+
+// Rough cost of the bit-banged signalling in the sketches, in microseconds.
+// ProgramPIC drives the ICSP pins through the port registers at about 1us
+// a bit plus TDLY2; ProgramEEPROM still pays for digitalWrite() overhead.
+#define ICSP_COMMAND_US     8       // 6-bit ICSP command, e.g. increment
+#define ICSP_TRANSFER_US    30      // ICSP command with 16 bits of data
+#define I2C_BYTE_US         230     // One byte on the I2C bus, with ack
+
+// ProgramEEPROM built for the hardware TWI pins clocks 9 bits for each
+// byte at 400kHz, plus a little time to drive the TWI.
+#define I2C_TWI_BITS        9
+#define I2C_TWI_OVERHEAD_US 2
+#define I2C_TWI_KHZ         400
+
+// Offsets of interesting config locations that contain device information.
+#define DEV_USERID0         0
+#define DEV_USERID1         1
+#define DEV_USERID2         2
+#define DEV_USERID3         3
+#define DEV_ID              6
+#define DEV_CONFIG_WORD     7
+
+// Value of the OSCCAL instruction in the reserved word of a fresh device.
+#define RESERVED_OSCCAL     0x3480
+
+// Revision number that is reported in the low bits of the device ID.
+#define DEVICE_REVISION     0x0002
+
+#define BINARY_TRANSFER_MAX 64
+#define RLE_RUN             0x80    // READBIN RLE packet type for a run.
+#define RLE_RUN_MIN         3
+#define RLE_RUN_MAX         1024
+#define COMMAND_MAX         64
+#define SPEED_CONFIRM_TIMEOUT   500
+
+// PIC devices, copied from the "devices" table in ProgramPIC.pde.
+struct PicDeviceInfo
+{
+    const char *name;           // User-readable name of the device.
+    int deviceId;               // Device ID for the PIC (-1 if no id).
+    unsigned long programSize;  // Size of program memory (words).
+    unsigned long configStart;  // Flat address start of configuration memory.
+    unsigned long dataStart;    // Flat address start of EEPROM data memory.
+    unsigned int configSize;    // Number of configuration words.
+    unsigned int dataSize;      // Size of EEPROM data memory (bytes).
+    unsigned int reservedWords; // Reserved program words (e.g. for OSCCAL).
+    unsigned int configSave;    // Bits in config word to be saved.
+    int progFlashType;          // Type of flash for program memory.
+    int dataFlashType;          // Type of flash for data memory.
+    unsigned int progTime;      // Program memory write time (microseconds).
+    unsigned int dataTime;      // Data memory write time (microseconds).
+    unsigned int eraseTime;     // Bulk erase time (microseconds).
+    unsigned int rowSize;       // Program words written in one cycle.
+};
+static const PicDeviceInfo picDevices[] = {
+    {"pic12f629",  0x0F80, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic12f675",  0x0FC0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f630",  0x10C0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f676",  0x10E0, 1024, 0x2000, 0x2100, 8, 128, 1, 0x3000, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f84",   -1,     1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {"pic16f84a",  0x0560, 1024, 0x2000, 0x2100, 8,  64, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {"pic16f87",   0x0720, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM, 1000, 12000, 50000, 4},
+    {"pic16f88",   0x0760, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH5, EEPROM, 1000, 12000, 50000, 4},
+    {"pic16f627",  0x07A0, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {"pic16f627a", 0x1040, 1024, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f628",  0x07C0, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH,  EEPROM, 12000, 12000, 50000, 1},
+    {"pic16f628a", 0x1060, 2048, 0x2000, 0x2100, 8, 128, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f648a", 0x1100, 4096, 0x2000, 0x2100, 8, 256, 0, 0, FLASH4, EEPROM, 4000, 12000, 50000, 1},
+    {"pic16f882",  0x2000, 2048, 0x2000, 0x2100, 9, 128, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 4},
+    {"pic16f883",  0x2020, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {"pic16f884",  0x2040, 4096, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {"pic16f886",  0x2060, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {"pic16f887",  0x2080, 8192, 0x2000, 0x2100, 9, 256, 0, 0, FLASH4, EEPROM, 2500,  6000,  6000, 8},
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+// EEPROM devices, copied from the "devices" table in ProgramEEPROM.pde.
+struct EepromDeviceInfo
+{
+    const char *name;           // User-readable name of the device.
+    unsigned long size;         // Size of the device in bytes.
+    unsigned int pageSize;      // Size of a page for bulk transfers.
+    unsigned int sockets;       // Number of chip select addresses.
+};
+static const EepromDeviceInfo eepromDevices[] = {
+    {"24lc00",   16UL,     1,   1},
+    {"24lc01",   128UL,    8,   1},
+    {"24lc014",  128UL,    16,  1},
+    {"24lc02",   256UL,    8,   1},
+    {"24lc024",  256UL,    16,  1},
+    {"24lc025",  256UL,    16,  1},
+    {"24lc04",   512UL,    16,  1},
+    {"24lc08",   1024UL,   16,  1},
+    {"24lc16",   2048UL,   16,  1},
+    {"24lc32",   4096UL,   32,  8},
+    {"24lc64",   8192UL,   32,  8},
+    {"24lc128",  16384UL,  64,  8},
+    {"24lc256",  32768UL,  64,  8},
+    {"24lc512",  65536UL,  128, 8},
+    {"24lc1025", 131072UL, 128, 4},
+    {"24lc1026", 131072UL, 128, 4},
+    {0, 0, 0, 0}
+};
+
+// Index of the 24LC256 in "eepromDevices", which ProgramEEPROM assumes
+// is in the socket until told otherwise.
+#define EEPROM_DEFAULT  12
+
+static unsigned long long currentMicros()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL +
+           (unsigned long long)(ts.tv_nsec / 1000);
+}
+
+static void sleepMicros(unsigned long long micros)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(micros / 1000000ULL);
+    ts.tv_nsec = (long)(micros % 1000000ULL) * 1000L;
+    while (::nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;   // Keep sleeping for the rest of the time.
+}
+
+static void sleepUntil(unsigned long long when)
+{
+    unsigned long long now = currentMicros();
+    if (when > now)
+        sleepMicros(when - now);
+}
+
+// Serial link to the host over the master side of a pseudo-terminal.
+// Optionally models the transfer time of each byte at the link speed.
+class EmuLink
+{
+public:
+    EmuLink();
+    ~EmuLink();
+
+    bool open();
+    std::string deviceName() const { return _deviceName; }
+
+    bool hungUp() const { return _hungUp; }
+    void waitForHost();
+
+    int speed() const { return _speed; }
+    void setSpeed(int speed);
+    void setModelBaud(bool enable) { modelBaud = enable; }
+
+    int read(int timeoutMillis);
+    size_t available();
+    void truncateInput(size_t size);
+
+    void write(const char *data, size_t len) { output.append(data, len); }
+    void print(const char *str) { output += str; }
+    void println(const char *str) { output += str; output += "\r\n"; }
+    void printf(const char *format, ...);
+    void flush();
+
+    void busy(unsigned long micros);
+
+private:
+    int fd;
+    std::string _deviceName;
+    bool _hungUp;
+    int _speed;
+    bool modelBaud;
+    unsigned char buffer[1024];
+    size_t buflen;
+    size_t bufposn;
+    std::string output;
+    unsigned long long rxClock;
+    unsigned long long txClock;
+    unsigned long long lastEmpty;
+    unsigned long long busyDebt;
+
+    bool fillBuffer(int timeoutMillis);
+    void writeAll(const char *data, size_t len);
+    unsigned long long byteTime(size_t count) const
+    {
+        // 10 bits per byte: start bit, 8 data bits, and stop bit.
+        return count * 10000000ULL / (unsigned long long)_speed;
+    }
+};
+
+EmuLink::EmuLink()
+    : fd(-1)
+    , _hungUp(true)
+    , _speed(9600)
+    , modelBaud(false)
+    , buflen(0)
+    , bufposn(0)
+    , rxClock(0)
+    , txClock(0)
+    , lastEmpty(0)
+    , busyDebt(0)
+{
+}
+
+EmuLink::~EmuLink()
+{
+    if (fd != -1)
+        ::close(fd);
+}
+
+bool EmuLink::open()
+{
+    fd = ::posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror("posix_openpt");
+        return false;
+    }
+    if (::grantpt(fd) < 0 || ::unlockpt(fd) < 0) {
+        perror("grantpt");
+        return false;
+    }
+    const char *name = ::ptsname(fd);
+    if (!name) {
+        perror("ptsname");
+        return false;
+    }
+    _deviceName = name;
+
+    // Start the slave side in raw mode.  The settings stick once the
+    // slave is closed again, but the host will set them anyway.
+    int slave = ::open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror(name);
+        return false;
+    }
+    struct termios params;
+    if (::tcgetattr(slave, &params) == 0) {
+        ::cfmakeraw(&params);
+        ::tcsetattr(slave, TCSANOW, &params);
+    }
+    ::close(slave);
+
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+// Waits until the host opens the slave side of the pseudo-terminal.
+// This is the equivalent of the Arduino being reset by the host.
+void EmuLink::waitForHost()
+{
+    for (;;) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, 0) >= 0 && (pfd.revents & POLLHUP) == 0)
+            break;
+        sleepMicros(20000);
+    }
+    _hungUp = false;
+    _speed = 9600;
+    buflen = 0;
+    bufposn = 0;
+    output.clear();
+    rxClock = 0;
+    txClock = 0;
+    lastEmpty = currentMicros();
+    busyDebt = 0;
+}
+
+void EmuLink::setSpeed(int speed)
+{
+    flush();
+    _speed = speed;
+}
+
+// Reads a byte from the host, or returns -1 on timeout or hangup.
+// A negative timeout waits forever.
+int EmuLink::read(int timeoutMillis)
+{
+    if (bufposn >= buflen && !fillBuffer(timeoutMillis))
+        return -1;
+    int ch = buffer[bufposn++];
+    if (modelBaud) {
+        // Bytes cannot arrive faster than the link can carry them.
+        // Sleep in 1 millisecond chunks rather than for every byte.
+        if (rxClock < lastEmpty)
+            rxClock = lastEmpty;
+        rxClock += byteTime(1);
+        if (rxClock > currentMicros() + 1000)
+            sleepUntil(rxClock);
+    }
+    return ch;
+}
+
+bool EmuLink::fillBuffer(int timeoutMillis)
+{
+    // Responses must be on their way before we wait for more input.
+    flush();
+    buflen = 0;
+    bufposn = 0;
+    if (_hungUp)
+        return false;
+    unsigned long long deadline = currentMicros() + timeoutMillis * 1000ULL;
+    for (;;) {
+        ssize_t len = ::read(fd, buffer, sizeof(buffer));
+        if (len > 0) {
+            buflen = (size_t)len;
+            return true;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len == 0 || errno != EAGAIN) {
+            // EIO indicates that the host has closed the slave side.
+            _hungUp = true;
+            return false;
+        }
+
+        // Remember when the input was last empty so that the baud rate
+        // model knows the earliest that the next byte could have arrived.
+        lastEmpty = currentMicros();
+        int wait = -1;
+        if (timeoutMillis >= 0) {
+            if (lastEmpty >= deadline)
+                return false;
+            wait = (int)((deadline - lastEmpty + 999) / 1000);
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int result = ::poll(&pfd, 1, wait);
+        if (result < 0) {
+            if (errno != EINTR) {
+                _hungUp = true;
+                return false;
+            }
+        } else if (result == 0) {
+            return false;
+        } else if ((pfd.revents & POLLIN) == 0) {
+            _hungUp = true;
+            return false;
+        }
+    }
+}
+
+// Returns the number of bytes that the host has sent but we haven't read.
+size_t EmuLink::available()
+{
+    int queued = 0;
+    if (::ioctl(fd, FIONREAD, &queued) < 0)
+        queued = 0;
+    return (buflen - bufposn) + (size_t)queued;
+}
+
+// Discards received bytes beyond the first "size", as happens when
+// the serial receive buffer on the Arduino overflows.
+void EmuLink::truncateInput(size_t size)
+{
+    if (bufposn > 0) {
+        ::memmove(buffer, buffer + bufposn, buflen - bufposn);
+        buflen -= bufposn;
+        bufposn = 0;
+    }
+    while (buflen < size) {
+        ssize_t len = ::read(fd, buffer + buflen, size - buflen);
+        if (len <= 0)
+            break;
+        buflen += (size_t)len;
+    }
+    if (buflen > size)
+        buflen = size;
+    char discard[256];
+    while (::read(fd, discard, sizeof(discard)) > 0)
+        ;   // Drop everything else that is queued.
+}
+
+void EmuLink::printf(const char *format, ...)
+{
+    char buf[128];
+    va_list va;
+    va_start(va, format);
+    vsnprintf(buf, sizeof(buf), format, va);
+    va_end(va);
+    output += buf;
+}
+
+// Sends the buffered output to the host once the device operations that
+// came before it have finished.
+void EmuLink::flush()
+{
+    if (busyDebt > 0) {
+        sleepMicros(busyDebt);
+        busyDebt = 0;
+    }
+    size_t posn = 0;
+    while (posn < output.size()) {
+        // The Arduino's transmit buffer holds 64 bytes, so pace the
+        // output in chunks of that size.
+        size_t len = output.size() - posn;
+        if (len > 64)
+            len = 64;
+        if (modelBaud) {
+            unsigned long long now = currentMicros();
+            if (txClock < now)
+                txClock = now;
+            txClock += byteTime(len);
+            sleepUntil(txClock);
+        }
+        writeAll(output.data() + posn, len);
+        posn += len;
+    }
+    output.clear();
+}
+
+void EmuLink::writeAll(const char *data, size_t len)
+{
+    while (len > 0 && !_hungUp) {
+        ssize_t written = ::write(fd, data, len);
+        if (written > 0) {
+            data += written;
+            len -= (size_t)written;
+        } else if (written < 0 && errno == EAGAIN) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            ::poll(&pfd, 1, 100);
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else {
+            _hungUp = true;
+        }
+    }
+}
+
+// Accounts for time spent talking to the device.  Short delays are
+// accumulated so that we aren't sleeping for a few microseconds at a time.
+void EmuLink::busy(unsigned long micros)
+{
+    busyDebt += micros;
+    if (busyDebt >= 1000) {
+        flush();
+        sleepMicros(busyDebt);
+        busyDebt = 0;
+    }
+}
+
+// Parses a hexadecimal value the same way as the sketches do.
+static int parseHex(const char *args, unsigned long *value)
+{
+    int size = 0;
+    *value = 0;
+    for (;;) {
+        char ch = *args;
+        if (ch >= '0' && ch <= '9')
+            *value = (*value << 4) | (ch - '0');
+        else if (ch >= 'A' && ch <= 'F')
+            *value = (*value << 4) | (ch - 'A' + 10);
+        else if (ch >= 'a' && ch <= 'f')
+            *value = (*value << 4) | (ch - 'a' + 10);
+        else
+            break;
+        ++size;
+        ++args;
+    }
+    if (*args != '\0' && *args != '-' && *args != ' ' && *args != '\t')
+        return 0;
+    return size;
+}
+
+// Parse a range of addresses of the form START or START-END.
+static bool parseRange(const char *args, unsigned long *start, unsigned long *end)
+{
+    int size = parseHex(args, start);
+    if (!size)
+        return false;
+    args += size;
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (*args != '-') {
+        *end = *start;
+        return true;
+    }
+    ++args;
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    if (!parseHex(args, end))
+        return false;
+    return *end >= *start;
+}
+
+// Case-insensitive match of "str", which is "len" characters long.
+static bool matchString(const char *name, const char *str, int len)
+{
+    return (int)strlen(name) == len && strncasecmp(name, str, len) == 0;
+}
+
+// Returns the length of the first word in "args".
+static int wordLength(const char *args)
+{
+    int len = 0;
+    while (args[len] != '\0' && args[len] != ' ' && args[len] != '\t')
+        ++len;
+    return len;
+}
+
+static const char *skipWhiteSpace(const char *args)
+{
+    while (*args == ' ' || *args == '\t')
+        ++args;
+    return args;
+}
+
+// Skips over a range of addresses of the form START or START-END.
+static const char *skipRange(const char *args)
+{
+    unsigned long value;
+    args = skipWhiteSpace(args + parseHex(args, &value));
+    if (*args == '-') {
+        args = skipWhiteSpace(args + 1);
+        args = skipWhiteSpace(args + parseHex(args, &value));
+    }
+    return args;
+}
+
+// Incremented by SIGUSR1, which takes the device out of the programming
+// socket, or puts a new blank one in if the socket is empty.
+static volatile sig_atomic_t socketSwaps = 0;
+
+// Commands that are common to both sketches, and the device-specific
+// operations that they rely upon.
+class Emulator
+{
+public:
+    explicit Emulator(EmuLink *link);
+    virtual ~Emulator() {}
+
+    void setTiming(bool enable) { timing = enable; }
+    void setWriteDelay(long micros) { writeDelay = micros; }
+    void setRxBufferSize(int size) { rxBufferSize = size; }
+    void setBootDelay(int millis) { bootDelay = millis; }
+    void setVerbose(bool enable) { verbose = enable; }
+
+    void run();
+
+protected:
+    EmuLink *link;
+    bool forceOption;
+    bool socketEmpty;
+
+    void charge(unsigned long micros);
+    void writeCycle(unsigned long micros);
+    unsigned long long cycleEnd(unsigned long micros) const;
+    void waitUntil(unsigned long long when);
+    void keepAlive();
+
+    virtual void resetDevice() = 0;
+    virtual void insertDevice() = 0;
+    virtual void cmdDevice() = 0;
+    virtual void cmdDevices() = 0;
+    virtual void cmdSetDevice(const char *name, int len) = 0;
+    virtual bool findLimit(unsigned long addr, unsigned long *limit) = 0;
+    virtual bool startRead(unsigned long addr) { return true; }
+    virtual unsigned int readWord(unsigned long addr) = 0;
+    virtual void startWrite(unsigned long addr) {}
+    virtual bool writeWord(unsigned long addr, unsigned int word, bool force) = 0;
+    virtual unsigned int verifyMask(unsigned long addr, bool force) { return 0xFFFF; }
+    virtual unsigned int rowSize(unsigned long addr) { return 1; }
+    virtual void writeRow(unsigned long addr, const std::vector<unsigned int> &words) {}
+    virtual void stopWrite() {}
+    virtual bool doubleBuffered() { return false; }
+    virtual bool erase(bool preserve) = 0;
+    virtual void cmdSockets(const char *args) { link->println("NOTSUPPORTED"); }
+    virtual void cmdPages() { link->println("NOTSUPPORTED"); }
+    virtual void powerOff() {}
+
+private:
+    bool timing;
+    long writeDelay;
+    int rxBufferSize;
+    int bootDelay;
+    bool verbose;
+    unsigned long long deviceTime;
+    unsigned long long pendingTime;
+    unsigned long overflows;
+    sig_atomic_t swapsSeen;
+
+    // Rows that WRITEBIN is collecting, and the words that have been
+    // written since the first row, which are read back at the end.
+    std::vector<unsigned int> row;
+    unsigned long rowStart;
+    std::vector<unsigned int> unverified;
+    unsigned long verifyStart;
+
+    void checkSocket();
+    void processCommand(const char *buf);
+    bool parseCheckedRange(const char *args, unsigned long *start, unsigned long *end);
+    void parseOptions(const char **args, bool *force, bool *window, bool *rle = 0);
+    void checkOverflow(size_t extra = 0);
+
+    void cmdHelp();
+    void cmdRead(const char *args);
+    void sendRun(char *packet, size_t *offset, unsigned int word, unsigned int count);
+    void flushPacket(char *packet, size_t *offset);
+    void cmdReadBinary(const char *args);
+    void cmdChecksum(const char *args);
+    void cmdWrite(const char *args);
+    bool queueWord(unsigned long addr, unsigned int word, bool force);
+    bool writeSingle(unsigned long addr, unsigned int word, bool force);
+    bool flushRow(bool force);
+    bool verifyRows();
+    bool ackPacket(bool window, bool failed, unsigned char seq);
+    void cmdWriteBinary(const char *args);
+    void cmdVerifyBinary(const char *args);
+    void cmdErase(const char *args);
+    void cmdSpeed(const char *args);
+};
+
+Emulator::Emulator(EmuLink *link)
+    : link(link)
+    , forceOption(false)
+    , socketEmpty(false)
+    , timing(false)
+    , writeDelay(-1)
+    , rxBufferSize(63)
+    , bootDelay(0)
+    , verbose(false)
+    , deviceTime(0)
+    , pendingTime(0)
+    , overflows(0)
+    , swapsSeen(0)
+    , rowStart(0)
+    , verifyStart(0)
+{
+}
+
+// Accounts for time spent talking to the device.
+void Emulator::charge(unsigned long micros)
+{
+    if (timing) {
+        link->busy(micros);
+        deviceTime += micros;
+    }
+}
+
+// Accounts for a write cycle on the device, which "--write-delay"
+// overrides with a fixed time.
+void Emulator::writeCycle(unsigned long micros)
+{
+    waitUntil(cycleEnd(micros));
+}
+
+// Returns when a write cycle that starts now will be finished, for
+// devices that can be doing something else in the meantime.
+unsigned long long Emulator::cycleEnd(unsigned long micros) const
+{
+    if (writeDelay >= 0)
+        return deviceTime + (unsigned long)writeDelay;
+    else if (timing)
+        return deviceTime + micros;
+    else
+        return deviceTime;
+}
+
+// Waits until a time that was returned by cycleEnd().
+void Emulator::waitUntil(unsigned long long when)
+{
+    if (when > deviceTime) {
+        link->busy((unsigned long)(when - deviceTime));
+        deviceTime = when;
+    }
+}
+
+// Sends "PENDING" every 2 seconds during a long-running command.
+void Emulator::keepAlive()
+{
+    unsigned long long now = currentMicros();
+    if ((now - pendingTime) >= 2000000ULL) {
+        link->println("PENDING");
+        link->flush();
+        pendingTime = now;
+    }
+}
+
+void Emulator::run()
+{
+    char buffer[COMMAND_MAX + 1];
+    int buflen = 0;
+    for (;;) {
+        if (link->hungUp()) {
+            // Wait for the host to open the port, and then behave like an
+            // Arduino that has just been reset by the DTR line.
+            link->waitForHost();
+            if (bootDelay > 0) {
+                // The bootloader swallows anything that is sent to it.
+                sleepMicros(bootDelay * 1000ULL);
+                link->truncateInput(0);
+            }
+            resetDevice();
+            buflen = 0;
+            if (verbose)
+                fprintf(stderr, "host connected\n");
+        }
+        int ch = link->read(-1);
+        if (ch == -1) {
+            if (verbose && link->hungUp())
+                fprintf(stderr, "host disconnected\n");
+            continue;
+        } else if (ch == 0x0A || ch == 0x0D) {
+            // End of the current command.  Blank lines are ignored.
+            if (buflen > 0) {
+                buffer[buflen] = '\0';
+                buflen = 0;
+                if (verbose)
+                    fprintf(stderr, "> %s\n", buffer);
+                processCommand(buffer);
+                link->flush();
+            }
+        } else if (ch == 0x08) {
+            // Backspace over the last character.
+            if (buflen > 0)
+                --buflen;
+        } else if (buflen < COMMAND_MAX) {
+            // Add the character to the buffer after forcing to upper case.
+            if (ch >= 'a' && ch <= 'z')
+                buffer[buflen++] = ch - 'a' + 'A';
+            else
+                buffer[buflen++] = ch;
+        }
+    }
+}
+
+// Applies any device swaps that have been requested with SIGUSR1.
+void Emulator::checkSocket()
+{
+    while (swapsSeen != socketSwaps) {
+        ++swapsSeen;
+        socketEmpty = !socketEmpty;
+        if (!socketEmpty)
+            insertDevice();
+        if (verbose)
+            fprintf(stderr, socketEmpty ? "device removed\n" : "device inserted\n");
+    }
+}
+
+void Emulator::processCommand(const char *buf)
+{
+    buf = skipWhiteSpace(buf);
+    if (*buf == '\0')
+        return;     // Ignore blank lines.
+    checkSocket();
+    const char *cmd = buf;
+    int len = wordLength(cmd);
+    const char *args = skipWhiteSpace(buf + len);
+    if (matchString("READ", cmd, len))
+        cmdRead(args);
+    else if (matchString("READBIN", cmd, len))
+        cmdReadBinary(args);
+    else if (matchString("CHECKSUM", cmd, len))
+        cmdChecksum(args);
+    else if (matchString("WRITE", cmd, len))
+        cmdWrite(args);
+    else if (matchString("WRITEBIN", cmd, len))
+        cmdWriteBinary(args);
+    else if (matchString("VERIFYBIN", cmd, len))
+        cmdVerifyBinary(args);
+    else if (matchString("ERASE", cmd, len))
+        cmdErase(args);
+    else if (matchString("DEVICE", cmd, len))
+        cmdDevice();
+    else if (matchString("DEVICES", cmd, len))
+        cmdDevices();
+    else if (matchString("SETDEVICE", cmd, len))
+        cmdSetDevice(args, wordLength(args));
+    else if (matchString("SOCKETS", cmd, len))
+        cmdSockets(args);
+    else if (matchString("PAGES", cmd, len))
+        cmdPages();
+    else if (matchString("PWROFF", cmd, len)) {
+        powerOff();
+        link->println("OK");
+    } else if (matchString("PROGRAM_PIC_VERSION", cmd, len))
+        link->println("ProgramPIC 1.6");
+    else if (matchString("SPEED", cmd, len))
+        cmdSpeed(args);
+    else if (matchString("HELP", cmd, len))
+        cmdHelp();
+    else
+        link->println("NOTSUPPORTED");
+}
+
+void Emulator::cmdHelp()
+{
+    link->println("OK");
+    link->println("READ STARTADDR[-ENDADDR]");
+    link->println("    Reads program and data words from device memory (text)");
+    link->println("READBIN [RLE] STARTADDR[-ENDADDR]");
+    link->println("    Reads program and data words from device memory (binary)");
+    link->println("CHECKSUM STARTADDR-ENDADDR [BLOCKSIZE]");
+    link->println("    Returns the CRC-32 of program and data words in device memory");
+    link->println("WRITE STARTADDR WORD [WORD ...]");
+    link->println("    Writes program and data words to device memory (text)");
+    link->println("WRITEBIN STARTADDR");
+    link->println("    Writes program and data words to device memory (binary)");
+    link->println("VERIFYBIN [FORCE] STARTADDR");
+    link->println("    Compares program and data words with device memory (binary)");
+    link->println("ERASE");
+    link->println("    Erases the contents of program, configuration, and data memory");
+    link->println("DEVICE");
+    link->println("    Probes the device and returns information about it");
+    link->println("DEVICES");
+    link->println("    Returns a list of all supported device types");
+    link->println("SETDEVICE DEVTYPE");
+    link->println("    Sets a specific device type manually");
+    link->println("PWROFF");
+    link->println("    Powers off the device in the programming socket");
+    link->println("PROGRAM_PIC_VERSION");
+    link->println("    Prints the version of ProgramPIC");
+    link->println("SPEED BAUD");
+    link->println("    Changes the speed of the serial link to the host");
+    link->println("HELP");
+    link->println("    Prints this help message");
+    link->println(".");
+}
+
+bool Emulator::parseCheckedRange(const char *args, unsigned long *start, unsigned long *end)
+{
+    // Both ends must be within the same memory area.
+    unsigned long limit;
+    if (!parseRange(args, start, end))
+        return false;
+    return findLimit(*start, &limit) && *end <= limit;
+}
+
+// READ command.
+void Emulator::cmdRead(const char *args)
+{
+    unsigned long start;
+    unsigned long end;
+    if (!parseCheckedRange(args, &start, &end) || !startRead(start)) {
+        link->println("ERROR");
+        return;
+    }
+    link->println("OK");
+    int count = 0;
+    while (start <= end) {
+        unsigned int word = readWord(start);
+        if (count > 0)
+            link->print((count % 8) == 0 ? "\r\n" : " ");
+        link->printf("%04X", word);
+        ++start;
+        ++count;
+    }
+    link->println("");
+    link->println(".");
+}
+
+// Sends "count" copies of "word" during READBIN, as a single run packet
+// if the run is long enough or as literal words otherwise.
+void Emulator::sendRun(char *packet, size_t *offset, unsigned int word, unsigned int count)
+{
+    if (count >= RLE_RUN_MIN) {
+        flushPacket(packet, offset);
+        char run[5];
+        run[0] = (char)RLE_RUN;
+        run[1] = (char)count;
+        run[2] = (char)(count >> 8);
+        run[3] = (char)word;
+        run[4] = (char)(word >> 8);
+        link->write(run, sizeof(run));
+        return;
+    }
+    while (count-- > 0) {
+        packet[++(*offset)] = (char)word;
+        packet[++(*offset)] = (char)(word >> 8);
+        if (*offset >= BINARY_TRANSFER_MAX)
+            flushPacket(packet, offset);
+    }
+}
+
+void Emulator::flushPacket(char *packet, size_t *offset)
+{
+    if (*offset > 0) {
+        packet[0] = (char)(*offset);
+        link->write(packet, *offset + 1);
+        *offset = 0;
+    }
+}
+
+// READBIN command.  With "RLE", runs of identical words are sent as
+// run packets: 0x80, then the count and the word, low byte first.
+void Emulator::cmdReadBinary(const char *args)
+{
+    unsigned long start;
+    unsigned long end;
+    int len = wordLength(args);
+    bool rle = matchString("RLE", args, len);
+    if (rle)
+        args = skipWhiteSpace(args + len);
+    if (!parseCheckedRange(args, &start, &end) || !startRead(start)) {
+        link->println("ERROR");
+        return;
+    }
+    link->println("OK");
+    char packet[BINARY_TRANSFER_MAX + 1];
+    size_t offset = 0;
+    unsigned int runWord = 0;
+    unsigned int runCount = 0;
+    unsigned int runMax = rle ? RLE_RUN_MAX : 1;
+    while (start <= end) {
+        unsigned int word = readWord(start);
+        if (runCount > 0 && (word != runWord || runCount >= runMax)) {
+            sendRun(packet, &offset, runWord, runCount);
+            runCount = 0;
+        }
+        runWord = word;
+        ++runCount;
+        ++start;
+    }
+    if (runCount > 0)
+        sendRun(packet, &offset, runWord, runCount);
+    flushPacket(packet, &offset);
+    link->write("", 1);     // Terminator (a zero-length packet).
+}
+
+// Adds a byte to a CRC-32 (IEEE 802.3) checksum.
+static unsigned long crc32Update(unsigned long crc, unsigned char value)
+{
+    crc ^= value;
+    for (int bit = 0; bit < 8; ++bit) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ 0xEDB88320UL;
+        else
+            crc >>= 1;
+    }
+    return crc;
+}
+
+// CHECKSUM command.
+void Emulator::cmdChecksum(const char *args)
+{
+    unsigned long start;
+    unsigned long end;
+    unsigned long blockSize = 0;
+    if (!parseCheckedRange(args, &start, &end)) {
+        link->println("ERROR");
+        return;
+    }
+    args = skipRange(args);
+    if ((*args != '\0' && (!parseHex(args, &blockSize) || !blockSize)) ||
+            !startRead(start)) {
+        link->println("ERROR");
+        return;
+    }
+    if (blockSize)
+        link->println("OK");
+    unsigned long crc = 0xFFFFFFFFUL;
+    pendingTime = currentMicros();
+    while (start <= end) {
+        unsigned int word = readWord(start);
+        crc = crc32Update(crc, (unsigned char)word);
+        crc = crc32Update(crc, (unsigned char)(word >> 8));
+        if (blockSize && (start == end || ((start + 1) % blockSize) == 0)) {
+            link->printf("%08lX\r\n", crc ^ 0xFFFFFFFFUL);
+            crc = 0xFFFFFFFFUL;
+        }
+        ++start;
+        keepAlive();
+    }
+    if (blockSize)
+        link->println(".");
+    else
+        link->printf("OK %08lX\r\n", crc ^ 0xFFFFFFFFUL);
+}
+
+// Parses the "FORCE" and "WINDOW" options to WRITE and WRITEBIN.
+void Emulator::parseOptions(const char **args, bool *force, bool *window, bool *rle)
+{
+    *force = false;
+    if (window)
+        *window = false;
+    if (rle)
+        *rle = false;
+    for (;;) {
+        int len = wordLength(*args);
+        if (forceOption && matchString("FORCE", *args, len))
+            *force = true;
+        else if (window && matchString("WINDOW", *args, len))
+            *window = true;
+        else if (rle && matchString("RLE", *args, len))
+            *rle = true;
+        else
+            break;
+        *args = skipWhiteSpace(*args + len);
+    }
+}
+
+// WRITE command.
+void Emulator::cmdWrite(const char *args)
+{
+    unsigned long addr;
+    unsigned long limit;
+    unsigned long value;
+    bool force;
+    parseOptions(&args, &force, 0);
+    int size = parseHex(args, &addr);
+    if (!size || !findLimit(addr, &limit)) {
+        link->println("ERROR");
+        return;
+    }
+    args += size;
+    startWrite(addr);
+    int count = 0;
+    bool ok = true;
+    for (;;) {
+        args = skipWhiteSpace(args);
+        if (*args == '\0')
+            break;
+        size = (*args == '-') ? 0 : parseHex(args, &value);
+        if (!size || addr > limit || !writeWord(addr, (unsigned int)value, force)) {
+            ok = false;
+            break;
+        }
+        args += size;
+        ++addr;
+        ++count;
+    }
+    stopWrite();
+    link->println(ok && count > 0 ? "OK" : "ERROR");
+}
+
+// Reports the bytes that the host has sent beyond what the receive
+// buffer on a real Arduino could hold, and drops them as it would.
+void Emulator::checkOverflow(size_t extra)
+{
+    link->flush();
+    size_t queued = link->available();
+    size_t allowed = (size_t)rxBufferSize + extra;
+    if (queued > allowed) {
+        ++overflows;
+        fprintf(stderr, "receive buffer overflow: %lu bytes queued, "
+                        "%lu allowed (%lu overflows)\n",
+                (unsigned long)queued, (unsigned long)allowed, overflows);
+        link->truncateInput(allowed);
+    }
+}
+
+// Writes a word during WRITEBIN the same way as the sketch's queueWord(),
+// collecting aligned rows of program words on devices that support them.
+bool Emulator::queueWord(unsigned long addr, unsigned int word, bool force)
+{
+    unsigned int size = rowSize(addr);
+    if (size > 1 && (!row.empty() || (addr % size) == 0)) {
+        if (row.empty())
+            rowStart = addr;
+        row.push_back(word & 0x3FFF);
+        if (row.size() >= size) {
+            writeRow(rowStart, row);
+            if (unverified.empty())
+                verifyStart = rowStart;
+            unverified.insert(unverified.end(), row.begin(), row.end());
+            row.clear();
+        }
+        return true;
+    }
+    return writeSingle(addr, word, force);
+}
+
+// Writes a single word and reads it back immediately.
+bool Emulator::writeSingle(unsigned long addr, unsigned int word, bool force)
+{
+    if (!unverified.empty() && rowSize(addr) > 1)
+        unverified.push_back(word & 0x3FFF);
+    return writeWord(addr, word, force);
+}
+
+// Writes the words of a partial row one at a time.
+bool Emulator::flushRow(bool force)
+{
+    std::vector<unsigned int> words;
+    words.swap(row);
+    for (size_t index = 0; index < words.size(); ++index) {
+        if (!writeSingle(rowStart + index, words[index], force))
+            return false;
+    }
+    return true;
+}
+
+// Reads back the words that were written since the first row.
+bool Emulator::verifyRows()
+{
+    bool ok = true;
+    pendingTime = currentMicros();
+    for (size_t index = 0; index < unverified.size(); ++index) {
+        if (readWord(verifyStart + index) != unverified[index])
+            ok = false;
+        keepAlive();
+    }
+    unverified.clear();
+    return ok;
+}
+
+// Responds to a WRITEBIN packet.  Returns false if the command should
+// stop because the host will not send any more packets.
+bool Emulator::ackPacket(bool window, bool failed, unsigned char seq)
+{
+    if (window) {
+        link->printf("%s %02X\r\n", failed ? "ERROR" : "OK", seq);
+    } else if (failed) {
+        link->println("ERROR");
+        return false;
+    } else {
+        link->println("OK");
+    }
+    link->flush();
+    return true;
+}
+
+// WRITEBIN command.
+void Emulator::cmdWriteBinary(const char *args)
+{
+    unsigned long addr;
+    unsigned long limit;
+    bool force, window, rle;
+    parseOptions(&args, &force, &window, &rle);
+    int size = parseHex(args, &addr);
+    if (!size || !findLimit(addr, &limit)) {
+        link->println("ERROR");
+        return;
+    }
+    startWrite(addr);
+    row.clear();
+    unverified.clear();
+    if (window)
+        link->printf("OK %04X\r\n", rxBufferSize);
+    else
+        link->println("OK");
+    bool first = true;
+    bool failed = false;
+    bool reported = false;
+    unsigned char seq = 0;
+    unsigned char buffer[BINARY_TRANSFER_MAX];
+    for (;;) {
+        // Read in the next binary packet.  The sketch waits forever,
+        // but we give up if the host goes away.
+        int len = link->read(-1);
+        while (len == 0x0A && first)
+            len = link->read(-1);
+        first = false;
+        if (len <= 0)
+            break;
+        bool compressed = (rle && (len & 0x80) != 0);
+        if (compressed)
+            len &= 0x7F;
+        unsigned char pktseq = seq;
+        if (window)
+            pktseq = (unsigned char)link->read(-1);
+        for (int offset = 0; offset < len; ++offset) {
+            int ch = link->read(-1);
+            if (offset < BINARY_TRANSFER_MAX)
+                buffer[offset] = (unsigned char)ch;
+        }
+        if (link->hungUp())
+            return;
+        if (failed && reported)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+        if (compressed && len > BINARY_TRANSFER_MAX)
+            failed = true;      // Compressed packet too long to decode.
+
+        // ProgramPIC acknowledges a packet before writing it, and reports
+        // a failure to write the previous packet in the acknowledgement.
+        bool early = doubleBuffered();
+        if (early) {
+            if (!ackPacket(window, failed, pktseq))
+                return;
+            ++seq;
+            reported = failed;
+            if (failed)
+                continue;
+        }
+
+        // Write the words to memory.
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+        int posn = 0;
+        while (!failed && posn < len) {
+            // Compressed packets are made of 0x00-0x7F followed by 1 to
+            // 128 literal words, or 0x80-0xFF and a word to repeat.
+            // An opcode that runs past the end of the packet fails, but
+            // an odd trailing byte in a plain packet is ignored.
+            unsigned int repeat = 1;
+            bool fill = false;
+            unsigned int value = 0;
+            if (compressed) {
+                repeat = (buffer[posn] & 0x7F) + 1;
+                fill = ((buffer[posn] & 0x80) != 0);
+                ++posn;
+            } else if (posn >= (len - 1)) {
+                break;
+            }
+            if (fill) {
+                if (posn >= (len - 1)) {
+                    failed = true;
+                    break;
+                }
+                value = buffer[posn] | (buffer[posn + 1] << 8);
+                posn += 2;
+            }
+            while (repeat > 0 && !failed) {
+                if (!fill) {
+                    if (posn >= (len - 1)) {
+                        failed = true;
+                        break;
+                    }
+                    value = buffer[posn] | (buffer[posn + 1] << 8);
+                    posn += 2;
+                }
+                --repeat;
+                if (addr > limit || !queueWord(addr, value, force))
+                    failed = true;
+                else
+                    ++addr;
+            }
+        }
+        if (failed)
+            stopWrite();
+
+        // The next packet goes into ProgramPIC's second buffer while
+        // this one is written, so it does not count against the window.
+        checkOverflow(early ? BINARY_TRANSFER_MAX + 2 : 0);
+        if (!early) {
+            if (!ackPacket(window, failed, pktseq))
+                return;
+            ++seq;
+            reported = failed;
+        }
+    }
+    if (!failed && (!flushRow(force) || !verifyRows()))
+        failed = true;
+    if (!failed)
+        stopWrite();
+    link->println(failed ? "ERROR" : "OK");
+}
+
+// VERIFYBIN command.  Packets are always sent as for "WRITEBIN WINDOW".
+void Emulator::cmdVerifyBinary(const char *args)
+{
+    unsigned long addr;
+    unsigned long limit;
+    bool force;
+    parseOptions(&args, &force, 0);
+    int size = parseHex(args, &addr);
+    if (!size || !findLimit(addr, &limit)) {
+        link->println("ERROR");
+        return;
+    }
+    link->printf("OK %04X\r\n", rxBufferSize);
+    bool first = true;
+    bool failed = false;
+    bool mismatch = false;
+    unsigned char seq = 0;
+    unsigned char buffer[BINARY_TRANSFER_MAX];
+    for (;;) {
+        int len = link->read(-1);
+        while (len == 0x0A && first)
+            len = link->read(-1);
+        first = false;
+        if (len <= 0)
+            break;
+        unsigned char pktseq = (unsigned char)link->read(-1);
+        for (int offset = 0; offset < len; ++offset) {
+            int ch = link->read(-1);
+            if (offset < BINARY_TRANSFER_MAX)
+                buffer[offset] = (unsigned char)ch;
+        }
+        if (link->hungUp())
+            return;
+        if (failed)
+            continue;
+        if (pktseq != seq)
+            failed = true;      // Lost or garbled packet.
+        if (len > BINARY_TRANSFER_MAX)
+            len = BINARY_TRANSFER_MAX;
+        if (!failed && len > 1 && addr <= limit && !startRead(addr))
+            failed = true;
+
+        // Compare the words with memory, listing the ones that differ.
+        bool reported = false;
+        for (int posn = 0; posn < (len - 1) && !failed; posn += 2) {
+            if (addr > limit) {
+                failed = true;
+                break;
+            }
+            unsigned int value = buffer[posn] | (buffer[posn + 1] << 8);
+            unsigned int actual = readWord(addr);
+            if (((value ^ actual) & verifyMask(addr, force)) != 0) {
+                if (!reported)
+                    link->printf("MISMATCH %02X", pktseq);
+                link->printf(" %04lX:%04X", addr, actual);
+                reported = true;
+                mismatch = true;
+            }
+            ++addr;
+        }
+        checkOverflow();
+        if (reported)
+            link->println("");
+        if (failed || !reported)
+            link->printf("%s %02X\r\n", failed ? "ERROR" : "OK", pktseq);
+        link->flush();
+        ++seq;
+    }
+    link->println((failed || mismatch) ? "ERROR" : "OK");
+}
+
+// ERASE command.
+void Emulator::cmdErase(const char *args)
+{
+    bool preserve = !matchString("NOPRESERVE", args, wordLength(args));
+    pendingTime = currentMicros();
+    link->println(erase(preserve) ? "OK" : "ERROR");
+}
+
+// SPEED command.  The pseudo-terminal doesn't care about the speed,
+// but the handshake is the same as the sketches and the new speed is
+// used if the baud rate is being modelled.
+void Emulator::cmdSpeed(const char *args)
+{
+    static const int speeds[] = {
+        9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000, 0
+    };
+    int speed = 0;
+    while (*args >= '0' && *args <= '9')
+        speed = speed * 10 + (*args++ - '0');
+    if (*skipWhiteSpace(args) != '\0') {
+        link->println("ERROR");
+        return;
+    }
+    int index = 0;
+    while (speeds[index] != 0 && speeds[index] != speed)
+        ++index;
+    if (!speeds[index]) {
+        link->println("ERROR");
+        return;
+    }
+    link->println("OK");
+    int oldSpeed = link->speed();
+    link->setSpeed(speed);
+
+    // Wait for the host to confirm the new speed.
+    unsigned long long deadline =
+        currentMicros() + SPEED_CONFIRM_TIMEOUT * 1000ULL;
+    std::string line;
+    bool confirmed = false;
+    for (;;) {
+        unsigned long long now = currentMicros();
+        if (now >= deadline)
+            break;
+        int ch = link->read((int)((deadline - now + 999) / 1000));
+        if (ch == -1)
+            break;
+        if (ch == 0x0A || ch == 0x0D) {
+            if (line.empty())
+                continue;
+            confirmed = matchString("PROGRAM_PIC_VERSION", line.data(), line.size());
+            break;
+        } else if (line.size() < COMMAND_MAX) {
+            line += (char)ch;
+        }
+    }
+    if (confirmed)
+        link->println("ProgramPIC 1.6");
+    else
+        link->setSpeed(oldSpeed);
+}
+
+// Emulates ProgramPIC with a blank PIC in the programming socket.
+class PicEmulator : public Emulator
+{
+public:
+    PicEmulator(EmuLink *link, const PicDeviceInfo *chip);
+
+protected:
+    void resetDevice();
+    void insertDevice();
+    void cmdDevice();
+    void cmdDevices();
+    void cmdSetDevice(const char *name, int len);
+    bool findLimit(unsigned long addr, unsigned long *limit);
+    unsigned int readWord(unsigned long addr);
+    bool writeWord(unsigned long addr, unsigned int word, bool force);
+    unsigned int verifyMask(unsigned long addr, bool force);
+    unsigned int rowSize(unsigned long addr);
+    void writeRow(unsigned long addr, const std::vector<unsigned int> &words);
+    bool doubleBuffered() { return true; }
+    bool erase(bool preserve);
+    void powerOff() { powered = false; }
+
+private:
+    enum Area { Program, Config, Data };
+
+    // The device that is actually in the socket.
+    const PicDeviceInfo *chip;
+    std::vector<unsigned int> program;
+    std::vector<unsigned int> config;
+    std::vector<unsigned int> data;
+
+    // The sketch's idea of what is in the socket.
+    unsigned long programEnd;
+    unsigned long configStart;
+    unsigned long configEnd;
+    unsigned long dataStart;
+    unsigned long dataEnd;
+    unsigned long reservedStart;
+    unsigned long reservedEnd;
+    unsigned int configSave;
+    int progFlashType;
+    int dataFlashType;
+    unsigned int progTime;
+    unsigned int dataTime;
+    unsigned int eraseTime;
+    unsigned int progRowSize;
+
+    // Programming mode state, for working out ICSP costs.
+    bool powered;
+    Area area;
+    unsigned long pc;
+
+    void initDevice(const PicDeviceInfo *dev);
+    void blank();
+    unsigned int *locate(unsigned long addr, Area *area);
+    void setPC(Area newArea, unsigned long addr);
+    void beginProgramCycle(bool isData);
+};
+
+PicEmulator::PicEmulator(EmuLink *link, const PicDeviceInfo *chip)
+    : Emulator(link)
+    , chip(chip)
+    , program(chip->programSize)
+    , config(chip->configSize)
+    , data(chip->dataSize)
+    , powered(false)
+    , area(Program)
+    , pc(0)
+{
+    forceOption = true;
+    insertDevice();
+    resetDevice();
+}
+
+// Puts a new device in the socket, with factory calibration words.
+void PicEmulator::insertDevice()
+{
+    blank();
+    for (unsigned int index = 0; index < chip->reservedWords; ++index)
+        program[chip->programSize - 1 - index] = RESERVED_OSCCAL;
+}
+
+// Erases the device to its factory state, except for reserved words.
+void PicEmulator::blank()
+{
+    for (size_t index = 0; index < program.size(); ++index)
+        program[index] = 0x3FFF;
+    for (size_t index = 0; index < config.size(); ++index)
+        config[index] = 0x3FFF;
+    for (size_t index = 0; index < data.size(); ++index)
+        data[index] = 0x00FF;
+    if (chip->deviceId != -1)
+        config[DEV_ID] = (unsigned int)chip->deviceId | DEVICE_REVISION;
+}
+
+// Resets the sketch's device details to the PIC16F628A defaults.
+void PicEmulator::resetDevice()
+{
+    programEnd    = 0x07FF;
+    configStart   = 0x2000;
+    configEnd     = 0x2007;
+    dataStart     = 0x2100;
+    dataEnd       = 0x217F;
+    reservedStart = 0x0800;
+    reservedEnd   = 0x07FF;
+    configSave    = 0x0000;
+    progFlashType = FLASH4;
+    dataFlashType = EEPROM;
+    progTime      = DELAY_TPROG;
+    dataTime      = DELAY_TDPROG + DELAY_TERA;
+    eraseTime     = DELAY_TFULLERA;
+    progRowSize   = 1;
+    powered = false;
+}
+
+void PicEmulator::initDevice(const PicDeviceInfo *dev)
+{
+    programEnd = dev->programSize - 1;
+    configStart = dev->configStart;
+    configEnd = configStart + dev->configSize - 1;
+    dataStart = dev->dataStart;
+    dataEnd = dataStart + dev->dataSize - 1;
+    reservedStart = programEnd - dev->reservedWords + 1;
+    reservedEnd = programEnd;
+    configSave = dev->configSave;
+    progFlashType = dev->progFlashType;
+    dataFlashType = dev->dataFlashType;
+    progTime = dev->progTime;
+    dataTime = dev->dataTime;
+    eraseTime = dev->eraseTime;
+    progRowSize = dev->rowSize;
+
+    link->printf("DeviceName: %s\r\n", dev->name);
+    link->printf("ProgramRange: 0000-%04lX\r\n", programEnd);
+    link->printf("ConfigRange: %04lX-%04lX\r\n", configStart, configEnd);
+    if (configSave != 0)
+        link->printf("ConfigSave: %04X\r\n", configSave);
+    link->printf("DataRange: %04lX-%04lX\r\n", dataStart, dataEnd);
+    if (reservedStart <= reservedEnd)
+        link->printf("ReservedRange: %04lX-%04lX\r\n", reservedStart, reservedEnd);
+    link->printf("ProgramTime: %u\r\n", progTime);
+    link->printf("DataTime: %u\r\n", dataTime);
+    link->printf("EraseTime: %u\r\n", eraseTime);
+}
+
+void PicEmulator::cmdDevice()
+{
+    // Read the identifiers straight from config memory on the chip,
+    // as the sketch doesn't know where the device's ranges are yet.
+    powered = false;
+    setPC(Config, DEV_CONFIG_WORD);
+    charge(6 * ICSP_TRANSFER_US);
+    if (socketEmpty) {
+        // The lines float high with nothing in the socket.
+        link->println("ERROR");
+        return;
+    }
+    unsigned int deviceId = config[DEV_ID];
+    unsigned int configWord = config[DEV_CONFIG_WORD];
+    if (deviceId == 0 || deviceId == 0x3FFF) {
+        unsigned int word = config[DEV_USERID0] | config[DEV_USERID1] |
+                            config[DEV_USERID2] | config[DEV_USERID3] |
+                            configWord;
+        for (unsigned long addr = 0; !word && addr < 16; ++addr)
+            word |= program[addr];
+        if (!word) {
+            link->println("ERROR");
+            powered = false;
+            return;
+        }
+        deviceId = 0;
+    }
+    link->println("OK");
+    link->printf("DeviceID: %04X\r\n", deviceId);
+    const PicDeviceInfo *dev = picDevices;
+    while (dev->name && dev->deviceId != (int)(deviceId & 0xFFE0))
+        ++dev;
+    if (dev->name)
+        initDevice(dev);
+    else
+        resetDevice();
+    link->printf("ConfigWord: %04X\r\n", configWord);
+    link->println(".");
+    powered = false;
+}
+
+void PicEmulator::cmdDevices()
+{
+    link->println("OK");
+    for (int index = 0; picDevices[index].name; ++index) {
+        if (index > 0)
+            link->print((index % 6) == 0 ? ",\r\n" : ", ");
+        link->print(picDevices[index].name);
+        if (picDevices[index].deviceId != -1)
+            link->print("*");
+    }
+    link->println("");
+    link->println(".");
+}
+
+void PicEmulator::cmdSetDevice(const char *name, int len)
+{
+    for (const PicDeviceInfo *dev = picDevices; dev->name; ++dev) {
+        if (matchString(dev->name, name, len)) {
+            link->println("OK");
+            initDevice(dev);
+            link->println(".");
+            powered = false;
+            return;
+        }
+    }
+    link->println("ERROR");
+}
+
+bool PicEmulator::findLimit(unsigned long addr, unsigned long *limit)
+{
+    if (addr <= programEnd)
+        *limit = programEnd;
+    else if (addr >= configStart && addr <= configEnd)
+        *limit = configEnd;
+    else if (addr >= dataStart && addr <= dataEnd)
+        *limit = dataEnd;
+    else
+        return false;
+    return true;
+}
+
+// Finds the word on the chip that the sketch would access for a flat
+// address.  Program and data addresses wrap around like the device's
+// program counter does.  Returns null if there is no such config word.
+unsigned int *PicEmulator::locate(unsigned long addr, Area *area)
+{
+    if (addr >= dataStart && addr <= dataEnd) {
+        *area = Data;
+        return &(data[(addr - dataStart) % data.size()]);
+    } else if (addr >= configStart && addr <= configEnd) {
+        *area = Config;
+        addr -= configStart;
+        return addr < config.size() ? &(config[addr]) : 0;
+    } else {
+        *area = Program;
+        return &(program[addr % program.size()]);
+    }
+}
+
+// Accounts for the ICSP commands that the sketch's setPC() would send.
+void PicEmulator::setPC(Area newArea, unsigned long addr)
+{
+    if (!powered || newArea != area || addr < pc) {
+        // Reset the device to get back to the start of the area.
+        charge(2 * DELAY_SETTLE);
+        if (newArea == Config)
+            charge(ICSP_TRANSFER_US);
+        powered = true;
+        area = newArea;
+        pc = 0;
+    }
+    charge((addr - pc) * ICSP_COMMAND_US);
+    pc = addr;
+}
+
+void PicEmulator::beginProgramCycle(bool isData)
+{
+    unsigned int time = (isData ? dataTime : progTime);
+    switch (isData ? dataFlashType : progFlashType) {
+    case FLASH:
+    case EEPROM:
+    case FLASH4:
+        charge(ICSP_COMMAND_US);
+        writeCycle(time);
+        break;
+    case FLASH5:
+        charge(2 * ICSP_COMMAND_US);
+        writeCycle(time);
+        break;
+    }
+}
+
+unsigned int PicEmulator::readWord(unsigned long addr)
+{
+    Area wordArea;
+    unsigned int *word = locate(addr, &wordArea);
+    unsigned long base = 0;
+    if (wordArea == Data)
+        base = dataStart;
+    else if (wordArea == Config)
+        base = configStart;
+    setPC(wordArea, addr - base);
+    charge(ICSP_TRANSFER_US);
+    if (!word)
+        return 0x3FFF;
+    return wordArea == Data ? (*word & 0x00FF) : (*word & 0x3FFF);
+}
+
+// Bits that VERIFYBIN compares, which leaves out the bits in the
+// configuration word that writeWord() preserves.
+unsigned int PicEmulator::verifyMask(unsigned long addr, bool force)
+{
+    if (addr >= dataStart && addr <= dataEnd)
+        return 0x00FF;
+    else if (force || !configSave || addr != (configStart + DEV_CONFIG_WORD))
+        return 0x3FFF;
+    else
+        return 0x3FFF & ~configSave;
+}
+
+// Writes a word and checks it the same way as the sketch.  The reserved
+// and device ID words in config memory are read-only.
+bool PicEmulator::writeWord(unsigned long addr, unsigned int value, bool force)
+{
+    Area wordArea;
+    unsigned int *word = locate(addr, &wordArea);
+    bool readOnly = false;
+    if (wordArea == Data) {
+        value &= 0x00FF;
+        setPC(Data, addr - dataStart);
+    } else {
+        value &= 0x3FFF;
+        if (wordArea == Config) {
+            unsigned long offset = addr - configStart;
+            setPC(Config, offset);
+            readOnly = (offset >= 4 && offset <= DEV_ID);
+            if (!force && configSave && offset == DEV_CONFIG_WORD && word) {
+                // Preserve the calibration bits in the config word.
+                charge(ICSP_TRANSFER_US);
+                value = (*word & configSave) | (value & ~configSave);
+            }
+        } else {
+            setPC(Program, addr);
+        }
+    }
+    charge(2 * ICSP_TRANSFER_US);
+    beginProgramCycle(wordArea == Data);
+    if (!word)
+        return false;
+    if (!readOnly)
+        *word = value;
+    return *word == value;
+}
+
+// Program memory is written in rows on devices that can do it.
+unsigned int PicEmulator::rowSize(unsigned long addr)
+{
+    return addr <= programEnd ? progRowSize : 1;
+}
+
+// Loads a row of program words and programs them in one cycle,
+// without reading them back.
+void PicEmulator::writeRow(unsigned long addr, const std::vector<unsigned int> &words)
+{
+    for (size_t index = 0; index < words.size(); ++index) {
+        setPC(Program, addr + index);
+        charge(ICSP_TRANSFER_US);
+        program[(addr + index) % program.size()] = words[index];
+    }
+    beginProgramCycle(false);
+}
+
+bool PicEmulator::erase(bool preserve)
+{
+    // Save the reserved words and the calibration bits in the config word.
+    std::vector<unsigned int> reserved;
+    if (preserve && reservedStart <= reservedEnd) {
+        for (unsigned long addr = reservedStart; addr <= reservedEnd; ++addr)
+            reserved.push_back(readWord(addr));
+    }
+    unsigned int configWord = 0x3FFF;
+    if (configSave != 0 && preserve) {
+        configWord &= ~configSave;
+        configWord |= readWord(configStart + DEV_CONFIG_WORD) & configSave;
+    }
+
+    // Bulk erase everything, including the reserved words.
+    powered = false;
+    setPC(Config, 0);
+    switch (progFlashType) {
+    case FLASH4:
+        charge(2 * ICSP_COMMAND_US + DELAY_TERA);
+        break;
+    case FLASH5:
+        charge(ICSP_COMMAND_US);
+        break;
+    default:
+        charge(14 * ICSP_COMMAND_US + DELAY_TFULL84 + ICSP_TRANSFER_US);
+        break;
+    }
+    charge(eraseTime);
+    blank();
+    powered = false;
+
+    // Write the reserved words back and force the config words.
+    bool ok = true;
+    unsigned long addr = reservedStart;
+    for (size_t index = 0; index < reserved.size(); ++index, ++addr) {
+        if (!writeWord(addr, reserved[index], false))
+            ok = false;
+    }
+    if (!ok)
+        return false;
+    for (addr = configStart + DEV_CONFIG_WORD; addr <= configEnd; ++addr)
+        writeWord(addr, configWord, true);
+    return true;
+}
+
+// Emulates ProgramEEPROM with a blank 24LCxx EEPROM in the socket, or
+// several of them on the same bus with "--sockets".
+class EepromEmulator : public Emulator
+{
+public:
+    EepromEmulator(EmuLink *link, const EepromDeviceInfo *chip, bool twi,
+                   unsigned int chips);
+
+protected:
+    void resetDevice();
+    void insertDevice();
+    void cmdDevice();
+    void cmdDevices();
+    void cmdSetDevice(const char *name, int len);
+    bool findLimit(unsigned long addr, unsigned long *limit);
+    bool startRead(unsigned long addr);
+    unsigned int readWord(unsigned long addr);
+    void startWrite(unsigned long addr);
+    bool writeWord(unsigned long addr, unsigned int word, bool force);
+    void stopWrite();
+    bool erase(bool preserve);
+    void cmdSockets(const char *args);
+    void cmdPages();
+
+private:
+    // The devices that are actually in the sockets, and when each one
+    // will finish the write cycle that it is busy with.
+    const EepromDeviceInfo *chip;
+    std::vector< std::vector<unsigned char> > memory;
+    std::vector<unsigned long long> readyAt;
+    unsigned int socketsBusy;
+
+    // The sketch's idea of what is in the socket.
+    const EepromDeviceInfo *current;
+    unsigned long eepromEnd;
+
+    // Sockets that the sketch writes to and reads from.
+    unsigned int socketCount;
+    unsigned int readSocket;
+
+    // Time to send one byte on the I2C bus, which is much shorter if
+    // the sketch is using the TWI peripheral.
+    bool twi;
+    unsigned long byteTime;
+
+    // State of the current bulk write, and the page that is collected
+    // before it is written.
+    unsigned long writeByteAddr;
+    std::vector<unsigned char> page;
+
+    // Pages written, and skipped because they were unchanged.
+    unsigned long pagesWritten;
+    unsigned long pagesSkipped;
+
+    void initDevice(const EepromDeviceInfo *dev);
+    void printDeviceInfo();
+    bool pageMatches(unsigned int socket, unsigned long byteAddr);
+    void writeSockets(unsigned long byteAddr);
+    void waitForSockets();
+    void writeByte(unsigned char value);
+};
+
+EepromEmulator::EepromEmulator(EmuLink *link, const EepromDeviceInfo *chip,
+                               bool twi, unsigned int chips)
+    : Emulator(link)
+    , chip(chip)
+    , memory(chips, std::vector<unsigned char>(chip->size, 0xFF))
+    , readyAt(chips, 0)
+    , socketsBusy(0)
+    , twi(twi)
+    , byteTime(I2C_BYTE_US)
+    , writeByteAddr(0)
+    , pagesWritten(0)
+    , pagesSkipped(0)
+{
+    resetDevice();
+}
+
+void EepromEmulator::resetDevice()
+{
+    initDevice(&(eepromDevices[EEPROM_DEFAULT]));
+}
+
+void EepromEmulator::insertDevice()
+{
+    for (size_t index = 0; index < memory.size(); ++index)
+        memory[index].assign(chip->size, 0xFF);
+}
+
+void EepromEmulator::initDevice(const EepromDeviceInfo *dev)
+{
+    current = dev;
+    eepromEnd = (dev->size / 2) - 1;
+    socketCount = 1;
+    readSocket = 0;
+    pagesWritten = 0;
+    pagesSkipped = 0;
+    if (twi)
+        byteTime = I2C_TWI_BITS * 1000 / I2C_TWI_KHZ + I2C_TWI_OVERHEAD_US;
+    else
+        byteTime = I2C_BYTE_US;
+}
+
+void EepromEmulator::printDeviceInfo()
+{
+    link->printf("DeviceName: %s\r\n", current->name);
+    link->printf("DataRange: 0000-%04lX\r\n", eepromEnd);
+    link->println("DataBits: 16");
+    if (current->pageSize >= 2)
+        link->printf("PageSize: %u\r\n", current->pageSize / 2);
+}
+
+void EepromEmulator::cmdDevice()
+{
+    // The sketch cannot tell which EEPROM is on the bus, so it always
+    // reports the default if anything acknowledges the probe.
+    resetDevice();
+    charge(2 * byteTime);
+    if (socketEmpty) {
+        link->println("ERROR");
+        return;
+    }
+    link->println("OK");
+    link->println("DeviceID: 0000");
+    printDeviceInfo();
+    link->println(".");
+}
+
+void EepromEmulator::cmdDevices()
+{
+    link->println("OK");
+    for (int index = 0; eepromDevices[index].name; ++index) {
+        if (index > 0)
+            link->print((index % 6) == 0 ? ",\r\n" : ", ");
+        link->print(eepromDevices[index].name);
+        if (index == EEPROM_DEFAULT)
+            link->print("*");
+    }
+    link->println("");
+    link->println(".");
+}
+
+void EepromEmulator::cmdSetDevice(const char *name, int len)
+{
+    for (const EepromDeviceInfo *dev = eepromDevices; dev->name; ++dev) {
+        if (matchString(dev->name, name, len)) {
+            initDevice(dev);
+            charge(2 * byteTime);
+            link->println("OK");
+            printDeviceInfo();
+            link->println(".");
+            return;
+        }
+    }
+    resetDevice();
+    link->println("ERROR");
+}
+
+bool EepromEmulator::findLimit(unsigned long addr, unsigned long *limit)
+{
+    *limit = eepromEnd;
+    return addr <= eepromEnd;
+}
+
+bool EepromEmulator::startRead(unsigned long addr)
+{
+    charge(5 * byteTime);
+    return true;
+}
+
+// Reads a word from the EEPROM.  Addresses wrap around if the sketch
+// thinks that the EEPROM is bigger than it really is.
+unsigned int EepromEmulator::readWord(unsigned long addr)
+{
+    const std::vector<unsigned char> &chipMemory = memory[readSocket];
+    unsigned long byteAddr = (addr * 2) % chipMemory.size();
+    charge(2 * byteTime);
+    return chipMemory[byteAddr] |
+           (chipMemory[(byteAddr + 1) % chipMemory.size()] << 8);
+}
+
+void EepromEmulator::startWrite(unsigned long addr)
+{
+    writeByteAddr = addr * 2;
+    page.clear();
+}
+
+// Reads back a page before writing it, stopping at the first byte
+// that is different.
+bool EepromEmulator::pageMatches(unsigned int socket, unsigned long byteAddr)
+{
+    const std::vector<unsigned char> &chipMemory = memory[socket];
+    charge(5 * byteTime);
+    for (size_t index = 0; index < page.size(); ++index) {
+        charge(byteTime);
+        if (chipMemory[(byteAddr + index) % chipMemory.size()] != page[index]) {
+            if (index < (page.size() - 1))
+                charge(byteTime);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes "page" to every socket that does not already hold it, waiting
+// for each EEPROM to finish its previous page just before it is needed.
+void EepromEmulator::writeSockets(unsigned long byteAddr)
+{
+    for (unsigned int socket = 0; socket < socketCount; ++socket) {
+        if (socketsBusy & (1 << socket)) {
+            waitUntil(readyAt[socket]);
+            charge(byteTime);
+            socketsBusy &= ~(1 << socket);
+        }
+        if (pageMatches(socket, byteAddr)) {
+            ++pagesSkipped;
+            continue;
+        }
+        std::vector<unsigned char> &chipMemory = memory[socket];
+        for (size_t index = 0; index < page.size(); ++index)
+            chipMemory[(byteAddr + index) % chipMemory.size()] = page[index];
+        charge((3 + page.size()) * byteTime);
+        readyAt[socket] = cycleEnd(DELAY_TWC);
+        socketsBusy |= (1 << socket);
+        ++pagesWritten;
+    }
+}
+
+void EepromEmulator::waitForSockets()
+{
+    for (unsigned int socket = 0; socket < socketCount; ++socket) {
+        if (socketsBusy & (1 << socket)) {
+            waitUntil(readyAt[socket]);
+            charge(byteTime);
+        }
+    }
+    socketsBusy = 0;
+}
+
+// Collects a byte, and writes the page once it is full.
+void EepromEmulator::writeByte(unsigned char value)
+{
+    page.push_back(value);
+    if ((++writeByteAddr % current->pageSize) == 0) {
+        writeSockets(writeByteAddr - page.size());
+        page.clear();
+    }
+}
+
+bool EepromEmulator::writeWord(unsigned long addr, unsigned int word, bool force)
+{
+    writeByte((unsigned char)word);
+    writeByte((unsigned char)(word >> 8));
+    return true;
+}
+
+void EepromEmulator::stopWrite()
+{
+    if (!page.empty())
+        writeSockets(writeByteAddr - page.size());
+    page.clear();
+    waitForSockets();
+}
+
+bool EepromEmulator::erase(bool preserve)
+{
+    // Fill the bytes a page at a time in all of the sockets, like the sketch.
+    page.assign(current->pageSize, 0xFF);
+    for (unsigned long addr = 0; addr < current->size; addr += current->pageSize) {
+        writeSockets(addr);
+        keepAlive();
+    }
+    waitForSockets();
+    page.clear();
+    return true;
+}
+
+// SOCKETS command, which ProgramEEPROM checks by probing each socket.
+void EepromEmulator::cmdSockets(const char *args)
+{
+    unsigned long count;
+    unsigned long read = 0;
+    int size = parseHex(args, &count);
+    if (size) {
+        args = skipWhiteSpace(args + size);
+        if (*args != '\0')
+            size = parseHex(args, &read);
+    }
+    socketCount = 1;
+    readSocket = 0;
+    if (!size || !count || count > current->sockets || read >= count) {
+        link->println("ERROR");
+        return;
+    }
+    charge(2 * count * byteTime);
+    if (socketEmpty || count > memory.size()) {
+        link->println("ERROR");
+        return;
+    }
+    socketCount = count;
+    readSocket = read;
+    link->println("OK");
+}
+
+void EepromEmulator::cmdPages()
+{
+    link->printf("OK %04lX %04lX\r\n", pagesWritten, pagesSkipped);
+}
+
+static const char *linkName = 0;
+
+static void removeLink()
+{
+    if (linkName)
+        ::unlink(linkName);
+}
+
+static void terminate(int sig)
+{
+    removeLink();
+    _exit(0);
+}
+
+static void swapDevice(int sig)
+{
+    ++socketSwaps;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s --device DEVTYPE -d DEVTYPE --link PATH\n", argv0);
+    fprintf(stderr, "    --baud --timing --twi --write-delay USEC --rx-buffer SIZE\n");
+    fprintf(stderr, "    --sockets COUNT\n");
+    fprintf(stderr, "    --boot-delay MSEC --verbose -v --help -h\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    std::string device = "pic16f628a";
+    bool baud = false;
+    bool timing = false;
+    bool twi = false;
+    int sockets = 1;
+    long writeDelay = -1;
+    int rxBufferSize = 63;
+    int bootDelay = 0;
+    bool verbose = false;
+    while ((opt = getopt_long(argc, argv, "d:hv", long_options, 0)) != -1) {
+        switch (opt) {
+        case 'B':
+            // Model the transfer time of each byte at the link speed.
+            baud = true;
+            break;
+        case 'b':
+            // Time that the bootloader takes after the host opens the port.
+            bootDelay = atoi(optarg);
+            break;
+        case 'd':
+            // Set the type of device in the programming socket.
+            device = optarg;
+            break;
+        case 'L':
+            // Create a symbolic link to the slave side of the pty.
+            linkName = optarg;
+            break;
+        case 'r':
+            // Set the size of the Arduino's serial receive buffer.
+            rxBufferSize = atoi(optarg);
+            if (rxBufferSize < 16 || rxBufferSize > 1024) {
+                fprintf(stderr, "Receive buffer size must be between 16 and 1024\n");
+                return 64;
+            }
+            break;
+        case 'S':
+            // Set the number of EEPROMs on the bus, for "SOCKETS".
+            sockets = atoi(optarg);
+            if (sockets < 1 || sockets > 8) {
+                fprintf(stderr, "Number of sockets must be between 1 and 8\n");
+                return 64;
+            }
+            break;
+        case 't':
+            // Model the time taken to read, write, and erase the device.
+            timing = true;
+            break;
+        case 'T':
+            // Model ProgramEEPROM driving the I2C bus with the TWI peripheral.
+            twi = true;
+            break;
+        case 'v':
+            // Log commands to stderr.
+            verbose = true;
+            break;
+        case 'W':
+            // Set a fixed time for each write cycle.
+            writeDelay = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 64;
+        }
+    }
+
+    // Find the device to put in the programming socket.
+    EmuLink link;
+    Emulator *emulator = 0;
+    for (const PicDeviceInfo *dev = picDevices; dev->name && !emulator; ++dev) {
+        if (!strcasecmp(dev->name, device.c_str()))
+            emulator = new PicEmulator(&link, dev);
+    }
+    for (const EepromDeviceInfo *dev = eepromDevices; dev->name && !emulator; ++dev) {
+        if (!strcasecmp(dev->name, device.c_str()))
+            emulator = new EepromEmulator(&link, dev, twi, sockets);
+    }
+    if (!emulator) {
+        fprintf(stderr, "Unknown device type '%s'\n", device.c_str());
+        return 76;
+    }
+    emulator->setTiming(timing);
+    emulator->setWriteDelay(writeDelay);
+    emulator->setRxBufferSize(rxBufferSize);
+    emulator->setBootDelay(bootDelay);
+    emulator->setVerbose(verbose);
+    link.setModelBaud(baud);
+
+    // Create the pseudo-terminal and tell the user where it is.
+    if (!link.open())
+        return 74;
+    if (linkName) {
+        ::unlink(linkName);
+        if (::symlink(link.deviceName().c_str(), linkName) < 0) {
+            perror(linkName);
+            return 74;
+        }
+        atexit(removeLink);
+        signal(SIGINT, terminate);
+        signal(SIGTERM, terminate);
+        signal(SIGHUP, terminate);
+    }
+    signal(SIGUSR1, swapDevice);
+    printf("%s\n", link.deviceName().c_str());
+    fflush(stdout);
+
+    emulator->run();
+    delete emulator;
+    return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the output of HexFile::save() and HexFile::saveCC() against
+// the original putc()-based writer, byte for byte, and reports how long
+// each writer takes.  Run with "make check".
+
+#include "hexfile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+typedef HexFile::Address Address;
+typedef HexFile::Word Word;
+
+// Layout and contents of one test image.
+struct Image
+{
+    const char *name;
+    DeviceInfoMap details;
+    int format;
+    std::vector<Address> set;   // Sorted addresses that have been set.
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Original writer: one putc() per character.
+static void writeLine(FILE *file, const char *buffer, int len)
+{
+    static const char hexchars[] = "0123456789ABCDEF";
+    int checksum = 0;
+    int index;
+    for (index = 0; index < len; ++index)
+        checksum += (buffer[index] & 0xFF);
+    checksum = (((checksum & 0xFF) ^ 0xFF) + 1) & 0xFF;
+    putc(':', file);
+    for (index = 0; index < len; ++index) {
+        int value = buffer[index];
+        putc(hexchars[(value >> 4) & 0x0F], file);
+        putc(hexchars[value & 0x0F], file);
+    }
+    putc(hexchars[(checksum >> 4) & 0x0F], file);
+    putc(hexchars[checksum & 0x0F], file);
+    putc('\n', file);
+}
+
+static void saveRange(const HexFile &hex, FILE *file, Address start, Address end)
+{
+    Address current = start;
+    Address currentSegment = ~((Address)0);
+    bool needsSegments = (hex.programEnd() >= 0x10000 ||
+                          hex.configEnd() >= 0x10000 ||
+                          hex.dataEnd() >= 0x10000);
+    int format;
+    if (hex.format() == FORMAT_AUTO && hex.programBits() == 16)
+        format = FORMAT_IHX32;
+    else
+        format = hex.format();
+    if (format == FORMAT_IHX8M)
+        needsSegments = false;
+    char buffer[64];
+    while (current <= end) {
+        Address byteAddress = current * 2;
+        Address segment = byteAddress >> 16;
+        if (needsSegments && segment != currentSegment) {
+            if (segment < 16 && hex.format() != FORMAT_IHX32) {
+                currentSegment = segment;
+                segment <<= 12;
+                buffer[0] = (char)0x02;
+                buffer[1] = (char)0x00;
+                buffer[2] = (char)0x00;
+                buffer[3] = (char)0x02;
+                buffer[4] = (char)(segment >> 8);
+                buffer[5] = (char)segment;
+                writeLine(file, buffer, 6);
+            } else {
+                currentSegment = segment;
+                buffer[0] = (char)0x02;
+                buffer[1] = (char)0x00;
+                buffer[2] = (char)0x00;
+                buffer[3] = (char)0x04;
+                buffer[4] = (char)(segment >> 8);
+                buffer[5] = (char)segment;
+                writeLine(file, buffer, 6);
+            }
+        }
+        if ((current + 7) <= end)
+            buffer[0] = (char)0x10;
+        else
+            buffer[0] = (char)((end - current + 1) * 2);
+        buffer[1] = (char)(byteAddress >> 8);
+        buffer[2] = (char)byteAddress;
+        buffer[3] = (char)0x00;
+        int len = 4;
+        while (current <= end && len < (4 + 16)) {
+            Word value = hex.word(current);
+            buffer[len++] = (char)value;
+            buffer[len++] = (char)(value >> 8);
+            ++current;
+        }
+        writeLine(file, buffer, len);
+    }
+}
+
+static void saveRange(const HexFile &hex, FILE *file, Address start, Address end, bool skipOnes)
+{
+    if (skipOnes) {
+        while (start <= end) {
+            while (start <= end && hex.isAllOnes(start))
+                ++start;
+            if (start > end)
+                break;
+            Address limit = start + 1;
+            while (limit <= end && !hex.isAllOnes(limit))
+                ++limit;
+            saveRange(hex, file, start, limit - 1);
+            start = limit;
+        }
+    } else {
+        saveRange(hex, file, start, end);
+    }
+}
+
+static bool oldSave(const HexFile &hex, const std::string &filename, bool skipOnes)
+{
+    FILE *file = fopen(filename.c_str(), "w");
+    if (!file) {
+        perror(filename.c_str());
+        return false;
+    }
+    saveRange(hex, file, hex.programStart(), hex.programEnd(), skipOnes);
+    if (hex.configStart() <= hex.configEnd()) {
+        if ((hex.configEnd() - hex.configStart() + 1) >= 8) {
+            saveRange(hex, file, hex.configStart(), hex.configStart() + 5, skipOnes);
+            saveRange(hex, file, hex.configStart() + 7, hex.configEnd(), skipOnes);
+        } else {
+            saveRange(hex, file, hex.configStart(), hex.configEnd(), skipOnes);
+        }
+    }
+    saveRange(hex, file, hex.dataStart(), hex.dataEnd(), skipOnes);
+    fputs(":00000001FF\n", file);
+    fclose(file);
+    return true;
+}
+
+// The original saveCC() wrote each maximal run of set words, merging
+// runs across region boundaries, so it only needs the set addresses.
+static bool oldSaveCC(const HexFile &hex, const std::vector<Address> &set,
+                      const std::string &filename, bool skipOnes)
+{
+    FILE *file = fopen(filename.c_str(), "w");
+    if (!file) {
+        perror(filename.c_str());
+        return false;
+    }
+    size_t index = 0;
+    while (index < set.size()) {
+        Address runStart = set[index];
+        Address runEnd = runStart;
+        while (++index < set.size() && set[index] == (runEnd + 1))
+            runEnd = set[index];
+        saveRange(hex, file, runStart, runEnd, skipOnes);
+    }
+    fputs(":00000001FF\n", file);
+    fclose(file);
+    return true;
+}
+
+// Sets words in [start, end] in runs of random length, leaving random
+// gaps and some all-ones words so that every writer path is exercised.
+static void fill(HexFile *hex, std::vector<Address> *set, Address start, Address end, Word mask)
+{
+    Address address = start;
+    while (address <= end) {
+        Address run = 1 + rand() % 300;
+        for (; run > 0 && address <= end; --run, ++address) {
+            Word value = (rand() % 8) == 0 ? mask : (Word)(rand() & mask);
+            hex->setWord(address, value);
+            set->push_back(address);
+        }
+        address += rand() % 40;
+    }
+}
+
+static bool sameFiles(const std::string &name1, const std::string &name2, long *size)
+{
+    FILE *file1 = fopen(name1.c_str(), "rb");
+    FILE *file2 = fopen(name2.c_str(), "rb");
+    bool same = (file1 != 0 && file2 != 0);
+    *size = 0;
+    while (same) {
+        int ch1 = getc(file1);
+        int ch2 = getc(file2);
+        if (ch1 != ch2)
+            same = false;
+        else if (ch1 == EOF)
+            break;
+        else
+            ++(*size);
+    }
+    if (file1)
+        fclose(file1);
+    if (file2)
+        fclose(file2);
+    return same;
+}
+
+// Writes the image with both writers and compares the results.
+static bool check(const HexFile &hex, const std::vector<Address> &set,
+                  const char *name, bool cc, bool skipOnes, int repeat)
+{
+    std::string oldName = "hexcheck-old.hex";
+    std::string newName = "hexcheck-new.hex";
+    double oldTime = 0, newTime = 0, start;
+    for (int iter = 0; iter < repeat; ++iter) {
+        start = now();
+        if (cc)
+            oldSaveCC(hex, set, oldName, skipOnes);
+        else
+            oldSave(hex, oldName, skipOnes);
+        oldTime += now() - start;
+        start = now();
+        if (cc)
+            hex.saveCC(newName, skipOnes);
+        else
+            hex.save(newName, skipOnes);
+        newTime += now() - start;
+    }
+    long size;
+    bool same = sameFiles(oldName, newName, &size);
+    printf("%-14s %-6s %-9s %9ld bytes  old %8.2f ms  new %8.2f ms  %s\n",
+           name, cc ? "saveCC" : "save", skipOnes ? "skipOnes" : "",
+           size, oldTime * 1000.0 / repeat, newTime * 1000.0 / repeat,
+           same ? "same" : "DIFFERENT");
+    unlink(oldName.c_str());
+    unlink(newName.c_str());
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char * const formats[] = {"auto", "ihx8m", "ihx16", "ihx32"};
+    int repeat = (argc > 1 ? atoi(argv[1]) : 5);
+    if (repeat < 1)
+        repeat = 1;
+    srand(1);
+
+    Image images[3];
+    images[0].name = "pic16f877a";
+    images[0].details["ProgramRange"] = "0000-1FFF";
+    images[0].details["ConfigRange"] = "2000-2007";
+    images[0].details["DataRange"] = "2100-21FF";
+    images[1].name = "16bit-64K";
+    images[1].details["ProgramRange"] = "00000-0FFFF";
+    images[1].details["ProgramBits"] = "16";
+    images[2].name = "16bit-128K";
+    images[2].details["ProgramRange"] = "00000-1FFFF";
+    images[2].details["ProgramBits"] = "16";
+    images[2].details["DataRange"] = "20000-200FF";
+    images[2].details["DataBits"] = "16";
+
+    bool ok = true;
+    for (int index = 0; index < 3; ++index) {
+        for (int format = FORMAT_AUTO; format <= FORMAT_IHX32; ++format) {
+            HexFile hex;
+            std::vector<Address> set;
+            hex.setReportsProgress(false);
+            hex.setDeviceDetails(images[index].details);
+            hex.setFormat(format);
+            Word progMask = (Word)((1UL << hex.programBits()) - 1);
+            Word dataMask = (Word)((1UL << hex.dataBits()) - 1);
+            fill(&hex, &set, hex.programStart(), hex.programEnd(), progMask);
+            if (hex.configStart() <= hex.configEnd())
+                fill(&hex, &set, hex.configStart(), hex.configEnd(), progMask);
+            if (hex.dataStart() <= hex.dataEnd())
+                fill(&hex, &set, hex.dataStart(), hex.dataEnd(), dataMask);
+            std::string name = std::string(images[index].name) + "/" +
+                               formats[format - FORMAT_AUTO];
+            for (int mode = 0; mode < 4; ++mode) {
+                if (!check(hex, set, name.c_str(), (mode & 2) != 0,
+                           (mode & 1) != 0, repeat))
+                    ok = false;
+            }
+        }
+    }
+    printf("%s\n", ok ? "All outputs match the original writer." : "MISMATCH");
+    return ok ? 0 : 1;
+}
@@ -16,10 +16,38 @@
  */
 
 #include "hexfile.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "hexstream.h"
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Reference: http://en.wikipedia.org/wiki/Intel_HEX
 
+// Memory areas that are larger than this are stored sparsely rather than
+// densely to avoid allocating huge arrays for malformed device details.
+#define HEXFILE_MAX_DENSE_WORDS     0x100000UL
+
+#define REGION_PROGRAM      0
+#define REGION_CONFIG       1
+#define REGION_DATA         2
+#define REGION_COUNT        3
+
+#define BITS_PER_LONG       (sizeof(unsigned long) * 8)
+
+// Offset of the configuration word within config memory.
+#define CONFIG_WORD_OFFSET  7
+
 HexFile::HexFile()
     : _programStart(0x0000)
     , _programEnd(0x07FF)
@@ -31,9 +59,16 @@ HexFile::HexFile()
     , _reservedEnd(0x07FF)
     , _programBits(14)
     , _dataBits(8)
+    , _configSave(0)
+    , _pageSize(0)
     , _format(FORMAT_AUTO)
+    , _stats(0)
+    , _progress(true)
+    , _elideBlank(false)
     , count(0)
+    , unchanged(0)
 {
+    initRegions();
 }
 
 HexFile::~HexFile()
@@ -61,6 +96,18 @@ static inline std::string fetchMap
         return defValue;
 }
 
+static inline int hexDigit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    else if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    else if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    else
+        return -1;
+}
+
 static bool parseHex(const std::string &str, HexFile::Address *value)
 {
     bool haveHex = false;
@@ -98,6 +145,7 @@ static bool parseRange
 bool HexFile::setDeviceDetails(const DeviceInfoMap &details)
 {
     std::string value;
+    Address address;
 
     _deviceName = fetchMap(details, "DeviceName");
 
@@ -122,6 +170,13 @@ bool HexFile::setDeviceDetails(const DeviceInfoMap &details)
         _configEnd = 0x1FFF;
     }
 
+    value = fetchMap(details, "ConfigSave");
+    if (value.empty() || !parseHex(value, &address))
+        address = 0;
+    _configSave = (Word)address;
+
+    _pageSize = atoi(fetchMap(details, "PageSize", "0").c_str());
+
     value = fetchMap(details, "DataRange");
     if (!value.empty()) {
         if (!parseRange(value, &_dataStart, &_dataEnd))
@@ -143,18 +198,160 @@ bool HexFile::setDeviceDetails(const DeviceInfoMap &details)
         _reservedEnd = _programEnd;
     }
 
+    // Resize the memory image to match the new device.  Any words that
+    // were previously loaded or read are discarded.
+    initRegions();
+
     return _programBits >= 1 && _dataBits >= 1;
 }
 
-HexFile::Word HexFile::word(Address address) const
+// Allocates dense storage for the program, config, and data memory areas.
+void HexFile::initRegions()
 {
-    std::vector<HexFileBlock>::const_iterator it;
-    for (it = blocks.begin(); it != blocks.end(); ++it) {
-        if (address >= (*it).address &&
-                address < ((*it).address + (*it).data.size())) {
-            return (*it).data[(std::vector<HexFileBlock>::size_type)(address - (*it).address)];
+    regions[REGION_PROGRAM].start = _programStart;
+    regions[REGION_PROGRAM].end = _programEnd;
+    regions[REGION_CONFIG].start = _configStart;
+    regions[REGION_CONFIG].end = _configEnd;
+    regions[REGION_DATA].start = _dataStart;
+    regions[REGION_DATA].end = _dataEnd;
+    for (int index = 0; index < REGION_COUNT; ++index) {
+        HexFileRegion &region = regions[index];
+        if (region.start > region.end ||
+                (region.end - region.start) >= HEXFILE_MAX_DENSE_WORDS) {
+            // Empty or unreasonably large: fall back to sparse storage.
+            region.start = 1;
+            region.end = 0;
+            region.data.clear();
+            region.present.clear();
+        } else {
+            Address size = region.end - region.start + 1;
+            region.data.assign(size, 0);
+            region.present.assign((size + BITS_PER_LONG - 1) / BITS_PER_LONG, 0);
         }
     }
+    extra.clear();
+}
+
+// Forgets all words in the image without changing the region sizes.
+void HexFile::clearWords()
+{
+    for (int index = 0; index < REGION_COUNT; ++index) {
+        std::vector<unsigned long> &present = regions[index].present;
+        std::fill(present.begin(), present.end(), 0UL);
+    }
+    extra.clear();
+}
+
+const HexFile::HexFileRegion *HexFile::findRegion(Address address) const
+{
+    for (int index = 0; index < REGION_COUNT; ++index) {
+        const HexFileRegion &region = regions[index];
+        if (address >= region.start && address <= region.end)
+            return &region;
+    }
+    return 0;
+}
+
+static inline bool testBit(const std::vector<unsigned long> &bits, HexFile::Address index)
+{
+    return (bits[index / BITS_PER_LONG] & (1UL << (index % BITS_PER_LONG))) != 0;
+}
+
+// Finds the first set bit in [index, limit].  Returns limit + 1 if none.
+static HexFile::Address nextSetBit
+    (const std::vector<unsigned long> &bits, HexFile::Address index,
+     HexFile::Address limit)
+{
+    while (index <= limit) {
+        unsigned long word = bits[index / BITS_PER_LONG];
+        if (!word && (index % BITS_PER_LONG) == 0) {
+            index += BITS_PER_LONG;     // Skip a whole empty word.
+            continue;
+        }
+        if (word & (1UL << (index % BITS_PER_LONG)))
+            return index;
+        ++index;
+    }
+    return limit + 1;
+}
+
+// Finds the first clear bit in [index, limit].  Returns limit + 1 if none.
+static HexFile::Address nextClearBit
+    (const std::vector<unsigned long> &bits, HexFile::Address index,
+     HexFile::Address limit)
+{
+    while (index <= limit) {
+        unsigned long word = bits[index / BITS_PER_LONG];
+        if (word == ~0UL && (index % BITS_PER_LONG) == 0) {
+            index += BITS_PER_LONG;     // Skip a whole full word.
+            continue;
+        }
+        if (!(word & (1UL << (index % BITS_PER_LONG))))
+            return index;
+        ++index;
+    }
+    return limit + 1;
+}
+
+// Finds the first run of consecutive words that have been set within
+// the range [from, to].  Returns false if there are no such words.
+// Adjacent runs that are stored in different regions are not merged.
+bool HexFile::findRun(Address from, Address to, Address *runStart, Address *runEnd) const
+{
+    Address address = from;
+    while (address <= to) {
+        const HexFileRegion *region = findRegion(address);
+        if (region) {
+            Address limit = (to < region->end ? to : region->end) - region->start;
+            Address first = nextSetBit(region->present, address - region->start, limit);
+            if (first <= limit) {
+                Address last = nextClearBit(region->present, first, limit) - 1;
+                *runStart = region->start + first;
+                *runEnd = region->start + last;
+                return true;
+            }
+            if (region->end >= to)
+                break;
+            address = region->end + 1;
+            continue;
+        }
+
+        // Sparse storage: stop just before the start of the next dense region.
+        Address limit = to;
+        for (int index = 0; index < REGION_COUNT; ++index) {
+            const HexFileRegion &r = regions[index];
+            if (r.start <= r.end && r.start > address && r.start <= limit)
+                limit = r.start - 1;
+        }
+        std::map<Address, Word>::const_iterator it = extra.lower_bound(address);
+        if (it != extra.end() && (*it).first <= limit) {
+            Address last = (*it).first;
+            *runStart = last;
+            for (++it; it != extra.end() && (*it).first == (last + 1) &&
+                            (*it).first <= limit; ++it)
+                ++last;
+            *runEnd = last;
+            return true;
+        }
+        if (limit >= to)
+            break;
+        address = limit + 1;
+    }
+    return false;
+}
+
+HexFile::Word HexFile::word(Address address) const
+{
+    const HexFileRegion *region = findRegion(address);
+    if (region) {
+        Address index = address - region->start;
+        if (testBit(region->present, index))
+            return region->data[index];
+    } else {
+        std::map<Address, Word>::const_iterator it = extra.find(address);
+        if (it != extra.end())
+            return (*it).second;
+    }
     if (address >= _dataStart && address <= _dataEnd)
         return (Word)((1 << _dataBits) - 1);
     else
@@ -163,55 +360,42 @@ HexFile::Word HexFile::word(Address address) const
 
 void HexFile::setWord(Address address, Word word)
 {
-    std::vector<HexFileBlock>::iterator it;
-    std::vector<HexFileBlock>::size_type index;
-    for (it = blocks.begin(), index = 0; it != blocks.end(); ++it, ++index) {
-        HexFileBlock &block = *it;
-        if (address < block.address) {
-            if (address == (block.address - 1)) {
-                // Prepend to the existing block.
-                block.address--;
-                block.data.insert(block.data.begin(), word);
-            } else {
-                // Create a new block before this one.
-                HexFileBlock newBlock;
-                newBlock.address = address;
-                newBlock.data.push_back(word);
-                blocks.insert(it, newBlock);
-            }
-            return;
-        } else if (address < ((*it).address + (*it).data.size())) {
-            // Update a word in an existing block.
-            block.data[(std::vector<HexFileBlock>::size_type)(address - block.address)] = word;
-            return;
-        } else if (address == ((*it).address + (*it).data.size())) {
-            // Can we extend the current block without hitting the next block?
-            if (index < (blocks.size() - 1)) {
-                HexFileBlock &next = blocks[index + 1];
-                if (address < next.address) {
-                    block.data.push_back(word);
-                    return;
-                }
-            } else {
-                block.data.push_back(word);
-                return;
-            }
+    HexFileRegion *region = const_cast<HexFileRegion *>(findRegion(address));
+    if (region) {
+        Address index = address - region->start;
+        region->data[index] = word;
+        region->present[index / BITS_PER_LONG] |= 1UL << (index % BITS_PER_LONG);
+    } else {
+        extra[address] = word;
+    }
+}
+
+// Returns the number of words that have been set.
+HexFile::Address HexFile::wordCount() const
+{
+    Address total = extra.size();
+    for (int index = 0; index < REGION_COUNT; ++index) {
+        const std::vector<unsigned long> &present = regions[index].present;
+        for (size_t posn = 0; posn < present.size(); ++posn) {
+            for (unsigned long bits = present[posn]; bits != 0; bits &= bits - 1)
+                ++total;
         }
     }
-    HexFileBlock block;
-    block.address = address;
-    block.data.push_back(word);
-    blocks.push_back(block);
+    return total;
 }
 
-bool HexFile::isAllOnes(Address address) const
+// Returns the all-ones value of a blank word at "address".
+HexFile::Word HexFile::blankWord(Address address) const
 {
-    Word allOnes;
     if (address >= _dataStart && address <= _dataEnd)
-        allOnes = (Word)((1 << _dataBits) - 1);
+        return (Word)((1 << _dataBits) - 1);
     else
-        allOnes = (Word)((1 << _programBits) - 1);
-    return word(address) == allOnes;
+        return (Word)((1 << _programBits) - 1);
+}
+
+bool HexFile::isAllOnes(Address address) const
+{
+    return word(address) == blankWord(address);
 }
 
 bool HexFile::canForceCalibration() const
@@ -226,49 +410,61 @@ bool HexFile::canForceCalibration() const
     return false;
 }
 
+// Determines if the image can be burnt with diffWrite().  Program and
+// config words on flash PICs are written without an erase, which cannot
+// change a 0 bit back to 1, so the image must only contain data words.
+bool HexFile::canDiffWrite() const
+{
+    Address runStart, runEnd;
+    if (_programStart <= _programEnd &&
+            findRun(_programStart, _programEnd, &runStart, &runEnd))
+        return false;
+    if (_configStart <= _configEnd &&
+            findRun(_configStart, _configEnd, &runStart, &runEnd))
+        return false;
+    return true;
+}
+
 bool HexFile::read(SerialPort *port)
 {
-    blocks.clear();
+    clearWords();
     if (_programStart <= _programEnd) {
-        printf("Reading program memory,\n");
+        progress("Reading program memory,\n");
         if (!readBlock(port, _programStart, _programEnd))
             return false;
     } else {
-        printf("Skipped reading program memory,\n");
+        progress("Skipped reading program memory,\n");
     }
     if (_dataStart <= _dataEnd) {
-        printf("reading data memory,\n");
+        progress("reading data memory,\n");
         if (!readBlock(port, _dataStart, _dataEnd))
             return false;
     } else {
-        printf("skipped reading data memory,\n");
+        progress("skipped reading data memory,\n");
     }
     if (_configStart <= _configEnd) {
-        printf("reading id words and fuses,\n");  // Done in one hit.
+        progress("reading id words and fuses,\n");  // Done in one hit.
         if (!readBlock(port, _configStart, _configEnd))
             return false;
     } else {
-        printf("skipped reading id words and fuses,\n");
+        progress("skipped reading id words and fuses,\n");
     }
-    printf("done.\n");
+    progress("done.\n");
     return true;
 }
 
 bool HexFile::readBlock(SerialPort *port, Address start, Address end)
 {
-    HexFileBlock block;
-    block.address = start;
-    block.data.resize(std::vector<unsigned short>::size_type(end - start + 1));
-    if (!port->readData(start, end, &(block.data.at(0))))
+    std::vector<Word> data;
+    data.resize(std::vector<Word>::size_type(end - start + 1));
+    if (_stats)
+        _stats->begin(Stats::Readback);
+    if (!port->readData(start, end, &(data.at(0))))
         return false;
-    std::vector<HexFileBlock>::iterator it;
-    for (it = blocks.begin(); it != blocks.end(); ++it) {
-        if (start <= (*it).address) {
-            blocks.insert(it, block);
-            return true;
-        }
-    }
-    blocks.push_back(block);
+    if (_stats)
+        _stats->end(end - start + 1);
+    for (Address address = start; address <= end; ++address)
+        setWord(address, data[std::vector<Word>::size_type(address - start)]);
     return true;
 }
 
@@ -277,8 +473,10 @@ bool HexFile::write(SerialPort *port, bool forceCalibration)
     // Write the contents of program memory.
     count = 0;
     if (_programStart <= _programEnd) {
-        printf("Burning program memory,");
+        progress("Burning program memory,");
         fflush(stdout);
+        if (_stats)
+            _stats->begin(Stats::ProgramBurn);
         if (forceCalibration || _reservedStart > _reservedEnd) {
             // Calibration forced or no reserved words to worry about.
             if (!writeBlock(port, _programStart, _programEnd, forceCalibration))
@@ -288,191 +486,893 @@ bool HexFile::write(SerialPort *port, bool forceCalibration)
             if (!writeBlock(port, _programStart, _reservedStart - 1, forceCalibration))
                 return false;
         }
+        if (_stats)
+            _stats->end(count);
         reportCount();
     } else {
-        printf("Skipped burning program memory,\n");
+        progress("Skipped burning program memory,\n");
     }
 
     // Write data memory before config memory in case the configuration
     // word turns on data protection and thus hinders data verification.
     if (_dataStart <= _dataEnd) {
-        printf("burning data memory,");
+        progress("burning data memory,");
         fflush(stdout);
+        if (_stats)
+            _stats->begin(Stats::DataBurn);
         if (!writeBlock(port, _dataStart, _dataEnd, forceCalibration))
             return false;
+        if (_stats)
+            _stats->end(count);
         reportCount();
     } else {
-        printf("skipped burning data memory,\n");
+        progress("skipped burning data memory,\n");
     }
 
     // Write the contents of config memory.
     if (_configStart <= _configEnd) {
-        printf("burning id words and fuses,");
+        progress("burning id words and fuses,");
         fflush(stdout);
+        if (_stats)
+            _stats->begin(Stats::ConfigBurn);
         if (!writeBlock(port, _configStart, _configEnd, forceCalibration))
             return false;
+        if (_stats)
+            _stats->end(count);
         reportCount();
     } else {
-        printf("skipped burning id words and fuses,");
+        progress("skipped burning id words and fuses,");
     }
 
-    printf("done.\n");
+    progress("done.\n");
     return true;
 }
 
 bool HexFile::writeBlock(SerialPort *port, Address start, Address end, bool forceCalibration)
 {
-    std::vector<HexFileBlock>::const_iterator it;
-    for (it = blocks.begin(); it != blocks.end(); ++it) {
-        Address blockStart = (*it).address;
-        Address blockEnd = blockStart + (*it).data.size() - 1;
-        if (start <= blockEnd && end >= blockStart) {
-            const unsigned short *data = &((*it).data.at(0));
-            Address overlapStart;
-            Address overlapEnd;
-            if (start > blockStart) {
-                data += std::vector<unsigned short>::size_type
-                    (start - blockStart);
-                overlapStart = start;
+    std::vector<Word> data;
+    Address runStart, runEnd;
+    while (start <= end && findRun(start, end, &runStart, &runEnd)) {
+        data.resize(std::vector<Word>::size_type(runEnd - runStart + 1));
+        for (Address address = runStart; address <= runEnd; ++address)
+            data[std::vector<Word>::size_type(address - runStart)] = word(address);
+        if (!writeRun(port, runStart, runEnd, &(data.at(0)), forceCalibration))
+            return false;
+        count += runEnd - runStart + 1;
+        if (runEnd >= end)
+            break;
+        start = runEnd + 1;
+    }
+    return true;
+}
+
+// Cost model for leaving out blank words after an erase, in microseconds.
+// Starting another WRITEBIN costs a command line, the terminating packet,
+// and their responses: about 30 bytes and two round trips.  Sending a
+// blank word instead costs two bytes and a write cycle on the device.
+#define ELIDE_COMMAND_BYTES     30
+#define ELIDE_ROUND_TRIP_US     2000
+#define ELIDE_WORD_WRITE_US     1000
+
+// Writes a run of words to the device.  If the device has just been
+// erased, then blank words are already in place and are left out,
+// unless a gap of them is cheaper to send than starting a new WRITEBIN.
+bool HexFile::writeRun(SerialPort *port, Address start, Address end, const Word *data, bool forceCalibration)
+{
+    if (!_elideBlank)
+        return port->writeData(start, end, data, forceCalibration);
+    return writeChanged(port, start, end, data, 0, forceCalibration);
+}
+
+// Writes the words in a run that differ from "current", which holds
+// what is already on the device, or blank words if "current" is null.
+// Short gaps of unchanged words are sent anyway if that is cheaper
+// than starting a new WRITEBIN.
+bool HexFile::writeChanged(SerialPort *port, Address start, Address end, const Word *data, const Word *current, bool forceCalibration)
+{
+    unsigned long byteMicros = 10000000UL / (unsigned long)(port->speed());
+    Address maxGap = (ELIDE_COMMAND_BYTES * byteMicros + 2 * ELIDE_ROUND_TRIP_US) /
+                     (2 * byteMicros + ELIDE_WORD_WRITE_US);
+    Address address = start;
+    while (address <= end) {
+        // Skip the unchanged words before the next changed one.
+        while (address <= end && data[address - start] ==
+                    (current ? current[address - start] : blankWord(address)))
+            ++address;
+        if (address > end)
+            break;
+
+        // Extend the run across changed words and short unchanged gaps.
+        Address first = address;
+        Address last = address;
+        Address gap = 0;
+        for (++address; address <= end && gap <= maxGap; ++address) {
+            if (data[address - start] ==
+                    (current ? current[address - start] : blankWord(address))) {
+                ++gap;
             } else {
-                overlapStart = blockStart;
+                last = address;
+                gap = 0;
+            }
+        }
+        if (!port->writeData(first, last, data + (first - start), forceCalibration))
+            return false;
+        address = last + 1;
+    }
+    return true;
+}
+
+// Number of words that "--diff-burn" compares at a time when the
+// device does not report a page size.
+#define DIFF_BLOCK_WORDS    32
+
+// Burns only the words that differ from what is already on the device,
+// without erasing it first.  Each page is compared using its CRC-32 from
+// "CHECKSUM", and only pages that differ are read back to find the words
+// that need to be written.  Only data memory is burnt, which covers PIC
+// data EEPROM and 24LCxx EEPROM's: see canDiffWrite().
+bool HexFile::diffWrite(SerialPort *port, bool forceCalibration)
+{
+    count = 0;
+    unchanged = 0;
+    if (_dataStart <= _dataEnd) {
+        progress("Burning changes to data memory,");
+        fflush(stdout);
+        if (_stats)
+            _stats->begin(Stats::DataBurn);
+        if (!diffBlock(port, _dataStart, _dataEnd, forceCalibration))
+            return false;
+        if (_stats)
+            _stats->end(count);
+        reportCount();
+    } else {
+        progress("Skipped burning data memory,");
+    }
+    progress("done.\n");
+    return true;
+}
+
+bool HexFile::diffBlock(SerialPort *port, Address start, Address end, bool forceCalibration)
+{
+    Address runStart, runEnd;
+    while (start <= end && findRun(start, end, &runStart, &runEnd)) {
+        if (!diffRange(port, runStart, runEnd, forceCalibration))
+            return false;
+        if (runEnd >= end)
+            break;
+        start = runEnd + 1;
+    }
+    return true;
+}
+
+bool HexFile::diffRange(SerialPort *port, Address start, Address end, bool forceCalibration)
+{
+    std::vector<Word>::size_type size = end - start + 1;
+    std::vector<Word> data(size);
+    for (Address address = start; address <= end; ++address)
+        data[address - start] = word(address);
+
+    // Compare the CRC-32 of each page of the range, and only look more
+    // closely at the pages that differ.  Sketches without "CHECKSUM" would
+    // read the range back to checksum it, so read it back directly instead.
+    Address block = _pageSize ? _pageSize : DIFF_BLOCK_WORDS;
+    if (port->protocolVersion() >= 3 && size > 1) {
+        std::vector<unsigned long> crcs;
+        if (!port->checksums(start, end, block, &crcs))
+            return false;
+        std::vector<Word> expected;
+        Address first = start;
+        for (size_t index = 0; index < crcs.size(); ++index) {
+            Address last = (first / block + 1) * block - 1;
+            if (last > end)
+                last = end;
+            expected.resize(last - first + 1);
+            for (Address address = first; address <= last; ++address)
+                expected[address - first] = data[address - start] & blankWord(address);
+            if (crcs[index] == SerialPort::checksumWords(&(expected[0]), last - first + 1))
+                unchanged += last - first + 1;
+            else if (!diffPage(port, first, last, &(data[first - start]), forceCalibration))
+                return false;
+            first = last + 1;
+        }
+        return true;
+    }
+    return diffPage(port, start, end, &(data[0]), forceCalibration);
+}
+
+// Reads back a page and writes the words that have changed.  Words that
+// differ only in bits that cannot change are left alone.
+bool HexFile::diffPage(SerialPort *port, Address start, Address end, const Word *data, bool forceCalibration)
+{
+    std::vector<Word> current(end - start + 1);
+    if (!port->readData(start, end, &(current[0])))
+        return false;
+    for (Address address = start; address <= end; ++address) {
+        if (sameWord(address, data[address - start], current[address - start],
+                     forceCalibration)) {
+            current[address - start] = data[address - start];
+            ++unchanged;
+        } else {
+            ++count;
+        }
+    }
+    return writeChanged(port, start, end, data, &(current[0]), forceCalibration);
+}
+
+// Determines if a word on the device already has the value to be burnt.
+bool HexFile::sameWord(Address address, Word word1, Word word2, bool forceCalibration) const
+{
+    Word mask = blankWord(address);
+    if (address == (_configStart + CONFIG_WORD_OFFSET) && !forceCalibration)
+        mask &= ~_configSave;   // Preserved by the device when burning.
+    return ((word1 ^ word2) & mask) == 0;
+}
+
+// Verifies the burnt words against the device using "VERIFYBIN", which
+// compares the words on the programmer and only reports back the ones
+// that differ.  Mismatched words are reported on stderr, and verifying
+// stops after "maxMismatches" of them.  Returns false on mismatch or if
+// the device could not be verified.
+bool HexFile::verify(SerialPort *port, bool forceCalibration, Address maxMismatches)
+{
+    return verifyRegions(port, forceCalibration, false, maxMismatches);
+}
+
+// Verifies the burnt words against the device by comparing CRC-32
+// checksums of each run of words, rather than reading the words back.
+// Mismatched runs are reported on stderr.  Returns false on mismatch
+// or if the device could not be checksummed.
+bool HexFile::verifyChecksum(SerialPort *port, bool forceCalibration)
+{
+    return verifyRegions(port, forceCalibration, true, (Address)-1);
+}
+
+bool HexFile::verifyRegions(SerialPort *port, bool forceCalibration, bool checksums, Address maxMismatches)
+{
+    Address mismatches = 0;
+    Address total = 0;
+    if (_stats)
+        _stats->begin(Stats::Verify);
+    progress("Verifying program memory,");
+    fflush(stdout);
+    count = 0;
+    if (_programStart <= _programEnd) {
+        // Reserved words are only burnt when calibration is forced.
+        Address end = _programEnd;
+        if (!forceCalibration && _reservedStart <= _reservedEnd)
+            end = _reservedStart - 1;
+        if (!verifyBlock(port, _programStart, end, forceCalibration,
+                         checksums, &mismatches, maxMismatches))
+            return false;
+    }
+    total += count;
+    reportCount();
+    progress("verifying data memory,");
+    fflush(stdout);
+    if (!verifyBlock(port, _dataStart, _dataEnd, forceCalibration,
+                     checksums, &mismatches, maxMismatches))
+        return false;
+    total += count;
+    reportCount();
+    progress("verifying id words and fuses,");
+    fflush(stdout);
+    if (!verifyBlock(port, _configStart, _configEnd, forceCalibration,
+                     checksums, &mismatches, maxMismatches))
+        return false;
+    total += count;
+    reportCount();
+    if (_stats)
+        _stats->end(total);
+    if (mismatches) {
+        if (mismatches >= maxMismatches)
+            fprintf(stderr, "Too many mismatches, stopped verifying\n");
+        progress("failed.\n");
+        return false;
+    }
+    progress("done.\n");
+    return true;
+}
+
+bool HexFile::verifyBlock(SerialPort *port, Address start, Address end, bool forceCalibration, bool checksums, Address *mismatches, Address maxMismatches)
+{
+    // The configuration word keeps the device's own values for the
+    // "ConfigSave" bits unless calibration is forced.  Those bits are
+    // unknown here, so that word is read back and compared without them.
+    Address configWord = _configStart + CONFIG_WORD_OFFSET;
+    bool maskConfig = (checksums && _configSave != 0 && !forceCalibration &&
+                       configWord >= start && configWord <= end);
+    Address runStart, runEnd;
+    while (start <= end && *mismatches < maxMismatches &&
+                findRun(start, end, &runStart, &runEnd)) {
+        if (!checksums) {
+            if (!compareRun(port, runStart, runEnd, forceCalibration,
+                            mismatches, maxMismatches))
+                return false;
+        } else if (maskConfig && configWord >= runStart && configWord <= runEnd) {
+            if (runStart < configWord &&
+                    !checksumRun(port, runStart, configWord - 1, mismatches))
+                return false;
+            Word value;
+            if (!port->readData(configWord, configWord, &value))
+                return false;
+            if (!sameWord(configWord, value, word(configWord), false)) {
+                fflush(stdout);
+                fprintf(stderr, "Verify failed at %04lX\n", configWord);
+                ++(*mismatches);
             }
-            if (end < blockEnd)
-                overlapEnd = end;
-            else
-                overlapEnd = blockEnd;
-            if (!port->writeData(overlapStart, overlapEnd, data, forceCalibration))
+            ++count;
+            if (configWord < runEnd &&
+                    !checksumRun(port, configWord + 1, runEnd, mismatches))
                 return false;
-            count += overlapEnd - overlapStart + 1;
+        } else if (!checksumRun(port, runStart, runEnd, mismatches)) {
+            return false;
+        }
+        if (runEnd >= end)
+            break;
+        start = runEnd + 1;
+    }
+    return true;
+}
+
+// Compares a run of words with the device, using "VERIFYBIN" if the
+// sketch has it or by reading the words back if it does not.
+bool HexFile::compareRun(SerialPort *port, Address start, Address end, bool forceCalibration, Address *mismatches, Address maxMismatches)
+{
+    std::vector<Word> data;
+    data.resize(std::vector<Word>::size_type(end - start + 1));
+    for (Address address = start; address <= end; ++address)
+        data[std::vector<Word>::size_type(address - start)] = word(address);
+    std::vector<SerialMismatch> found;
+    if (port->protocolVersion() >= 4) {
+        if (!port->verifyData(start, end, &(data.at(0)), forceCalibration,
+                              &found, maxMismatches - *mismatches))
+            return false;
+    } else {
+        std::vector<Word> current(data.size());
+        if (!port->readData(start, end, &(current.at(0))))
+            return false;
+        for (Address address = start; address <= end &&
+                    found.size() < (maxMismatches - *mismatches); ++address) {
+            Word value = current[address - start];
+            if (!sameWord(address, data[address - start], value, forceCalibration)) {
+                SerialMismatch mismatch;
+                mismatch.address = address;
+                mismatch.value = value;
+                found.push_back(mismatch);
+            }
         }
     }
+    if (!found.empty())
+        fflush(stdout);
+    for (size_t index = 0; index < found.size(); ++index) {
+        Address address = found[index].address;
+        fprintf(stderr, "Verify failed at %04lX: expected %04X, read %04X\n",
+                address, word(address) & blankWord(address), found[index].value);
+    }
+    *mismatches += found.size();
+    count += end - start + 1;
     return true;
 }
 
+bool HexFile::checksumRun(SerialPort *port, Address start, Address end, Address *mismatches)
+{
+    // The device returns words with the unimplemented bits cleared.
+    std::vector<Word> data;
+    data.resize(std::vector<Word>::size_type(end - start + 1));
+    for (Address address = start; address <= end; ++address) {
+        data[std::vector<Word>::size_type(address - start)] =
+            word(address) & blankWord(address);
+    }
+    unsigned long crc;
+    if (!port->checksum(start, end, &crc))
+        return false;
+    if (crc != SerialPort::checksumWords(&(data.at(0)), end - start + 1)) {
+        fflush(stdout);
+        if (start == end)
+            fprintf(stderr, "Verify failed at %04lX\n", start);
+        else
+            fprintf(stderr, "Verify failed at %04lX-%04lX\n", start, end);
+        ++(*mismatches);
+    }
+    count += end - start + 1;
+    return true;
+}
+
+#ifndef _WIN32
+
+struct HexFileParseArgs
+{
+    HexFile *hex;
+    FILE *file;
+    HexFileStream *stream;
+};
+
+void *HexFile::parseThread(void *arg)
+{
+    HexFileParseArgs *args = (HexFileParseArgs *)arg;
+    args->stream->finish(args->hex->loadFile(args->file, args->stream));
+    return 0;
+}
+
+// Writes the parts of a streamed run that fall within program memory
+// (less the reserved words) or data memory.  Config words are left
+// until the whole file has been parsed.
+bool HexFile::writeStreamRun(SerialPort *port, Address start, Address end, const Word *data)
+{
+    Address ranges[2][2];
+    ranges[0][0] = _programStart;
+    if (_reservedStart > _reservedEnd)
+        ranges[0][1] = _programEnd;
+    else
+        ranges[0][1] = _reservedStart - 1;  // Reserved words are at the end.
+    ranges[1][0] = _dataStart;
+    ranges[1][1] = _dataEnd;
+    for (int range = 0; range < 2; ++range) {
+        Address first = std::max(start, ranges[range][0]);
+        Address last = std::min(end, ranges[range][1]);
+        if (ranges[range][0] > ranges[range][1] || first > last)
+            continue;
+        if (_stats)
+            _stats->begin(range ? Stats::DataBurn : Stats::ProgramBurn);
+        if (!writeRun(port, first, last, data + (first - start), false))
+            return false;
+        if (_stats)
+            _stats->end(last - first + 1);
+        count += last - first + 1;
+    }
+    return true;
+}
+
+#endif
+
+// Burns the contents of a hex file while it is still being parsed.
+// Program and data words are written as soon as they arrive; the config
+// words are written last, once the file is known to be valid.  If the
+// file turns out to be invalid, "loadFailed" is set and the device will
+// have been partially programmed.
+bool HexFile::streamWrite(FILE *file, SerialPort *port, bool *loadFailed)
+{
+    *loadFailed = false;
+#ifdef _WIN32
+    // No parser thread on this platform; load the whole file first.
+    if (!load(file)) {
+        *loadFailed = true;
+        return false;
+    }
+    return write(port, false);
+#else
+    HexFileStream stream(64);
+    HexFileParseArgs args;
+    args.hex = this;
+    args.file = file;
+    args.stream = &stream;
+    pthread_t thread;
+    if (pthread_create(&thread, 0, parseThread, &args) != 0) {
+        perror("pthread_create");
+        return false;
+    }
+
+    count = 0;
+    progress("Burning program and data memory,");
+    fflush(stdout);
+    HexFileStream::Run run;
+    bool ok = true;
+    while (stream.nextRun(&run)) {
+        if (!writeStreamRun(port, run.start, run.start + run.data.size() - 1,
+                            &(run.data[0]))) {
+            stream.cancel();
+            ok = false;
+            break;
+        }
+    }
+    pthread_join(thread, 0);
+    if (!ok)
+        return false;
+    if (!stream.succeeded()) {
+        progress("\n");
+        *loadFailed = true;
+        return false;
+    }
+    reportCount();
+
+    // Write the contents of config memory.
+    if (_configStart <= _configEnd) {
+        progress("burning id words and fuses,");
+        fflush(stdout);
+        if (_stats)
+            _stats->begin(Stats::ConfigBurn);
+        if (!writeBlock(port, _configStart, _configEnd, false))
+            return false;
+        if (_stats)
+            _stats->end(count);
+        reportCount();
+    } else {
+        progress("skipped burning id words and fuses,");
+    }
+    progress("done.\n");
+    return true;
+#endif
+}
+
+// Prints a progress message, unless they have been turned off.
+void HexFile::progress(const char *format, ...) const
+{
+    if (!_progress)
+        return;
+    va_list va;
+    va_start(va, format);
+    vprintf(format, va);
+    va_end(va);
+}
+
 void HexFile::reportCount()
 {
     if (count == 1)
-        printf(" 1 location,\n");
+        progress(" 1 location");
     else
-        printf(" %lu locations,\n", count);
+        progress(" %lu locations", count);
+    if (unchanged)
+        progress(", %lu unchanged", unchanged);
+    progress(",\n");
     count = 0;
+    unchanged = 0;
 }
 
 // Read a big-endian word value from a buffer.
-static inline HexFile::Word readBigWord
-    (const std::vector<char> &buf, std::vector<char>::size_type index)
+static inline HexFile::Word readBigWord(const unsigned char *buf, size_t index)
 {
-    return ((buf[index] & 0xFF) << 8) | (buf[index + 1] & 0xFF);
+    return (buf[index] << 8) | buf[index + 1];
 }
 
 // Read a little-endian word value from a buffer.
-static inline HexFile::Word readLittleWord
-    (const std::vector<char> &buf, std::vector<char>::size_type index)
+static inline HexFile::Word readLittleWord(const unsigned char *buf, size_t index)
 {
-    return ((buf[index + 1] & 0xFF) << 8) | (buf[index] & 0xFF);
+    return (buf[index + 1] << 8) | buf[index];
 }
 
-bool HexFile::load(FILE *file)
+// Longest record that can be valid: 255 data bytes plus the length,
+// address, type, and checksum bytes.
+#define HEX_RECORD_MAX      (255 + 5)
+
+// Decodes "len" hex digits (len must be even) from "src" into "dst".
+// Returns false if a character is not a hex digit, in which case the
+// contents of "dst" are undefined.  Processes 32 or 16 digits at a time
+// using AVX2 or SSE2 if the compiler is targeting them.
+static bool decodeHex(const char *src, size_t len, unsigned char *dst)
+{
+#if defined(__AVX2__)
+    while (len >= 64) {
+        __m256i c1 = _mm256_loadu_si256((const __m256i *)src);
+        __m256i c2 = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i l1 = _mm256_or_si256(c1, _mm256_set1_epi8(0x20));
+        __m256i l2 = _mm256_or_si256(c2, _mm256_set1_epi8(0x20));
+        __m256i d1 = _mm256_and_si256
+            (_mm256_cmpgt_epi8(c1, _mm256_set1_epi8('0' - 1)),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c1));
+        __m256i d2 = _mm256_and_si256
+            (_mm256_cmpgt_epi8(c2, _mm256_set1_epi8('0' - 1)),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c2));
+        __m256i a1 = _mm256_and_si256
+            (_mm256_cmpgt_epi8(l1, _mm256_set1_epi8('a' - 1)),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l1));
+        __m256i a2 = _mm256_and_si256
+            (_mm256_cmpgt_epi8(l2, _mm256_set1_epi8('a' - 1)),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l2));
+        __m256i ok = _mm256_and_si256(_mm256_or_si256(d1, a1), _mm256_or_si256(d2, a2));
+        if (_mm256_movemask_epi8(ok) != -1)
+            return false;
+        // Digit value is the low nibble, plus 9 for letters.
+        __m256i v1 = _mm256_add_epi8(_mm256_and_si256(c1, _mm256_set1_epi8(0x0F)),
+                                     _mm256_and_si256(a1, _mm256_set1_epi8(9)));
+        __m256i v2 = _mm256_add_epi8(_mm256_and_si256(c2, _mm256_set1_epi8(0x0F)),
+                                     _mm256_and_si256(a2, _mm256_set1_epi8(9)));
+        // Combine the high nibble (even byte) and low nibble (odd byte).
+        v1 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v1, _mm256_set1_epi16(0x00FF)), 4),
+                             _mm256_srli_epi16(v1, 8));
+        v2 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v2, _mm256_set1_epi16(0x00FF)), 4),
+                             _mm256_srli_epi16(v2, 8));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v1, v2), 0xD8);
+        _mm256_storeu_si256((__m256i *)dst, packed);
+        src += 64;
+        dst += 32;
+        len -= 64;
+    }
+#endif
+#if defined(__SSE2__)
+    while (len >= 32) {
+        __m128i c1 = _mm_loadu_si128((const __m128i *)src);
+        __m128i c2 = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i l1 = _mm_or_si128(c1, _mm_set1_epi8(0x20));
+        __m128i l2 = _mm_or_si128(c2, _mm_set1_epi8(0x20));
+        __m128i d1 = _mm_and_si128(_mm_cmpgt_epi8(c1, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmplt_epi8(c1, _mm_set1_epi8('9' + 1)));
+        __m128i d2 = _mm_and_si128(_mm_cmpgt_epi8(c2, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmplt_epi8(c2, _mm_set1_epi8('9' + 1)));
+        __m128i a1 = _mm_and_si128(_mm_cmpgt_epi8(l1, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(l1, _mm_set1_epi8('f' + 1)));
+        __m128i a2 = _mm_and_si128(_mm_cmpgt_epi8(l2, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(l2, _mm_set1_epi8('f' + 1)));
+        __m128i ok = _mm_and_si128(_mm_or_si128(d1, a1), _mm_or_si128(d2, a2));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            return false;
+        __m128i v1 = _mm_add_epi8(_mm_and_si128(c1, _mm_set1_epi8(0x0F)),
+                                  _mm_and_si128(a1, _mm_set1_epi8(9)));
+        __m128i v2 = _mm_add_epi8(_mm_and_si128(c2, _mm_set1_epi8(0x0F)),
+                                  _mm_and_si128(a2, _mm_set1_epi8(9)));
+        v1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, _mm_set1_epi16(0x00FF)), 4),
+                          _mm_srli_epi16(v1, 8));
+        v2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v2, _mm_set1_epi16(0x00FF)), 4),
+                          _mm_srli_epi16(v2, 8));
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(v1, v2));
+        src += 32;
+        dst += 16;
+        len -= 32;
+    }
+#endif
+    while (len >= 2) {
+        int hi = hexDigit(src[0]);
+        int lo = hexDigit(src[1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        *dst++ = (unsigned char)((hi << 4) | lo);
+        src += 2;
+        len -= 2;
+    }
+    return true;
+}
+
+// Sums the bytes in a decoded record for checksum purposes.
+static unsigned int sumBytes(const unsigned char *buf, size_t len)
+{
+    unsigned int sum = 0;
+#if defined(__SSE2__)
+    __m128i total = _mm_setzero_si128();
+    while (len >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)buf);
+        total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+        buf += 16;
+        len -= 16;
+    }
+    sum = (unsigned int)_mm_cvtsi128_si32(total) +
+          (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+#endif
+    while (len > 0) {
+        sum += *buf++;
+        --len;
+    }
+    return sum;
+}
+
+// Decodes the body of a record that contains white space or other
+// unexpected characters, with the same rules as the fast path.
+// Returns the number of bytes, or -1 if the body is invalid.
+static int decodeHexSlow(const char *src, size_t len, unsigned char *dst)
 {
-    bool startLine = true;
-    std::vector<char> line;
-    int ch, digit;
+    int size = 0;
     int nibble = -1;
-    bool ok = false;
-    int checksum;
-    Address baseAddress = 0;
-    std::vector<char>::size_type index;
-    while ((ch = getc(file)) != EOF) {
+    while (len > 0) {
+        char ch = *src++;
+        --len;
         if (ch == ' ' || ch == '\t')
             continue;
-        if (ch == '\r' || ch == '\n') {
-            if (nibble != -1) {
-                // Half a byte at the end of the line.
-                break;
-            }
-            if (!startLine) {
-                if (line.size() < 5) {
-                    // Not enough bytes to form a valid line.
-                    break;
-                }
-                if ((line[0] & 0xFF) != (int)(line.size() - 5)) {
-                    // Size value is incorrect.
-                    break;
-                }
-                checksum = 0;
-                for (index = 0; index < (line.size() - 1); ++index)
-                    checksum += (line[index] & 0xFF);
-                checksum = (((checksum & 0xFF) ^ 0xFF) + 1) & 0xFF;
-                if (checksum != (line[line.size() - 1] & 0xFF)) {
-                    // Checksum for this line is incorrect.
-                    break;
-                }
-                if (line[3] == 0x00) {
-                    // Data record.
-                    if ((line[0] & 0x01) != 0)
-                        break;      // Line length must be even.
-                    Address address = baseAddress + readBigWord(line, 1);
-                    if (address & 0x0001)
-                        break;      // Address must also be even.
-                    address >>= 1;  // Convert byte address into word address.
-                    for (index = 0; index < (line.size() - 5); index += 2) {
-                        Word word = readLittleWord(line, index + 4);
-                        setWord(address + index / 2, word);
-                    }
-                } else if (line[3] == 0x01) {
-                    // Stop processing at the End Of File Record.
-                    if (line[0] != 0x00)
-                        break;      // Invalid end of file record.
-                    ok = true;
-                    break;
-                } else if (line[3] == 0x02) {
-                    // Extended Segment Address Record.
-                    if (line[0] != 0x02)
-                        break;      // Invalid address record.
-                    baseAddress = ((Address)readBigWord(line, 4)) << 4;
-                } else if (line[3] == 0x04) {
-                    // Extended Linear Address Record.
-                    if (line[0] != 0x02)
-                        break;      // Invalid address record.
-                    baseAddress = ((Address)readBigWord(line, 4)) << 16;
-                } else if (line[3] != 0x03 && line[3] != 0x05) {
-                    // Invalid record type.
-                    break;
-                }
-            }
-            line.clear();
-            startLine = true;
+        int digit = hexDigit(ch);
+        if (digit < 0)
+            return -1;      // Invalid character, including a second ':'.
+        if (nibble == -1) {
+            nibble = digit;
+        } else {
+            if (size >= HEX_RECORD_MAX)
+                return -1;  // Too long for the size byte to be correct.
+            dst[size++] = (unsigned char)((nibble << 4) | digit);
+            nibble = -1;
+        }
+    }
+    if (nibble != -1)
+        return -1;          // Half a byte at the end of the line.
+    return size;
+}
+
+bool HexFile::load(FILE *file)
+{
+    return loadFile(file, 0);
+}
+
+// Loads the contents of a file, optionally passing the data records
+// to "stream" as they are parsed.
+bool HexFile::loadFile(FILE *file, HexFileStream *stream)
+{
+    const char *data;
+    size_t size;
+    std::vector<char> contents;
+#ifndef _WIN32
+    // Map regular files directly into memory and parse them in place.
+    void *mapped = MAP_FAILED;
+    size_t mappedSize = 0;
+    struct stat st;
+    long offset = ftell(file);
+    if (offset >= 0 && fstat(fileno(file), &st) == 0 &&
+            S_ISREG(st.st_mode) && st.st_size > offset) {
+        mappedSize = (size_t)st.st_size;
+        mapped = mmap(0, mappedSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    }
+    if (mapped != MAP_FAILED) {
+        data = (const char *)mapped + offset;
+        size = mappedSize - (size_t)offset;
+    } else
+#endif
+    {
+        // Pipes and other unmappable inputs are read into memory instead.
+        char chunk[8192];
+        size_t len;
+        while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+            contents.insert(contents.end(), chunk, chunk + len);
+        data = contents.empty() ? "" : &(contents[0]);
+        size = contents.size();
+    }
+    bool ok = parse(data, size, stream);
+#ifndef _WIN32
+    if (mapped != MAP_FAILED)
+        munmap(mapped, mappedSize);
+#endif
+    return ok;
+}
+
+// Parses the contents of a hex file, returning true if the End Of File
+// Record was reached with no errors along the way.
+bool HexFile::parse(const char *data, size_t size, HexFileStream *stream)
+{
+    const char *end = data + size;
+    unsigned char line[HEX_RECORD_MAX];
+    Address baseAddress = 0;
+    size_t index;
+    while (data < end) {
+        // Skip white space and blank lines before the ':' at line start.
+        char ch = *data;
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+            ++data;
             continue;
         }
-        if (ch == ':') {
-            if (!startLine) {
-                // ':' did not appear at the start of a line.
-                break;
-            } else {
-                startLine = false;
-                continue;
+        if (ch != ':')
+            return false;   // Hex digit or invalid character at line start.
+        ++data;
+
+        // Find the end of the line.  A record that is not terminated
+        // by CR or LF is never processed.
+        const char *eol = data;
+        while (eol < end && *eol != '\r' && *eol != '\n')
+            ++eol;
+        if (eol >= end)
+            return false;
+
+        // Decode the record, using the fast path if it is pure hex.
+        size_t digits = (size_t)(eol - data);
+        int len;
+        if ((digits % 2) == 0 && digits <= (HEX_RECORD_MAX * 2) &&
+                decodeHex(data, digits, line))
+            len = (int)(digits / 2);
+        else
+            len = decodeHexSlow(data, digits, line);
+        data = eol + 1;
+        if (len < 0)
+            return false;
+
+        // Validate the size and checksum.
+        if (len < 5)
+            return false;   // Not enough bytes to form a valid line.
+        if (line[0] != (len - 5))
+            return false;   // Size value is incorrect.
+        unsigned int checksum = sumBytes(line, (size_t)(len - 1));
+        checksum = (((checksum & 0xFF) ^ 0xFF) + 1) & 0xFF;
+        if (checksum != line[len - 1])
+            return false;   // Checksum for this line is incorrect.
+
+        if (line[3] == 0x00) {
+            // Data record.
+            if ((line[0] & 0x01) != 0)
+                return false;   // Line length must be even.
+            Address address = baseAddress + readBigWord(line, 1);
+            if (address & 0x0001)
+                return false;   // Address must also be even.
+            address >>= 1;      // Convert byte address into word address.
+            Word words[HEX_RECORD_MAX / 2];
+            size_t numWords = (size_t)(len - 5) / 2;
+            for (index = 0; index < numWords; ++index) {
+                words[index] = readLittleWord(line, index * 2 + 4);
+                setWord(address + index, words[index]);
             }
-        } else if (ch >= '0' && ch <= '9') {
-            digit = ch - '0';
-        } else if (ch >= 'A' && ch <= 'F') {
-            digit = ch - 'A' + 10;
-        } else if (ch >= 'a' && ch <= 'f') {
-            digit = ch - 'a' + 10;
-        } else {
-            // Invalid character in hex file.
-            break;
+#ifndef _WIN32
+            if (stream && !stream->addWords(address, words, numWords))
+                return false;   // Burning has been abandoned.
+#endif
+        } else if (line[3] == 0x01) {
+            // Stop processing at the End Of File Record.
+            return line[0] == 0x00;
+        } else if (line[3] == 0x02) {
+            // Extended Segment Address Record.
+            if (line[0] != 0x02)
+                return false;   // Invalid address record.
+            baseAddress = ((Address)readBigWord(line, 4)) << 4;
+        } else if (line[3] == 0x04) {
+            // Extended Linear Address Record.
+            if (line[0] != 0x02)
+                return false;   // Invalid address record.
+            baseAddress = ((Address)readBigWord(line, 4)) << 16;
+        } else if (line[3] != 0x03 && line[3] != 0x05) {
+            // Invalid record type.
+            return false;
         }
-        if (startLine) {
-            // Hex digit at the start of a line.
-            break;
+    }
+    return false;
+}
+
+// Formats hex records into a large buffer that is flushed with a
+// single fwrite() call whenever it fills up.
+class HexFileWriter
+{
+public:
+    HexFileWriter(FILE *file) : _file(file), _len(0), _error(false)
+    {
+        static const char hexchars[] = "0123456789ABCDEF";
+        for (int value = 0; value < 256; ++value) {
+            _hexPairs[value * 2] = hexchars[value >> 4];
+            _hexPairs[value * 2 + 1] = hexchars[value & 0x0F];
         }
-        if (nibble == -1) {
-            nibble = digit;
-        } else {
-            line.push_back((char)((nibble << 4) | digit));
-            nibble = -1;
+    }
+
+    // Writes a record, followed by its checksum and a newline.
+    void writeRecord(const unsigned char *record, int len)
+    {
+        if ((_len + len * 2 + 4) > sizeof(_buffer))
+            flush();
+        char *out = _buffer + _len;
+        *out++ = ':';
+        for (int index = 0; index < len; ++index) {
+            const char *pair = _hexPairs + record[index] * 2;
+            out[0] = pair[0];
+            out[1] = pair[1];
+            out += 2;
         }
+        unsigned int checksum = sumBytes(record, (size_t)len);
+        checksum = (((checksum & 0xFF) ^ 0xFF) + 1) & 0xFF;
+        out[0] = _hexPairs[checksum * 2];
+        out[1] = _hexPairs[checksum * 2 + 1];
+        out[2] = '\n';
+        _len = (size_t)(out + 3 - _buffer);
+    }
+
+    // Writes the End Of File Record.
+    void writeEnd()
+    {
+        static const unsigned char eof[4] = {0x00, 0x00, 0x00, 0x01};
+        writeRecord(eof, 4);
+    }
+
+    // Flushes the buffer, returning false if an error has occurred.
+    bool flush()
+    {
+        if (_len > 0 && fwrite(_buffer, 1, _len, _file) != _len)
+            _error = true;
+        _len = 0;
+        return !_error;
     }
+
+private:
+    FILE *_file;
+    size_t _len;
+    bool _error;
+    char _hexPairs[512];
+    char _buffer[65536];
+};
+
+// Closes an output file, reporting any write errors that occurred.
+static bool closeOutput(const std::string &filename, FILE *file, HexFileWriter *writer)
+{
+    bool ok = writer->flush();
+    delete writer;
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        perror(filename.c_str());
     return ok;
 }
 
@@ -483,20 +1383,20 @@ bool HexFile::save(const std::string &filename, bool skipOnes) const
         perror(filename.c_str());
         return false;
     }
-    saveRange(file, _programStart, _programEnd, skipOnes);
+    HexFileWriter *writer = new HexFileWriter(file);
+    saveRange(writer, _programStart, _programEnd, skipOnes);
     if (_configStart <= _configEnd) {
         if ((_configEnd - _configStart + 1) >= 8) {
-            saveRange(file, _configStart, _configStart + 5, skipOnes);
+            saveRange(writer, _configStart, _configStart + 5, skipOnes);
             // Don't bother saving the device ID word at _configStart + 6.
-            saveRange(file, _configStart + 7, _configEnd, skipOnes);
+            saveRange(writer, _configStart + 7, _configEnd, skipOnes);
         } else {
-            saveRange(file, _configStart, _configEnd, skipOnes);
+            saveRange(writer, _configStart, _configEnd, skipOnes);
         }
     }
-    saveRange(file, _dataStart, _dataEnd, skipOnes);
-    fputs(":00000001FF\n", file);
-    fclose(file);
-    return true;
+    saveRange(writer, _dataStart, _dataEnd, skipOnes);
+    writer->writeEnd();
+    return closeOutput(filename, file, writer);
 }
 
 bool HexFile::saveCC(const std::string &filename, bool skipOnes) const
@@ -506,18 +1406,25 @@ bool HexFile::saveCC(const std::string &filename, bool skipOnes) const
         perror(filename.c_str());
         return false;
     }
-    std::vector<HexFileBlock>::const_iterator it;
-    for (it = blocks.begin(); it != blocks.end(); ++it) {
-        Address start = (*it).address;
-        Address end = start + (*it).data.size() - 1;
-        saveRange(file, start, end, skipOnes);
+    HexFileWriter *writer = new HexFileWriter(file);
+    Address start = 0;
+    Address runStart, runEnd, nextStart, nextEnd;
+    while (findRun(start, ~((Address)0), &runStart, &runEnd)) {
+        // Merge runs that continue across region boundaries.
+        while (runEnd != ~((Address)0) &&
+                findRun(runEnd + 1, ~((Address)0), &nextStart, &nextEnd) &&
+                nextStart == (runEnd + 1))
+            runEnd = nextEnd;
+        saveRange(writer, runStart, runEnd, skipOnes);
+        if (runEnd == ~((Address)0))
+            break;
+        start = runEnd + 1;
     }
-    fputs(":00000001FF\n", file);
-    fclose(file);
-    return true;
+    writer->writeEnd();
+    return closeOutput(filename, file, writer);
 }
 
-void HexFile::saveRange(FILE *file, Address start, Address end, bool skipOnes) const
+void HexFile::saveRange(HexFileWriter *writer, Address start, Address end, bool skipOnes) const
 {
     if (skipOnes) {
         while (start <= end) {
@@ -528,15 +1435,15 @@ void HexFile::saveRange(FILE *file, Address start, Address end, bool skipOnes) c
             Address limit = start + 1;
             while (limit <= end && !isAllOnes(limit))
                 ++limit;
-            saveRange(file, start, limit - 1);
+            saveRange(writer, start, limit - 1);
             start = limit;
         }
     } else {
-        saveRange(file, start, end);
+        saveRange(writer, start, end);
     }
 }
 
-void HexFile::saveRange(FILE *file, Address start, Address end) const
+void HexFile::saveRange(HexFileWriter *writer, Address start, Address end) const
 {
     Address current = start;
     Address currentSegment = ~((Address)0);
@@ -550,7 +1457,7 @@ void HexFile::saveRange(FILE *file, Address start, Address end) const
         format = _format;
     if (format == FORMAT_IHX8M)
         needsSegments = false;
-    char buffer[64];
+    unsigned char buffer[64];
     while (current <= end) {
         Address byteAddress = current * 2;
         Address segment = byteAddress >> 16;
@@ -559,58 +1466,39 @@ void HexFile::saveRange(FILE *file, Address start, Address end) const
                 // Over 64K boundary: output an Extended Segment Address Record.
                 currentSegment = segment;
                 segment <<= 12;
-                buffer[0] = (char)0x02;
-                buffer[1] = (char)0x00;
-                buffer[2] = (char)0x00;
-                buffer[3] = (char)0x02;
-                buffer[4] = (char)(segment >> 8);
-                buffer[5] = (char)segment;
-                writeLine(file, buffer, 6);
+                buffer[0] = 0x02;
+                buffer[1] = 0x00;
+                buffer[2] = 0x00;
+                buffer[3] = 0x02;
+                buffer[4] = (unsigned char)(segment >> 8);
+                buffer[5] = (unsigned char)segment;
+                writer->writeRecord(buffer, 6);
             } else {
                 // Over 1M boundary: output an Extended Linear Address Record.
                 currentSegment = segment;
-                buffer[0] = (char)0x02;
-                buffer[1] = (char)0x00;
-                buffer[2] = (char)0x00;
-                buffer[3] = (char)0x04;
-                buffer[4] = (char)(segment >> 8);
-                buffer[5] = (char)segment;
-                writeLine(file, buffer, 6);
+                buffer[0] = 0x02;
+                buffer[1] = 0x00;
+                buffer[2] = 0x00;
+                buffer[3] = 0x04;
+                buffer[4] = (unsigned char)(segment >> 8);
+                buffer[5] = (unsigned char)segment;
+                writer->writeRecord(buffer, 6);
             }
         }
         if ((current + 7) <= end)
-            buffer[0] = (char)0x10;
+            buffer[0] = 0x10;
         else
-            buffer[0] = (char)((end - current + 1) * 2);
-        buffer[1] = (char)(byteAddress >> 8);
-        buffer[2] = (char)byteAddress;
-        buffer[3] = (char)0x00;
+            buffer[0] = (unsigned char)((end - current + 1) * 2);
+        buffer[1] = (unsigned char)(byteAddress >> 8);
+        buffer[2] = (unsigned char)byteAddress;
+        buffer[3] = 0x00;
         int len = 4;
         while (current <= end && len < (4 + 16)) {
             Word value = word(current);
-            buffer[len++] = (char)value;
-            buffer[len++] = (char)(value >> 8);
+            buffer[len++] = (unsigned char)value;
+            buffer[len++] = (unsigned char)(value >> 8);
             ++current;
         }
-        writeLine(file, buffer, len);
-    }
-}
-
-void HexFile::writeLine(FILE *file, const char *buffer, int len)
-{
-    static const char hexchars[] = "0123456789ABCDEF";
-    int checksum = 0;
-    int index;
-    for (index = 0; index < len; ++index)
-        checksum += (buffer[index] & 0xFF);
-    checksum = (((checksum & 0xFF) ^ 0xFF) + 1) & 0xFF;
-    putc(':', file);
-    for (index = 0; index < len; ++index) {
-        int value = buffer[index];
-        putc(hexchars[(value >> 4) & 0x0F], file);
-        putc(hexchars[value & 0x0F], file);
+        writer->writeRecord(buffer, len);
     }
-    putc(hexchars[(checksum >> 4) & 0x0F], file);
-    putc(hexchars[checksum & 0x0F], file);
-    putc('\n', file);
 }
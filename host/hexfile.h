@@ -20,6 +20,7 @@
 
 #include "serialport.h"
 #include <vector>
+#include <map>
 #include <string>
 #include <stdio.h>
 
@@ -28,6 +29,13 @@
 #define FORMAT_IHX16        1
 #define FORMAT_IHX32        2
 
+// Number of mismatched words to report before giving up on a verify.
+#define VERIFY_MAX_MISMATCHES   16
+
+class HexFileWriter;
+class HexFileStream;
+class Stats;
+
 class HexFile
 {
 public:
@@ -39,9 +47,19 @@ public:
 
     bool setDeviceDetails(const DeviceInfoMap &details);
 
-    std::string deviceName() { return _deviceName; }
+    std::string deviceName() const { return _deviceName; }
     void setDeviceName(const std::string &name) { _deviceName = name; }
 
+    Stats *stats() const { return _stats; }
+    void setStats(Stats *stats) { _stats = stats; }
+
+    bool reportsProgress() const { return _progress; }
+    void setReportsProgress(bool progress) { _progress = progress; }
+
+    // Set when the device has been erased, so blank words need not be sent.
+    bool elideBlank() const { return _elideBlank; }
+    void setElideBlank(bool elide) { _elideBlank = elide; }
+
     int format() const { return _format; }
     void setFormat(int format) { _format = format; }
 
@@ -75,6 +93,14 @@ public:
     int dataBits() const { return _dataBits; }
     void setDataBits(int bits) { _dataBits = bits; }
 
+    // Size of a write page in words, or zero if the device has no pages.
+    Address pageSize() const { return _pageSize; }
+    void setPageSize(Address size) { _pageSize = size; }
+
+    // Bits in the configuration word that are preserved when burning.
+    Word configSave() const { return _configSave; }
+    void setConfigSave(Word mask) { _configSave = mask; }
+
     Address programSizeWords() const { return _programEnd - _programStart + 1; }
     Address dataSizeBytes() const
     {
@@ -83,23 +109,34 @@ public:
 
     Word word(Address address) const;
     void setWord(Address address, Word word);
+    Address wordCount() const;
 
+    Word blankWord(Address address) const;
     bool isAllOnes(Address address) const;
     bool canForceCalibration() const;
+    bool canDiffWrite() const;
 
     bool read(SerialPort *port);
     bool write(SerialPort *port, bool forceCalibration);
+    bool diffWrite(SerialPort *port, bool forceCalibration);
+    bool verify(SerialPort *port, bool forceCalibration, Address maxMismatches = VERIFY_MAX_MISMATCHES);
+    bool verifyChecksum(SerialPort *port, bool forceCalibration);
 
     bool load(FILE *file);
+    bool streamWrite(FILE *file, SerialPort *port, bool *loadFailed);
 
     bool save(const std::string &filename, bool skipOnes) const;
     bool saveCC(const std::string &filename, bool skipOnes) const;
 
 private:
-    struct HexFileBlock
+    // Dense storage for one of the device's memory areas, with a bitmap
+    // that records which words have actually been set.
+    struct HexFileRegion
     {
-        Address address;
+        Address start;
+        Address end;
         std::vector<Word> data;
+        std::vector<unsigned long> present;
     };
 
     std::string _deviceName;
@@ -113,16 +150,43 @@ private:
     Address _reservedEnd;
     int _programBits;
     int _dataBits;
+    Word _configSave;
+    Address _pageSize;
     int _format;
-    std::vector<HexFileBlock> blocks;
+    Stats *_stats;
+    bool _progress;
+    bool _elideBlank;
+    HexFileRegion regions[3];
+    std::map<Address, Word> extra;
     Address count;
+    Address unchanged;
+
+    void initRegions();
+    void clearWords();
+    const HexFileRegion *findRegion(Address address) const;
+    bool findRun(Address from, Address to, Address *runStart, Address *runEnd) const;
 
     bool readBlock(SerialPort *port, Address start, Address end);
     bool writeBlock(SerialPort *port, Address start, Address end, bool forceCalibration);
-
-    void saveRange(FILE *file, Address start, Address end, bool skipOnes) const;
-    void saveRange(FILE *file, Address start, Address end) const;
-    static void writeLine(FILE *file, const char *buffer, int len);
+    bool writeRun(SerialPort *port, Address start, Address end, const Word *data, bool forceCalibration);
+    bool writeChanged(SerialPort *port, Address start, Address end, const Word *data, const Word *current, bool forceCalibration);
+    bool diffBlock(SerialPort *port, Address start, Address end, bool forceCalibration);
+    bool diffRange(SerialPort *port, Address start, Address end, bool forceCalibration);
+    bool diffPage(SerialPort *port, Address start, Address end, const Word *data, bool forceCalibration);
+    bool sameWord(Address address, Word word1, Word word2, bool forceCalibration) const;
+    bool verifyRegions(SerialPort *port, bool forceCalibration, bool checksums, Address maxMismatches);
+    bool verifyBlock(SerialPort *port, Address start, Address end, bool forceCalibration, bool checksums, Address *mismatches, Address maxMismatches);
+    bool compareRun(SerialPort *port, Address start, Address end, bool forceCalibration, Address *mismatches, Address maxMismatches);
+    bool checksumRun(SerialPort *port, Address start, Address end, Address *mismatches);
+
+    bool loadFile(FILE *file, HexFileStream *stream);
+    bool parse(const char *data, size_t size, HexFileStream *stream);
+    bool writeStreamRun(SerialPort *port, Address start, Address end, const Word *data);
+    static void *parseThread(void *arg);
+
+    void saveRange(HexFileWriter *writer, Address start, Address end, bool skipOnes) const;
+    void saveRange(HexFileWriter *writer, Address start, Address end) const;
+    void progress(const char *format, ...) const;
     void reportCount();
 };
 
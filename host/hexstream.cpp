@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hexstream.h"
+
+// Runs are handed to the consumer once they reach this many words.
+// The consumer merges queued runs that are contiguous, so this only
+// determines how soon the first WRITEBIN command can be sent.
+#define STREAM_RUN_WORDS    32
+
+HexFileStream::HexFileStream(size_t maxRuns)
+    : maxRuns(maxRuns)
+    , finished(false)
+    , failed(false)
+    , cancelled(false)
+{
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&notEmpty, 0);
+    pthread_cond_init(&notFull, 0);
+    pending.start = 0;
+}
+
+HexFileStream::~HexFileStream()
+{
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&mutex);
+}
+
+// Adds the words from a data record to the stream.  Records that continue
+// the current run or move forward in memory are streamed straight away.
+// Records that go backwards are deferred until the end of the file.
+bool HexFileStream::addWords(Address address, const Word *words, size_t count)
+{
+    while (count > 0) {
+        // Once a run has been flushed, "pending.start" is left pointing
+        // just past it and anything earlier has to be deferred.
+        Address limit = pending.start + pending.data.size();
+        if (!pending.data.empty() && address >= pending.start &&
+                address <= limit) {
+            // Overwrite or extend the run that has not been sent yet.
+            size_t offset = (size_t)(address - pending.start);
+            if (offset < pending.data.size()) {
+                pending.data[offset] = *words;
+            } else {
+                pending.data.push_back(*words);
+                if (pending.data.size() >= STREAM_RUN_WORDS && !flushPending())
+                    return false;
+            }
+        } else if (address >= limit) {
+            // Moving forward in memory, so start a new run.
+            if (!flushPending())
+                return false;
+            pending.start = address;
+            pending.data.push_back(*words);
+        } else {
+            // Already streamed past this address, so hold it back.
+            deferred[address] = *words;
+        }
+        ++address;
+        ++words;
+        --count;
+    }
+    return true;
+}
+
+// Indicates that the producer has finished parsing the file.  If "ok" is
+// true, the remaining runs are sent, followed by the deferred words.
+void HexFileStream::finish(bool ok)
+{
+    if (ok && flushPending()) {
+        std::map<Address, Word>::const_iterator it = deferred.begin();
+        while (it != deferred.end()) {
+            Run run;
+            run.start = (*it).first;
+            do {
+                run.data.push_back((*it).second);
+                ++it;
+            } while (it != deferred.end() &&
+                     (*it).first == (run.start + run.data.size()));
+            if (!push(run))
+                break;
+        }
+    }
+    deferred.clear();
+    pthread_mutex_lock(&mutex);
+    finished = true;
+    if (!ok) {
+        failed = true;
+        queue.clear();
+    }
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool HexFileStream::flushPending()
+{
+    if (pending.data.empty())
+        return true;
+    Run run;
+    run.start = pending.start;
+    run.data.swap(pending.data);
+    pending.start = run.start + run.data.size();
+    return push(run);
+}
+
+bool HexFileStream::push(Run &run)
+{
+    pthread_mutex_lock(&mutex);
+    while (!cancelled && queue.size() >= maxRuns)
+        pthread_cond_wait(&notFull, &mutex);
+    bool ok = !cancelled;
+    if (ok) {
+        queue.push_back(Run());
+        queue.back().start = run.start;
+        queue.back().data.swap(run.data);
+        pthread_cond_signal(&notEmpty);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+// Fetches the next run, merging any queued runs that follow on from it.
+bool HexFileStream::nextRun(Run *run)
+{
+    pthread_mutex_lock(&mutex);
+    while (queue.empty() && !finished)
+        pthread_cond_wait(&notEmpty, &mutex);
+    bool ok = !queue.empty() && !failed;
+    if (ok) {
+        run->start = queue.front().start;
+        run->data.swap(queue.front().data);
+        queue.pop_front();
+        while (!queue.empty() &&
+                queue.front().start == (run->start + run->data.size())) {
+            run->data.insert(run->data.end(), queue.front().data.begin(),
+                             queue.front().data.end());
+            queue.pop_front();
+        }
+        pthread_cond_broadcast(&notFull);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+// Cancels the stream from the consumer side; e.g. because a write failed.
+void HexFileStream::cancel()
+{
+    pthread_mutex_lock(&mutex);
+    cancelled = true;
+    queue.clear();
+    pthread_cond_broadcast(&notFull);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool HexFileStream::succeeded()
+{
+    pthread_mutex_lock(&mutex);
+    bool ok = finished && !failed;
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
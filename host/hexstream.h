@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HEXSTREAM_H
+#define HEXSTREAM_H
+
+#include "hexfile.h"
+#include <deque>
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+// Bounded queue of address-ordered word runs that carries the contents
+// of a hex file from a parser thread to the thread that is burning it.
+// Records that arrive out of order are held back until the end.
+class HexFileStream
+{
+public:
+    typedef HexFile::Address Address;
+    typedef HexFile::Word Word;
+
+    struct Run
+    {
+        Address start;
+        std::vector<Word> data;
+    };
+
+    explicit HexFileStream(size_t maxRuns);
+    ~HexFileStream();
+
+    // Producer side.  addWords() returns false if the consumer has
+    // cancelled the stream and the producer should stop.
+    bool addWords(Address address, const Word *words, size_t count);
+    void finish(bool ok);
+
+    // Consumer side.  nextRun() blocks until a run is available and
+    // returns false at the end of the stream or if the producer failed.
+    bool nextRun(Run *run);
+    void cancel();
+
+    // Returns true once the producer has finished with no errors.
+    bool succeeded();
+
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    std::deque<Run> queue;
+    size_t maxRuns;
+    bool finished;
+    bool failed;
+    bool cancelled;
+
+    // Only accessed by the producer.
+    Run pending;
+    std::map<Address, Word> deferred;
+
+    bool flushPending();
+    bool push(Run &run);
+};
+
+#endif
@@ -17,11 +17,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "serialport.h"
 #include "hexfile.h"
+#include "stats.h"
 
 /* The command-line options are deliberately designed to be compatible
  * with picprog: http://hyvatti.iki.fi/~jaakko/pic/picprog.html */
@@ -52,15 +60,24 @@ static struct option long_options[] = {
     {"slow", no_argument, 0, 'N'},
 
     /* These options are specific to ardpicprog - not present in picprog */
+    {"batch", optional_argument, 0, 'B'},
+    {"diff-burn", no_argument, 0, 'D'},
     {"list-devices", no_argument, 0, 'l'},
+    {"no-reset", no_argument, 0, 'R'},
+    {"sockets", required_argument, 0, 'K'},
     {"speed", required_argument, 0, 'S'},
+    {"stats", optional_argument, 0, 'M'},
+    {"stream", no_argument, 0, 'T'},
+    {"transfer-speed", required_argument, 0, 'X'},
+    {"verify", optional_argument, 0, 'Y'},
+    {"verify-crc", no_argument, 0, 'V'},
 
     {0, 0, 0, 0}
 };
 
 bool opt_quiet = false;
 std::string opt_device;
-std::string opt_port;
+std::vector<std::string> opt_ports;
 std::string opt_input;
 std::string opt_output;
 std::string opt_cc_output;
@@ -70,7 +87,25 @@ bool opt_erase = false;
 bool opt_burn = false;
 bool opt_force_calibration = false;
 bool opt_list_devices = false;
+bool opt_no_reset = false;
 int opt_speed = 9600;
+bool opt_stream = false;
+int opt_transfer_speed = 0;
+int opt_stats = STATS_NONE;
+bool opt_batch = false;
+bool opt_verify = false;
+unsigned long opt_max_mismatches = VERIFY_MAX_MISMATCHES;
+bool opt_verify_crc = false;
+bool opt_diff_burn = false;
+int opt_sockets = 1;
+std::string opt_batch_log;
+
+// Time between "DEVICE" polls while waiting for a device in --batch mode.
+#define BATCH_POLL_MS       250
+
+// Set by SIGINT to stop --batch mode once the current device is done.
+static volatile sig_atomic_t batchInterrupted = 0;
+static FILE *batchLog = 0;
 
 #ifndef DEFAULT_PIC_PORT
 #ifdef SERIAL_WIN32
@@ -91,6 +126,38 @@ int opt_speed = 9600;
 #define EXIT_CODE_IO_ERROR          74
 #define EXIT_CODE_UNKNOWN_DEVICE    76
 
+// The input file is parsed once and then shared between the programmers.
+// The first programmer to detect its device loads the file, and the rest
+// take a copy once they have checked that they have the same device.
+struct SharedImage
+{
+#ifndef _WIN32
+    pthread_mutex_t mutex;
+#endif
+    bool loaded;
+    int exitCode;
+    std::string port;
+    HexFile hexFile;
+};
+
+// State for one programmer in a gang.
+struct GangWorker
+{
+    std::string port;
+    SharedImage *image;
+    int exitCode;
+};
+
+static void addPorts(const std::string &ports);
+static void interruptBatch(int sig);
+static int programDevice(const std::string &portName, SharedImage *image);
+static int programSocket(SerialPort *port, const std::string &portName,
+                         SharedImage *image, Stats *stats);
+static int programBatch(SerialPort *port, const std::string &portName,
+                        SharedImage *image, Stats *stats);
+static int loadImage(const std::string &portName, HexFile *hexFile,
+                     Stats *stats, SharedImage *image);
+static int programGang(SharedImage *image);
 static void usage(const char *argv0);
 static void header();
 static void copying();
@@ -103,12 +170,11 @@ int main(int argc, char *argv[])
     if (env && *env != '\0')
         opt_device = env;
     env = getenv("PIC_PORT");
-    if (env && *env != '\0')
-        opt_port = env;
-    if (opt_port.empty())
-        opt_port = DEFAULT_PIC_PORT;
-fputs(opt_port.c_str(), stderr);
-fputs("\n", stderr);
+    bool portsFromEnv = false;
+    if (env && *env != '\0') {
+        addPorts(env);
+        portsFromEnv = true;
+    }
     while ((opt = getopt_long(argc, argv, "c:d:hi:o:p:q",
                               long_options, 0)) != -1) {
         switch (opt) {
@@ -151,13 +217,21 @@ fputs("\n", stderr);
             // List all devices that are supported by the programmer.
             opt_list_devices = true;
             break;
+        case 'R':
+            // Do not reset the Arduino when opening the serial port.
+            opt_no_reset = true;
+            break;
         case 'o':
             // Set the name of the output hexfile.
             opt_output = optarg;
             break;
         case 'p':
-            // Set the serial port to use to access the programmer.
-            opt_port = optarg;
+            // Add a serial port to use to access a programmer.
+            if (portsFromEnv) {
+                opt_ports.clear();
+                portsFromEnv = false;
+            }
+            addPorts(optarg);
             break;
         case 'q':
             // Enable quiet mode.
@@ -171,6 +245,62 @@ fputs("\n", stderr);
             // Set the speed for the serial connection.
             opt_speed = atoi(optarg);
             break;
+        case 'X':
+            // Switch to a faster serial speed after connecting.
+            opt_transfer_speed = atoi(optarg);
+            break;
+        case 'D':
+            // Burn only the words that differ from the device.
+            opt_burn = true;
+            opt_diff_burn = true;
+            break;
+        case 'K':
+            // Program several EEPROMs on the same bus at once.
+            opt_sockets = atoi(optarg);
+            if (opt_sockets < 1 || opt_sockets > 8) {
+                fprintf(stderr, "Invalid --sockets count '%s'\n", optarg);
+                usage(argv[0]);
+                return EXIT_CODE_USAGE;
+            }
+            break;
+        case 'B':
+            // Program one device after another until interrupted.
+            opt_batch = true;
+            if (optarg)
+                opt_batch_log = optarg;
+            break;
+        case 'M':
+            // Print a summary of the time and traffic for each phase.
+            if (!optarg || !strcmp(optarg, "table")) {
+                opt_stats = STATS_TABLE;
+            } else if (!strcmp(optarg, "json")) {
+                opt_stats = STATS_JSON;
+            } else {
+                fprintf(stderr, "Unknown --stats format '%s'\n", optarg);
+                usage(argv[0]);
+                return EXIT_CODE_USAGE;
+            }
+            break;
+        case 'Y':
+            // Verify the device against the input file on the programmer.
+            opt_verify = true;
+            if (optarg) {
+                opt_max_mismatches = strtoul(optarg, 0, 10);
+                if (!opt_max_mismatches) {
+                    fprintf(stderr, "Invalid --verify limit '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_CODE_USAGE;
+                }
+            }
+            break;
+        case 'V':
+            // Verify the device against the input file using checksums.
+            opt_verify_crc = true;
+            break;
+        case 'T':
+            // Burn the input file while it is still being parsed.
+            opt_stream = true;
+            break;
         case 'w':
             // Display warranty message.
             warranty();
@@ -204,9 +334,10 @@ fputs("\n", stderr);
         return EXIT_CODE_USAGE;
     }
 
-    // If we have -i, but no -c or --burn, then report an error.
-    if (!opt_input.empty() && opt_cc_output.empty() && !opt_burn) {
-        fprintf(stderr, "Cannot use --input-hexfile without also specifying --cc-hexfile or --burn\n");
+    // If we have -i, but no -c, --burn, or verify option, then report an error.
+    if (!opt_input.empty() && opt_cc_output.empty() && !opt_burn &&
+            !opt_verify && !opt_verify_crc) {
+        fprintf(stderr, "Cannot use --input-hexfile without also specifying --cc-hexfile, --burn, --verify, or --verify-crc\n");
         usage(argv[0]);
         return EXIT_CODE_USAGE;
     }
@@ -218,6 +349,13 @@ fputs("\n", stderr);
         return EXIT_CODE_USAGE;
     }
 
+    // Cannot use --verify or --verify-crc without -i.
+    if ((opt_verify || opt_verify_crc) && opt_input.empty()) {
+        fprintf(stderr, "Cannot use --verify or --verify-crc without also specifying --input-hexfile\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+
     // Will need --burn if doing --force-calibration.
     if (opt_force_calibration && !opt_burn) {
         fprintf(stderr, "Cannot use --force-calibration without also specifying --burn\n");
@@ -225,11 +363,111 @@ fputs("\n", stderr);
         return EXIT_CODE_USAGE;
     }
 
+    // --diff-burn compares against what is on the device, so the device
+    // must not be erased first, and it needs the whole file up front.
+    if (opt_diff_burn && (opt_erase || opt_stream)) {
+        fprintf(stderr, "Cannot use --diff-burn with --erase or --stream\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+
+    // --diff-burn can only compare against one of the sockets, and
+    // the output file can only hold one of them.
+    if (opt_sockets > 1 && (opt_diff_burn || !opt_output.empty())) {
+        fprintf(stderr, "Cannot use --sockets with --diff-burn or --output-hexfile\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+
+    // --stream only makes sense when burning, and the calibration and
+    // cc output options need the whole file before burning starts.
+    if (opt_stream && (!opt_burn || opt_force_calibration || !opt_cc_output.empty())) {
+        fprintf(stderr, "Cannot use --stream without --burn, or with --force-calibration or --cc-hexfile\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+
+    // Each device in a batch is burnt from the same parsed input file,
+    // and there is nowhere sensible to put the output of each one.
+    if (opt_batch && (!opt_burn || opt_stream || opt_list_devices || !opt_output.empty())) {
+        fprintf(stderr, "Cannot use --batch without --burn, or with --stream, --list-devices, or --output-hexfile\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+    if (!opt_batch_log.empty()) {
+        batchLog = fopen(opt_batch_log.c_str(), "a");
+        if (!batchLog) {
+            perror(opt_batch_log.c_str());
+            return EXIT_CODE_OPEN_INPUT;
+        }
+    }
+
+    // Several programmers can only share a fully-parsed input file, and
+    // the summaries and output files would get in each other's way.
+    if (opt_ports.empty())
+        opt_ports.push_back(DEFAULT_PIC_PORT);
+    if (opt_ports.size() > 1 &&
+            (opt_stream || opt_list_devices || !opt_output.empty() ||
+             opt_stats != STATS_NONE)) {
+        fprintf(stderr, "Cannot use --stream, --list-devices, --output-hexfile, or --stats with more than one programmer\n");
+        usage(argv[0]);
+        return EXIT_CODE_USAGE;
+    }
+
+    SharedImage image;
+    image.loaded = false;
+    image.exitCode = EXIT_CODE_OK;
+#ifndef _WIN32
+    pthread_mutex_init(&(image.mutex), 0);
+#endif
+    if (opt_batch)
+        signal(SIGINT, interruptBatch);
+    int exitCode;
+    if (opt_ports.size() == 1)
+        exitCode = programDevice(opt_ports[0], &image);
+    else
+        exitCode = programGang(&image);
+#ifndef _WIN32
+    pthread_mutex_destroy(&(image.mutex));
+#endif
+    if (batchLog)
+        fclose(batchLog);
+    return exitCode;
+}
+
+// Adds a comma-separated list of serial ports to "opt_ports".
+static void addPorts(const std::string &ports)
+{
+    std::string::size_type posn = 0;
+    while (posn <= ports.size()) {
+        std::string::size_type comma = ports.find(',', posn);
+        if (comma == std::string::npos)
+            comma = ports.size();
+        if (comma > posn)
+            opt_ports.push_back(ports.substr(posn, comma - posn));
+        posn = comma + 1;
+    }
+}
+
+// Runs the whole process for the programmer on "portName" and returns
+// the exit code for it.
+static int programDevice(const std::string &portName, SharedImage *image)
+{
+    bool gang = (opt_ports.size() > 1);
+
     // Try to open the serial port and initialize the programmer.
-    printf("Initializing programmer ...\n");
+    if (!gang)
+        printf("Initializing programmer ...\n");
+    // The statistics are printed when "stats" goes out of scope, which
+    // happens before "port" is closed.
     SerialPort port;
-    if (!port.open(opt_port, opt_speed))
+    Stats stats(&port, opt_stats);
+    stats.begin(Stats::Attach);
+    if (!port.open(portName, opt_speed, !opt_no_reset))
+        return EXIT_CODE_IO_ERROR;
+    if (opt_transfer_speed > 0 && !port.negotiateSpeed(opt_transfer_speed))
         return EXIT_CODE_IO_ERROR;
+    stats.end();
 
     // Does the user want to list the available devices?
     if (opt_list_devices) {
@@ -238,55 +476,88 @@ fputs("\n", stderr);
         return EXIT_CODE_OK;
     }
 
+    if (opt_batch)
+        return programBatch(&port, portName, image, &stats);
+    return programSocket(&port, portName, image, &stats);
+}
+
+// Writes to "opt_sockets" EEPROMs at once and reads from "readSocket",
+// using the "SOCKETS" command of ProgramEEPROM.
+static bool selectSockets(SerialPort *port, const std::string &portName,
+                          int readSocket)
+{
+    char cmd[32];
+    sprintf(cmd, "SOCKETS %X %X", opt_sockets, readSocket);
+    if (!port->command(cmd)) {
+        fprintf(stderr, "%s: cannot select %d EEPROM sockets\n",
+                portName.c_str(), opt_sockets);
+        return false;
+    }
+    return true;
+}
+
+// Detects the device in the programming socket, and then erases, burns,
+// and reads it as requested.  Returns the exit code for the device.
+static int programSocket(SerialPort *port, const std::string &portName,
+                         SharedImage *image, Stats *stats)
+{
+    bool gang = (opt_ports.size() > 1);
+
     // Initialize the device.
-    DeviceInfoMap details = port.initDevice(opt_device);
+    stats->begin(Stats::Detect);
+    DeviceInfoMap details = port->initDevice(opt_device);
     if (details.empty())
         return EXIT_CODE_UNKNOWN_DEVICE;
+    stats->end();
 
     // Copy the device details into the hex file object.
     HexFile hexFile;
     if (!hexFile.setDeviceDetails(details)) {
-        fprintf(stderr, "Device details from programmer are malformed.\n");
+        fprintf(stderr, "%s: device details from programmer are malformed.\n",
+                portName.c_str());
         return EXIT_CODE_UNKNOWN_DEVICE;
     }
     hexFile.setFormat(opt_format);
+    hexFile.setReportsProgress(!gang);
+
+    // Select the EEPROMs to be written at once, which also checks that
+    // all of them are present.
+    if (opt_sockets > 1 && !selectSockets(port, portName, 0))
+        return EXIT_CODE_UNKNOWN_DEVICE;
 
     // Dump the type of device and how much memory it has.
-    printf("Device %s, program memory: %ld words, data memory: %ld bytes.\n",
-           hexFile.deviceName().c_str(), hexFile.programSizeWords(),
-           hexFile.dataSizeBytes());
+    if (!gang) {
+        printf("Device %s, program memory: %ld words, data memory: %ld bytes.\n",
+               hexFile.deviceName().c_str(), hexFile.programSizeWords(),
+               hexFile.dataSizeBytes());
+    }
 
-    // Read the input file.
-    if (!opt_input.empty()) {
-        FILE *file = fopen(opt_input.c_str(), "r");
-        if (!file) {
+    // Read the input file.  With --stream, it is read while burning.
+    FILE *streamFile = 0;
+    if (opt_stream) {
+        streamFile = fopen(opt_input.c_str(), "r");
+        if (!streamFile) {
             perror(opt_input.c_str());
             return EXIT_CODE_OPEN_INPUT;
         }
-        if (!hexFile.load(file)) {
-            fprintf(stderr, "%s: syntax error, not in hex format\n",
-                    opt_input.c_str());
-            fclose(file);
-            return EXIT_CODE_DATA_ERROR;
-        }
-        fclose(file);
-    }
-
-    // Copy the input to the CC output file.
-    if (!opt_cc_output.empty()) {
-        if (!hexFile.saveCC(opt_cc_output, opt_skip_ones))
-            return EXIT_CODE_OPEN_INPUT;
+    } else if (!opt_input.empty()) {
+        int exitCode = loadImage(portName, &hexFile, stats, image);
+        if (exitCode != EXIT_CODE_OK)
+            return exitCode;
     }
+    hexFile.setStats(stats);
 
     // Erase the device if necessary.  If --force-calibration is specified
     // and we have an input that includes calibration information, then use
     // the "NOPRESERVE" option when erasing.
     if (opt_erase) {
+        stats->begin(Stats::Erase);
         if (opt_force_calibration) {
             if (hexFile.canForceCalibration()) {
-                printf("Erasing and removing code protection.\n");
-                if (!port.command("ERASE NOPRESERVE")) {
-                    fprintf(stderr, "Erase of device failed\n");
+                if (!gang)
+                    printf("Erasing and removing code protection.\n");
+                if (!port->command("ERASE NOPRESERVE")) {
+                    fprintf(stderr, "%s: erase of device failed\n", portName.c_str());
                     return EXIT_CODE_IO_ERROR;
                 }
             } else {
@@ -294,36 +565,307 @@ fputs("\n", stderr);
                 return EXIT_CODE_IO_ERROR;
             }
         } else {
-            printf("Erasing and removing code protection.\n");
-            if (!port.command("ERASE")) {
-                fprintf(stderr, "Erase of device failed\n");
+            if (!gang)
+                printf("Erasing and removing code protection.\n");
+            if (!port->command("ERASE")) {
+                fprintf(stderr, "%s: erase of device failed\n", portName.c_str());
                 return EXIT_CODE_IO_ERROR;
             }
         }
+        stats->end();
+
+        // Blank words are already in place, so they need not be burnt.
+        hexFile.setElideBlank(true);
     }
 
     // Burn the input file into the device if requested.
-    if (opt_burn) {
-        if (!hexFile.write(&port, opt_force_calibration)) {
-            fprintf(stderr, "Write to device failed\n");
+    if (opt_burn && streamFile) {
+        bool loadFailed;
+        bool ok = hexFile.streamWrite(streamFile, port, &loadFailed);
+        fclose(streamFile);
+        if (loadFailed) {
+            fprintf(stderr, "%s: syntax error, not in hex format\n",
+                    opt_input.c_str());
+            fprintf(stderr, "Device has been partially programmed\n");
+            return EXIT_CODE_DATA_ERROR;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: write to device failed\n", portName.c_str());
+            return EXIT_CODE_IO_ERROR;
+        }
+    } else if (opt_burn && opt_diff_burn) {
+        if (!hexFile.canDiffWrite()) {
+            fprintf(stderr, "%s: --diff-burn can only burn data memory; use --burn for program memory and fuses\n",
+                    opt_input.c_str());
+            return EXIT_CODE_DATA_ERROR;
+        }
+        if (!hexFile.diffWrite(port, opt_force_calibration)) {
+            fprintf(stderr, "%s: write to device failed\n", portName.c_str());
+            return EXIT_CODE_IO_ERROR;
+        }
+    } else if (opt_burn) {
+        if (!hexFile.write(port, opt_force_calibration)) {
+            fprintf(stderr, "%s: write to device failed\n", portName.c_str());
             return EXIT_CODE_IO_ERROR;
         }
     }
 
+    // Report the EEPROM pages that were left alone because they already
+    // held the right bytes.  Other sketches do not understand "PAGES".
+    unsigned long pagesWritten, pagesSkipped;
+    if ((opt_erase || opt_burn) && port->pageCounts(&pagesWritten, &pagesSkipped)) {
+        stats->addPages(pagesWritten, pagesSkipped);
+        if (!gang) {
+            printf("EEPROM pages: %lu written, %lu skipped as unchanged.\n",
+                   pagesWritten, pagesSkipped);
+        }
+    }
+
+    // Check the device against the input file without reading it back.
+    // With --sockets, each of the EEPROMs is checked in turn.
+    for (int socket = 0; socket < opt_sockets && (opt_verify || opt_verify_crc); ++socket) {
+        if (opt_sockets > 1) {
+            if (!selectSockets(port, portName, socket))
+                return EXIT_CODE_IO_ERROR;
+            if (!gang)
+                printf("Verifying socket %d.\n", socket);
+        }
+        if (opt_verify) {
+            if (!hexFile.verify(port, opt_force_calibration, opt_max_mismatches)) {
+                fprintf(stderr, "%s: verify of device failed\n", portName.c_str());
+                return EXIT_CODE_IO_ERROR;
+            }
+        }
+        if (opt_verify_crc) {
+            if (!hexFile.verifyChecksum(port, opt_force_calibration)) {
+                fprintf(stderr, "%s: verify of device failed\n", portName.c_str());
+                return EXIT_CODE_IO_ERROR;
+            }
+        }
+    }
+
     // If we have an output file, then read the contents of the PIC into it.
     if (!opt_output.empty()) {
-        if (!hexFile.read(&port)) {
-            fprintf(stderr, "Read from device failed\n");
+        if (!hexFile.read(port)) {
+            fprintf(stderr, "%s: read from device failed\n", portName.c_str());
             return EXIT_CODE_IO_ERROR;
         }
+        stats->begin(Stats::Save);
         if (!hexFile.save(opt_output, opt_skip_ones))
             return EXIT_CODE_IO_ERROR;
+        stats->end(hexFile.wordCount());
     }
 
     // Done.
     return EXIT_CODE_OK;
 }
 
+static void interruptBatch(int sig)
+{
+    batchInterrupted = 1;
+}
+
+static void sleepMillis(int millis)
+{
+#ifdef _WIN32
+    ::Sleep(millis);
+#else
+    ::usleep(millis * 1000);
+#endif
+}
+
+// Waits until a device has been inserted into the programming socket, or
+// removed from it.  A device must be seen on two polls in a row before it
+// counts as inserted, to give the operator time to close the socket.
+// Returns false if interrupted or if the programmer stops responding.
+static bool waitForSocket(SerialPort *port, bool inserted)
+{
+    int seen = 0;
+    while (!batchInterrupted) {
+        bool present;
+        if (!port->pollDevice(&present))
+            return false;
+        if (present != inserted)
+            seen = 0;
+        else if (!inserted || ++seen >= 2)
+            return true;
+        sleepMillis(BATCH_POLL_MS);
+    }
+    return false;
+}
+
+// Writes the result for a device in --batch mode to the log, if any.
+static void logResult(const std::string &portName, unsigned long device, int exitCode)
+{
+    if (!batchLog)
+        return;
+    char stamp[64];
+    time_t now = time(0);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    if (exitCode == EXIT_CODE_OK) {
+        fprintf(batchLog, "%s %s %lu pass\n", stamp, portName.c_str(), device);
+    } else {
+        fprintf(batchLog, "%s %s %lu fail %d\n", stamp, portName.c_str(),
+                device, exitCode);
+    }
+    fflush(batchLog);
+}
+
+// Programs one device after another on the same programmer, for --batch.
+// The port stays open and the input file is only parsed once.  Stops when
+// interrupted, if the programmer stops responding, or if the input file
+// is bad.  The exit code is that of the first device that failed.
+static int programBatch(SerialPort *port, const std::string &portName,
+                        SharedImage *image, Stats *stats)
+{
+    int exitCode = EXIT_CODE_OK;
+    unsigned long devices = 0;
+    unsigned long failures = 0;
+    bool badInput = false;
+    for (;;) {
+        printf("%s: waiting for a device ...\n", portName.c_str());
+        fflush(stdout);
+        if (!waitForSocket(port, true))
+            break;
+        int result = programSocket(port, portName, image, stats);
+        port->command("PWROFF");
+        ++devices;
+        logResult(portName, devices, result);
+        if (result == EXIT_CODE_OK) {
+            printf("%s: device %lu ok, remove it\n", portName.c_str(), devices);
+        } else {
+            printf("%s: device %lu failed, exit status %d, remove it\n",
+                   portName.c_str(), devices, result);
+            if (!failures++)
+                exitCode = result;
+            badInput = (result == EXIT_CODE_DATA_ERROR ||
+                        result == EXIT_CODE_OPEN_INPUT);
+            if (badInput)
+                break;
+        }
+        fflush(stdout);
+        if (!waitForSocket(port, false))
+            break;
+    }
+    if (!batchInterrupted && !badInput) {
+        fprintf(stderr, "%s: lost contact with the programmer\n", portName.c_str());
+        if (exitCode == EXIT_CODE_OK)
+            exitCode = EXIT_CODE_IO_ERROR;
+    }
+    printf("%s: %lu devices, %lu failed.\n", portName.c_str(), devices, failures);
+    return exitCode;
+}
+
+// Fills "hexFile" with the contents of the input file.  The first caller
+// parses the file and writes the CC output, and later callers copy the
+// result if their device is the same as the first one.
+static int loadImage(const std::string &portName, HexFile *hexFile,
+                     Stats *stats, SharedImage *image)
+{
+    int exitCode = EXIT_CODE_OK;
+#ifndef _WIN32
+    pthread_mutex_lock(&(image->mutex));
+#endif
+    if (!image->loaded) {
+        image->loaded = true;
+        image->port = portName;
+        stats->begin(Stats::Load);
+        FILE *file = fopen(opt_input.c_str(), "r");
+        if (!file) {
+            perror(opt_input.c_str());
+            exitCode = EXIT_CODE_OPEN_INPUT;
+        } else if (!hexFile->load(file)) {
+            fprintf(stderr, "%s: syntax error, not in hex format\n",
+                    opt_input.c_str());
+            exitCode = EXIT_CODE_DATA_ERROR;
+        }
+        if (file)
+            fclose(file);
+        stats->end(hexFile->wordCount());
+
+        // Copy the input to the CC output file.
+        if (exitCode == EXIT_CODE_OK && !opt_cc_output.empty() &&
+                !hexFile->saveCC(opt_cc_output, opt_skip_ones))
+            exitCode = EXIT_CODE_OPEN_INPUT;
+        image->exitCode = exitCode;
+        if (exitCode == EXIT_CODE_OK)
+            image->hexFile = *hexFile;
+    } else if (image->exitCode != EXIT_CODE_OK) {
+        exitCode = image->exitCode;
+    } else if (image->hexFile.deviceName() != hexFile->deviceName()) {
+        fprintf(stderr, "%s: device is not the same as the one on %s\n",
+                portName.c_str(), image->port.c_str());
+        exitCode = EXIT_CODE_UNKNOWN_DEVICE;
+    } else {
+        *hexFile = image->hexFile;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&(image->mutex));
+#endif
+    return exitCode;
+}
+
+#ifndef _WIN32
+
+static void *gangThread(void *arg)
+{
+    GangWorker *worker = (GangWorker *)arg;
+    worker->exitCode = programDevice(worker->port, worker->image);
+    return 0;
+}
+
+#endif
+
+// Programs the devices on all of the ports in "opt_ports" at once, with
+// a separate thread for each programmer.  The exit code is that of the
+// first programmer that failed, in command-line order.
+static int programGang(SharedImage *image)
+{
+    std::vector<GangWorker> workers(opt_ports.size());
+    for (size_t index = 0; index < opt_ports.size(); ++index) {
+        workers[index].port = opt_ports[index];
+        workers[index].image = image;
+        workers[index].exitCode = EXIT_CODE_IO_ERROR;
+    }
+    printf("Programming %d devices ...\n", (int)workers.size());
+    fflush(stdout);
+#ifdef _WIN32
+    // No threads on this platform, so do the programmers one at a time.
+    for (size_t index = 0; index < workers.size(); ++index)
+        workers[index].exitCode = programDevice(workers[index].port, image);
+#else
+    std::vector<pthread_t> threads(workers.size());
+    std::vector<bool> started(workers.size());
+    for (size_t index = 0; index < workers.size(); ++index) {
+        started[index] = (pthread_create(&(threads[index]), 0, gangThread,
+                                         &(workers[index])) == 0);
+        if (!started[index])
+            perror("pthread_create");
+    }
+    for (size_t index = 0; index < workers.size(); ++index) {
+        if (started[index])
+            pthread_join(threads[index], 0);
+    }
+#endif
+
+    // Report the result for each programmer.
+    int exitCode = EXIT_CODE_OK;
+    int failures = 0;
+    for (size_t index = 0; index < workers.size(); ++index) {
+        if (workers[index].exitCode == EXIT_CODE_OK) {
+            printf("%s: ok\n", workers[index].port.c_str());
+        } else {
+            printf("%s: failed, exit status %d\n", workers[index].port.c_str(),
+                   workers[index].exitCode);
+            if (!failures++)
+                exitCode = workers[index].exitCode;
+        }
+    }
+    printf("%d of %d devices programmed.\n",
+           (int)workers.size() - failures, (int)workers.size());
+    return exitCode;
+}
+
 static void usage(const char *argv0)
 {
     fprintf(stderr, "Usage: %s --quiet -q --warranty --copying --help -h\n", argv0);
@@ -331,6 +873,9 @@ static void usage(const char *argv0)
     fprintf(stderr, "    --input-hexfile INPUT -i INPUT --output-hexfile OUTPUT -o OUTPUT\n");
     fprintf(stderr, "    --ihx8m --ihx16 --ihx32 --cc-hexfile CCFILE -c CCFILE --skip-ones\n");
     fprintf(stderr, "    --erase --burn --force-calibration --list-devices --speed SPEED\n");
+    fprintf(stderr, "    --stream --transfer-speed SPEED --no-reset --stats[=FORMAT]\n");
+    fprintf(stderr, "    --batch[=LOGFILE] --verify[=MAX] --verify-crc --diff-burn\n");
+    fprintf(stderr, "    --sockets COUNT\n");
 }
 
 static void header()
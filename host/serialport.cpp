@@ -18,14 +18,36 @@
 #include "serialport.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <deque>
 
 #define BINARY_TRANSFER_MAX 64
 
+// Time allowed for the sketch to respond, in milliseconds.  Ordinary
+// commands use timeout() instead.  The sketch sends "PENDING" at least
+// every 2 seconds during a long-running command such as "ERASE".
+#define TIMEOUT_PACKET_MS   1000    // Each READBIN or WRITEBIN packet.
+#define TIMEOUT_ERASE_MS    3000    // ERASE, until the first PENDING.
+#define TIMEOUT_PENDING_MS  3000    // Each PENDING extends the timeout.
+#define TIMEOUT_PROBE_MS    1000    // PROGRAM_PIC_VERSION after SPEED.
+
+#define READBIN_RUN         0x80    // "READBIN RLE" run packet.
+#define WRITEBIN_PACKED     0x80    // "WRITEBIN RLE" compressed packet.
+
+// Most words in a compressed "WRITEBIN RLE" packet, so that the sketch
+// can still write a whole packet within TIMEOUT_PACKET_MS.
+#define WRITEBIN_RLE_WORDS  64
+
 SerialPort::SerialPort()
     : buflen(0)
     , bufposn(0)
-    , timeoutSecs(3)
+    , timeoutMillis(1000)
+    , deadline(0)
+    , protocolMinor(0)
+    , currentSpeed(9600)
+    , attachMillis(0)
 {
+    memset(&counters, 0, sizeof(counters));
     init();
 }
 
@@ -122,14 +144,146 @@ bool SerialPort::command(const std::string &cmd)
     std::string line = cmd;
     line += '\n';
     write(line.c_str(), line.length());
-    std::string response = readLine();
+    ++(counters.roundTrips);
+    int timeout = timeoutMillis;
+    if (cmd.compare(0, 5, "ERASE") == 0)
+        timeout = TIMEOUT_ERASE_MS;
+    std::string response = readLine(timeout);
     while (response == "PENDING") {
         // Long-running operation: sketch has asked for a longer timeout.
-        response = readLine();
+        response = readLine(TIMEOUT_PENDING_MS);
     }
     return response == "OK";
 }
 
+// Checks if there is a device in the programming socket using "DEVICE",
+// without selecting it.  Returns false if the programmer did not respond.
+bool SerialPort::pollDevice(bool *present)
+{
+    bool timedOut;
+    write("DEVICE\n", 7);
+    ++(counters.roundTrips);
+    std::string response = readLine(timeoutMillis, &timedOut);
+    if (timedOut)
+        return false;
+    *present = (response == "OK");
+    if (*present)
+        readDeviceInfo();
+    return true;
+}
+
+// Switches the serial link to a faster speed using the "SPEED" command
+// from version 1.2 of the protocol.  If the sketch cannot use the speed,
+// or the first command at the new speed fails, then both sides fall
+// back to the current speed.  Returns false only if the link is lost.
+bool SerialPort::negotiateSpeed(int speed)
+{
+    if (speed == currentSpeed)
+        return true;
+    if (protocolMinor < 2) {
+        fprintf(stderr, "Programmer cannot change speed, staying at %d baud\n",
+                currentSpeed);
+        return true;
+    }
+    char buffer[64];
+    sprintf(buffer, "SPEED %d", speed);
+    if (!command(buffer)) {
+        fprintf(stderr, "Programmer does not support %d baud, staying at %d baud\n",
+                speed, currentSpeed);
+        return true;
+    }
+
+    // The sketch is now waiting for "PROGRAM_PIC_VERSION" at the new speed.
+    int oldSpeed = currentSpeed;
+    if (setSpeed(speed) && probeVersion(1)) {
+        currentSpeed = speed;
+        return true;
+    }
+
+    // The sketch reverts to the old speed if it does not see a valid
+    // command soon after the switch, so go back and look for it there.
+    fprintf(stderr, "Could not communicate at %d baud, staying at %d baud\n",
+            speed, oldSpeed);
+    return setSpeed(oldSpeed) && probeVersion(3);
+}
+
+// Sends "PROGRAM_PIC_VERSION" until a version 1 response is received,
+// waiting for up to a second each time.
+bool SerialPort::probeVersion(int retries)
+{
+    bool found = false;
+    while (retries > 0 && !found) {
+        write("PROGRAM_PIC_VERSION\n", 20);
+        ++(counters.roundTrips);
+        found = (readLine(TIMEOUT_PROBE_MS).find("ProgramPIC 1.") == 0);
+        --retries;
+    }
+    return found;
+}
+
+// Total time to wait for the sketch to respond after opening the port,
+// how often to probe it, and how long the line must be quiet afterwards.
+#define ATTACH_TIMEOUT_MS   5000
+#define ATTACH_PROBE_MS     50
+#define ATTACH_QUIET_MS     100
+
+// Waits for the sketch to respond to "PROGRAM_PIC_VERSION" after the
+// port has been opened.  If the Arduino has auto-reset, then the probes
+// will be swallowed by the bootloader for a while and it may send junk
+// of its own.  Junk is discarded and the sketch is probed again whenever
+// the line has been quiet for 50 milliseconds.  Once a response is seen,
+// the responses to any extra probes are drained before returning.
+bool SerialPort::attach(const std::string &deviceName, unsigned long startTime)
+{
+    std::string line;
+    bool found = false;
+    bool incompatible = false;
+    bool probe = true;
+    int probes = 0;
+    while (!found && !incompatible &&
+                (currentMillis() - startTime) < ATTACH_TIMEOUT_MS) {
+        if (probe) {
+            write("PROGRAM_PIC_VERSION\n", 20);
+            ++(counters.roundTrips);
+            ++probes;
+        }
+        startTimer(ATTACH_PROBE_MS);
+        int ch = readChar();
+        probe = (ch == -1);
+        if (ch == 0x0A) {
+            // Look for the version anywhere in the line, in case it
+            // is preceded by junk from the bootloader.
+            std::string::size_type posn = line.find("ProgramPIC ");
+            if (posn == std::string::npos) {
+                probe = true;
+            } else if (line.compare(posn, 13, "ProgramPIC 1.") == 0) {
+                // We've found a version 1 sketch, which we can talk to.
+                protocolMinor = atoi(line.c_str() + posn + 13);
+                found = true;
+            } else {
+                // Version 2 or higher sketch - cannot talk to this.
+                incompatible = true;
+            }
+            line = std::string();
+        } else if (ch != -1 && ch != 0x0D && ch != 0x00 && line.size() < 256) {
+            line += (char)ch;
+        }
+    }
+    if (found) {
+        if (probes > 1) {
+            // Discard responses to extra probes.
+            do {
+                startTimer(ATTACH_QUIET_MS);
+            } while (readChar() != -1);
+        }
+        attachMillis = currentMillis() - startTime;
+    } else {
+        fprintf(stderr, "%s: did not find a compatible PIC programmer\n",
+                deviceName.c_str());
+    }
+    return found;
+}
+
 // Returns a list of the available devices.
 std::string SerialPort::devices()
 {
@@ -142,16 +296,34 @@ std::string SerialPort::devices()
 // Reads a large block of data using "READBIN".
 bool SerialPort::readData(unsigned long start, unsigned long end, unsigned short *data)
 {
+    // Version 1.5 of the protocol can send runs of identical words,
+    // such as blank memory, as a single run packet.
     char buffer[256];
-    sprintf(buffer, "READBIN %04lX-%04lX", start, end);
+    sprintf(buffer, "READBIN %s%04lX-%04lX",
+            protocolMinor >= 5 ? "RLE " : "", start, end);
     if (!command(buffer))
         return false;
     while (start <= end) {
+        startTimer(TIMEOUT_PACKET_MS);
         int pktlen = readChar();
         if (pktlen < 0)
             return false;
         else if (!pktlen)
             break;
+        if (pktlen == READBIN_RUN) {
+            // Run packet: the count and the word, low byte first.
+            if (!read(buffer, 4))
+                return false;
+            unsigned long count = (buffer[0] & 0xFF) | ((buffer[1] & 0xFF) << 8);
+            unsigned short word = (buffer[2] & 0xFF) | ((buffer[3] & 0xFF) << 8);
+            if (count > (end - start + 1))
+                count = end - start + 1;
+            for (unsigned long index = 0; index < count; ++index)
+                data[index] = word;
+            data += count;
+            start += count;
+            continue;
+        }
         if (!read(buffer, (size_t)pktlen))
             return false;
         int numWords = pktlen / 2;
@@ -167,6 +339,119 @@ bool SerialPort::readData(unsigned long start, unsigned long end, unsigned short
     return start > end;
 }
 
+// Computes the CRC-32 of a range of device memory using "CHECKSUM" from
+// version 1.3 of the protocol.  Older sketches do not have the command,
+// so the range is read back with "READBIN" and checksummed here instead.
+bool SerialPort::checksum(unsigned long start, unsigned long end, unsigned long *crc)
+{
+    if (protocolMinor < 3) {
+        std::vector<unsigned short> data(end - start + 1);
+        if (!readData(start, end, &(data[0])))
+            return false;
+        *crc = checksumWords(&(data[0]), end - start + 1);
+        return true;
+    }
+    char buffer[64];
+    sprintf(buffer, "CHECKSUM %04lX-%04lX\n", start, end);
+    write(buffer, strlen(buffer));
+    ++(counters.roundTrips);
+    std::string response = readLine(TIMEOUT_ERASE_MS);
+    while (response == "PENDING") {
+        // Large ranges take a while: sketch has asked for a longer timeout.
+        response = readLine(TIMEOUT_PENDING_MS);
+    }
+    if (response.compare(0, 3, "OK ") != 0)
+        return false;
+    char *endptr;
+    *crc = strtoul(response.c_str() + 3, &endptr, 16);
+    return endptr != (response.c_str() + 3) && *endptr == '\0';
+}
+
+// Computes the CRC-32 of each block of a range of device memory, where
+// blocks are aligned on multiples of "blockSize" words.  The first and
+// last blocks will be short if the range is not aligned.
+bool SerialPort::checksums(unsigned long start, unsigned long end, unsigned long blockSize, std::vector<unsigned long> *crcs)
+{
+    crcs->clear();
+    if (protocolMinor < 3) {
+        std::vector<unsigned short> data(end - start + 1);
+        if (!readData(start, end, &(data[0])))
+            return false;
+        for (unsigned long first = start; first <= end; ) {
+            unsigned long last = (first / blockSize + 1) * blockSize - 1;
+            if (last > end)
+                last = end;
+            crcs->push_back(checksumWords(&(data[first - start]), last - first + 1));
+            first = last + 1;
+        }
+        return true;
+    }
+    char buffer[64];
+    sprintf(buffer, "CHECKSUM %04lX-%04lX %lX", start, end, blockSize);
+    if (!command(buffer))
+        return false;
+    for (;;) {
+        // Each block's CRC is a separate line, and a block should take much
+        // less than a second, but the sketch may still send "PENDING".
+        bool timedOut;
+        std::string line = readLine(TIMEOUT_PENDING_MS, &timedOut);
+        if (timedOut)
+            return false;
+        if (line == ".")
+            break;
+        if (line == "PENDING")
+            continue;
+        char *endptr;
+        unsigned long crc = strtoul(line.c_str(), &endptr, 16);
+        if (endptr == line.c_str() || *endptr != '\0')
+            return false;
+        crcs->push_back(crc);
+    }
+    return crcs->size() == (end / blockSize - start / blockSize + 1);
+}
+
+// Asks ProgramEEPROM how many pages it has written, and how many it
+// skipped because the EEPROM already held them, since the device was
+// selected.  Returns false if the sketch does not understand "PAGES".
+bool SerialPort::pageCounts(unsigned long *written, unsigned long *skipped)
+{
+    write("PAGES\n", 6);
+    ++(counters.roundTrips);
+    std::string response = readLine(timeoutMillis);
+    if (response.compare(0, 3, "OK ") != 0)
+        return false;
+    const char *str = response.c_str() + 3;
+    char *endptr;
+    *written = strtoul(str, &endptr, 16);
+    if (endptr == str || *endptr != ' ')
+        return false;
+    str = endptr + 1;
+    *skipped = strtoul(str, &endptr, 16);
+    return endptr != str && *endptr == '\0';
+}
+
+// Computes the CRC-32 (IEEE 802.3) of a block of words in the same way as
+// "CHECKSUM": each word contributes its low byte and then its high byte.
+unsigned long SerialPort::checksumWords(const unsigned short *data, unsigned long count)
+{
+    unsigned long crc = 0xFFFFFFFFUL;
+    while (count > 0) {
+        unsigned int word = *data++;
+        for (int byte = 0; byte < 2; ++byte) {
+            crc ^= (word & 0xFF);
+            for (int bit = 0; bit < 8; ++bit) {
+                if (crc & 1)
+                    crc = (crc >> 1) ^ 0xEDB88320UL;
+                else
+                    crc >>= 1;
+            }
+            word >>= 8;
+        }
+        --count;
+    }
+    return crc ^ 0xFFFFFFFFUL;
+}
+
 // Writes a large block of data using a "WRITEBIN" or "WRITE" command.
 bool SerialPort::writeData(unsigned long start, unsigned long end, const unsigned short *data, bool force)
 {
@@ -181,6 +466,8 @@ bool SerialPort::writeData(unsigned long start, unsigned long end, const unsigne
                 start, data[0], data[1], data[2], data[3], data[4]);
         return command(buffer);
     }
+    if (protocolMinor >= 1)
+        return writeDataWindowed(start, end, data, force);
     sprintf(buffer, "WRITEBIN %s%04lX", force ? "FORCE " : "", start);
     if (!command(buffer))
         return false;
@@ -210,6 +497,256 @@ bool SerialPort::writeData(unsigned long start, unsigned long end, const unsigne
     return writePacket(buffer, 1);
 }
 
+// Parses a "OK XX" or "ERROR XX" acknowledgement from "WRITEBIN WINDOW".
+// Returns the sequence number, or -1 if the line does not have one.
+static int parseAck(const std::string &response, bool *ok)
+{
+    std::string::size_type index = response.find(' ');
+    *ok = (response.compare(0, index, "OK") == 0);
+    if (index == std::string::npos)
+        return -1;
+    return (int)strtoul(response.c_str() + index + 1, 0, 16);
+}
+
+// Parses the list of "ADDR:VALUE" pairs after the sequence number in a
+// "MISMATCH XX" acknowledgement from "VERIFYBIN".
+static void parseMismatches(const std::string &response, std::vector<SerialMismatch> *mismatches, size_t maxMismatches)
+{
+    char *posn;
+    strtoul(response.c_str() + 9, &posn, 16);   // Skip the sequence number.
+    while (*posn == ' ' && mismatches->size() < maxMismatches) {
+        SerialMismatch mismatch;
+        mismatch.address = strtoul(posn, &posn, 16);
+        if (*posn != ':')
+            break;
+        mismatch.value = (unsigned short)strtoul(posn + 1, &posn, 16);
+        mismatches->push_back(mismatch);
+    }
+}
+
+// Writes a large block of data using "WRITEBIN WINDOW" from version 1.1
+// of the protocol.  Version 1.6 adds "RLE" for compressed packets.
+bool SerialPort::writeDataWindowed(unsigned long start, unsigned long end, const unsigned short *data, bool force)
+{
+    char command[64];
+    bool compress = (protocolMinor >= 6);
+    sprintf(command, "WRITEBIN %sWINDOW %s%04lX\n", force ? "FORCE " : "",
+            compress ? "RLE " : "", start);
+    return sendWindowed(command, start, end, data, compress, 0, 0);
+}
+
+// Encodes words for a compressed "WRITEBIN RLE" packet.  Runs of 3 or
+// more identical words become fill opcodes (0x80-0xFF, then the word)
+// and everything else goes into literal opcodes (0x00-0x7F, then the
+// words).  Each opcode covers 1 to 128 words.  Returns the number of
+// words that were encoded into at most "maxSize" bytes of "buffer".
+static unsigned long encodeRuns(const unsigned short *data, unsigned long count, char *buffer, size_t maxSize, size_t *size)
+{
+    unsigned long words = 0;
+    size_t posn = 0;
+    size_t literal = 0;
+    bool open = false;
+    if (count > WRITEBIN_RLE_WORDS)
+        count = WRITEBIN_RLE_WORDS;
+    while (words < count) {
+        unsigned short word = data[words];
+        unsigned long run = 1;
+        while ((words + run) < count && run < 128 && data[words + run] == word)
+            ++run;
+        if (run >= 3) {
+            if ((posn + 3) > maxSize)
+                break;
+            buffer[posn++] = (char)(0x80 | (run - 1));
+            buffer[posn++] = (char)word;
+            buffer[posn++] = (char)(word >> 8);
+            words += run;
+            open = false;
+            continue;
+        }
+        if (open && (buffer[literal] & 0x7F) != 0x7F) {
+            // Add the word to the current literal opcode.
+            if ((posn + 2) > maxSize)
+                break;
+            ++(buffer[literal]);
+        } else {
+            if ((posn + 3) > maxSize)
+                break;
+            literal = posn;
+            buffer[posn++] = (char)0x00;
+            open = true;
+        }
+        buffer[posn++] = (char)word;
+        buffer[posn++] = (char)(word >> 8);
+        ++words;
+    }
+    *size = posn;
+    return words;
+}
+
+// Compares a block of data with device memory using "VERIFYBIN" from
+// version 1.4 of the protocol.  The words that do not match are added to
+// "mismatches", and the comparison stops early once there are
+// "maxMismatches" of them.  Returns false if the comparison could not be
+// done, or true if it was, even if there were mismatches.
+bool SerialPort::verifyData(unsigned long start, unsigned long end, const unsigned short *data, bool force, std::vector<SerialMismatch> *mismatches, size_t maxMismatches)
+{
+    if (protocolMinor < 4)
+        return false;
+    char command[64];
+    sprintf(command, "VERIFYBIN %s%04lX\n", force ? "FORCE " : "", start);
+    return sendWindowed(command, start, end, data, false, mismatches, maxMismatches);
+}
+
+// Sends a large block of data in packets for "WRITEBIN WINDOW" or
+// "VERIFYBIN".  Several packets are kept in flight at once so that
+// the sketch does not sit idle waiting for the next packet after each
+// acknowledgement.  The sketch reports the size of its serial receive
+// buffer, and the host makes sure that the packets queued up behind the
+// one being processed will always fit.  If "compress" is set, then each
+// packet is compressed with encodeRuns() if that makes it smaller.
+bool SerialPort::sendWindowed(const char *command, unsigned long start, unsigned long end, const unsigned short *data, bool compress, std::vector<SerialMismatch> *mismatches, size_t maxMismatches)
+{
+    char buffer[BINARY_TRANSFER_MAX + 2];
+    unsigned long len = (end - start + 1) * 2;
+    bool ok;
+    write(command, strlen(command));
+    ++(counters.roundTrips);
+    int rxSize = parseAck(readLine(timeoutMillis), &ok);
+    if (!ok || rxSize < 0)
+        return false;
+
+    // Pick a packet size that allows at least two packets to queue up
+    // in the receive buffer.  If the buffer is too small for that, then
+    // send full-sized packets one at a time.
+    size_t maxPayload;
+    if (rxSize >= 2 * (BINARY_TRANSFER_MAX + 2))
+        maxPayload = BINARY_TRANSFER_MAX;
+    else
+        maxPayload = ((size_t)(rxSize / 2 - 2)) & ~((size_t)1);
+    if (maxPayload < 8)
+        maxPayload = BINARY_TRANSFER_MAX;
+    else if (maxPayload == 0x0A)
+        maxPayload = 8;     // First packet length cannot be 0x0A.
+
+    // Packets that have not been acknowledged yet, oldest first.
+    struct Inflight
+    {
+        int seq;
+        size_t pktlen;
+        unsigned long long sentMicros;
+    };
+    std::deque<Inflight> inflight;
+    size_t queued = 0;      // Bytes in flight, not counting the oldest packet.
+    int seq = 0;
+    bool terminated = false;
+    bool failed = false;
+    for (;;) {
+        // Send as many packets as the receive buffer will allow.
+        while (!terminated && !failed) {
+            size_t payload = len < maxPayload ? (size_t)len : maxPayload;
+            size_t pktlen = payload ? payload + 2 : 1;
+            unsigned long words = payload / 2;
+            bool packed = false;
+            if (compress && payload) {
+                size_t encoded;
+                unsigned long runWords = encodeRuns(data, len / 2, buffer + 2,
+                                                    maxPayload, &encoded);
+                if (runWords > 0 && encoded < runWords * 2) {
+                    packed = true;
+                    words = runWords;
+                    pktlen = encoded + 2;
+                    buffer[0] = (char)(WRITEBIN_PACKED | encoded);
+                }
+            }
+            if (!inflight.empty() && (queued + pktlen) > (size_t)rxSize)
+                break;
+            if (!packed) {
+                buffer[0] = (char)payload;
+                for (size_t index = 0; index < payload; index += 2) {
+                    unsigned short word = data[index / 2];
+                    buffer[index + 2] = (char)word;
+                    buffer[index + 3] = (char)(word >> 8);
+                }
+            }
+            if (payload) {
+                buffer[1] = (char)seq;
+                data += words;
+                len -= words * 2;
+            }
+            write(buffer, pktlen);
+            if (!payload) {
+                ++(counters.roundTrips);
+                terminated = true;
+                break;
+            }
+            if (!inflight.empty())
+                queued += pktlen;
+            Inflight packet;
+            packet.seq = seq;
+            packet.pktlen = pktlen;
+            packet.sentMicros = currentMicros();
+            inflight.push_back(packet);
+            seq = (seq + 1) & 0xFF;
+        }
+
+        // Wait for the next acknowledgement or the final response.
+        // The sketch may read back the rows it has written before
+        // sending the final response, so allow more time for that.
+        std::string response = readLine((terminated && inflight.empty())
+                                        ? TIMEOUT_PENDING_MS
+                                        : TIMEOUT_PACKET_MS);
+        while (response == "PENDING") {
+            // Still reading back rows: the sketch has asked for more time.
+            response = readLine(TIMEOUT_PENDING_MS);
+        }
+        int ackSeq = parseAck(response, &ok);
+        if (ackSeq < 0) {
+            // Final response to the terminating packet, or a timeout.
+            // The final response to "VERIFYBIN" is "ERROR" on a mismatch.
+            if (mismatches && !mismatches->empty() && response == "ERROR")
+                ok = true;
+            return ok && !failed && terminated && inflight.empty();
+        }
+        if (mismatches && response.compare(0, 9, "MISMATCH ") == 0) {
+            // Some words did not match.  Stop sending data once we have
+            // seen enough of them, but keep going with the packets in flight.
+            parseMismatches(response, mismatches, maxMismatches);
+            if (mismatches->size() >= maxMismatches && !terminated) {
+                buffer[0] = (char)0x00;
+                write(buffer, 1);
+                ++(counters.roundTrips);
+                terminated = true;
+            }
+            ok = true;
+        }
+        if (!ok) {
+            // A write failed.  Stop sending data and terminate the
+            // transfer; the sketch discards the packets still in flight.
+            failed = true;
+            if (!terminated) {
+                buffer[0] = (char)0x00;
+                write(buffer, 1);
+                ++(counters.roundTrips);
+                terminated = true;
+            }
+            continue;
+        }
+
+        // Acknowledgements are cumulative, so pop everything up to and
+        // including the packet with the acknowledged sequence number.
+        bool found = false;
+        while (!inflight.empty() && !found) {
+            found = (inflight.front().seq == ackSeq);
+            recordAck(inflight.front().sentMicros);
+            inflight.pop_front();
+            if (!inflight.empty())
+                queued -= inflight.front().pktlen;
+        }
+        if (!found)
+            return false;   // Out of sequence, so the link is confused.
+    }
+}
+
 bool SerialPort::read(char *data, size_t len)
 {
     while (len > 0) {
@@ -222,6 +759,13 @@ bool SerialPort::read(char *data, size_t len)
     return true;
 }
 
+// Returns the number of milliseconds until the current deadline.
+int SerialPort::remainingMillis() const
+{
+    long remaining = (long)(deadline - currentMillis());
+    return remaining > 0 ? (int)remaining : 0;
+}
+
 int SerialPort::readChar()
 {
     if (bufposn >= buflen) {
@@ -231,10 +775,13 @@ int SerialPort::readChar()
     return buffer[bufposn++] & 0xFF;
 }
 
-std::string SerialPort::readLine(bool *timedOut)
+// Reads a line from the sketch, waiting for up to "timeout" milliseconds
+// for the whole line to arrive.
+std::string SerialPort::readLine(int timeout, bool *timedOut)
 {
     std::string line;
     int ch;
+    startTimer(timeout);
     if (timedOut)
         *timedOut = false;
     while ((ch = readChar()) != -1) {
@@ -255,7 +802,7 @@ std::string SerialPort::readMultiLineResponse()
     std::string line;
     bool timedOut;
     for (;;) {
-        line = readLine(&timedOut);
+        line = readLine(timeoutMillis, &timedOut);
         if (timedOut || line == ".")
             break;
         response += line;
@@ -290,7 +837,7 @@ DeviceInfoMap SerialPort::readDeviceInfo()
     std::string line;
     bool timedOut;
     for (;;) {
-        line = readLine(&timedOut);
+        line = readLine(timeoutMillis, &timedOut);
         if (timedOut || line == ".")
             break;
         std::string::size_type index = line.find(':');
@@ -304,7 +851,25 @@ DeviceInfoMap SerialPort::readDeviceInfo()
 
 bool SerialPort::writePacket(const char *packet, size_t len)
 {
+    unsigned long long sentMicros = currentMicros();
     write(packet, len);
-    std::string response = readLine();
+    ++(counters.roundTrips);
+    std::string response = readLine(TIMEOUT_PACKET_MS);
+    if (len > 1)
+        recordAck(sentMicros);
     return response == "OK";
 }
+
+// Adds the time since a WRITEBIN packet was sent to the latency histogram.
+void SerialPort::recordAck(unsigned long long sentMicros)
+{
+    unsigned long long latency = currentMicros() - sentMicros;
+    int bucket = 0;
+    while (bucket < (SERIAL_ACK_BUCKETS - 1) && latency >= (128ULL << bucket))
+        ++bucket;
+    ++(counters.ackHistogram[bucket]);
+    ++(counters.acks);
+    counters.ackMicros += latency;
+    if (latency > counters.ackMaxMicros)
+        counters.ackMaxMicros = latency;
+}
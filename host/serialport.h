@@ -20,6 +20,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <stddef.h>
 #ifdef _WIN32
 #define	SERIAL_WIN32	1
@@ -31,16 +32,41 @@
 
 typedef std::map<std::string, std::string> DeviceInfoMap;
 
+// Number of buckets in the WRITEBIN acknowledgement latency histogram.
+// Bucket 0 counts latencies under 128 microseconds, and each bucket
+// after that covers twice the range of the one before it.
+#define SERIAL_ACK_BUCKETS  16
+
+// Traffic on the serial link since the port was created.
+struct SerialStats
+{
+    unsigned long bytesSent;
+    unsigned long bytesReceived;
+    unsigned long roundTrips;
+    unsigned long acks;
+    unsigned long long ackMicros;
+    unsigned long long ackMaxMicros;
+    unsigned long ackHistogram[SERIAL_ACK_BUCKETS];
+};
+
+// A word that did not match during "VERIFYBIN".
+struct SerialMismatch
+{
+    unsigned long address;
+    unsigned short value;       // Value on the device.
+};
+
 class SerialPort
 {
 public:
     SerialPort();
     ~SerialPort();
 
-    bool open(const std::string &deviceName, int speed = 9600);
+    bool open(const std::string &deviceName, int speed = 9600, bool reset = true);
     void close();
 
     DeviceInfoMap initDevice(const std::string &deviceName);
+    bool pollDevice(bool *present);
 
     bool command(const std::string &cmd);
 
@@ -48,9 +74,27 @@ public:
 
     bool readData(unsigned long start, unsigned long end, unsigned short *data);
     bool writeData(unsigned long start, unsigned long end, const unsigned short *data, bool force);
+    bool verifyData(unsigned long start, unsigned long end, const unsigned short *data, bool force, std::vector<SerialMismatch> *mismatches, size_t maxMismatches);
+    bool checksum(unsigned long start, unsigned long end, unsigned long *crc);
+    bool checksums(unsigned long start, unsigned long end, unsigned long blockSize, std::vector<unsigned long> *crcs);
+    bool pageCounts(unsigned long *written, unsigned long *skipped);
 
-    int timeout() const { return timeoutSecs; }
-    void setTimeout(int timeout) { timeoutSecs = timeout; }
+    static unsigned long checksumWords(const unsigned short *data, unsigned long count);
+
+    int protocolVersion() const { return protocolMinor; }
+
+    int speed() const { return currentSpeed; }
+    bool negotiateSpeed(int speed);
+
+    unsigned long attachTime() const { return attachMillis; }
+
+    const SerialStats &stats() const { return counters; }
+    static unsigned long long currentMicros();
+
+    // Timeout for ordinary commands, in milliseconds.  Data packets and
+    // long-running commands like "ERASE" have their own timeouts.
+    int timeout() const { return timeoutMillis; }
+    void setTimeout(int timeout) { timeoutMillis = timeout; }
 
 private:
 #ifdef SERIAL_POSIX
@@ -60,24 +104,39 @@ private:
 #ifdef SERIAL_WIN32
     HANDLE handle;
     COMMTIMEOUTS timeouts;
-    int lastTimeoutSecs;
+    int lastTimeoutMillis;
 #endif
     char buffer[1024];
     int buflen;
     int bufposn;
-    int timeoutSecs;
+    int timeoutMillis;
+    unsigned long deadline;
+    int protocolMinor;
+    int currentSpeed;
+    unsigned long attachMillis;
+    SerialStats counters;
 
     void init();
 
     bool read(char *data, size_t len);
     int readChar();
-    std::string readLine(bool *timedOut = 0);
+    std::string readLine(int timeout, bool *timedOut = 0);
     std::string readMultiLineResponse();
     DeviceInfoMap readDeviceInfo();
 
+    bool attach(const std::string &deviceName, unsigned long startTime);
+    bool probeVersion(int retries);
+    static unsigned long currentMillis();
+    void startTimer(int timeout) { deadline = currentMillis() + timeout; }
+    int remainingMillis() const;
+
+    bool setSpeed(int speed);
     bool fillBuffer();
     void write(const char *data, size_t len);
     bool writePacket(const char *packet, size_t len);
+    void recordAck(unsigned long long sentMicros);
+    bool writeDataWindowed(unsigned long start, unsigned long end, const unsigned short *data, bool force);
+    bool sendWindowed(const char *command, unsigned long start, unsigned long end, const unsigned short *data, bool compress, std::vector<SerialMismatch> *mismatches, size_t maxMismatches);
 };
 
 #endif
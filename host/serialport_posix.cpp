@@ -16,12 +16,13 @@
  */
 
 #include "serialport.h"
+#include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <string.h>
@@ -32,14 +33,66 @@
 #define O_NONBLOCK O_NDELAY
 #endif
 
+#if defined(__linux__) && defined(TCGETS2)
+// <asm/termbits.h> cannot be included alongside <termios.h>, so declare
+// the kernel's termios2 structure here.  It is used to set speeds that
+// do not have a Bnnn constant, such as 250000, via BOTHER.
+#define SERIAL_TERMIOS2 1
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#endif
+
+// Converts a speed into one of the standard termios speed constants.
+static bool standardSpeed(int speed, speed_t *speedval)
+{
+    switch (speed) {
+    case 9600:      *speedval = B9600; break;
+    case 19200:     *speedval = B19200; break;
+    case 38400:     *speedval = B38400; break;
+#ifdef B57600
+    case 57600:     *speedval = B57600; break;
+#endif
+#ifdef B115200
+    case 115200:    *speedval = B115200; break;
+#endif
+#ifdef B230400
+    case 230400:    *speedval = B230400; break;
+#endif
+#ifdef B460800
+    case 460800:    *speedval = B460800; break;
+#endif
+#ifdef B500000
+    case 500000:    *speedval = B500000; break;
+#endif
+#ifdef B1000000
+    case 1000000:   *speedval = B1000000; break;
+#endif
+    default:        return false;
+    }
+    return true;
+}
+
 void SerialPort::init()
 {
     fd = -1;
     ::memset(&prevParams, 0, sizeof(prevParams));
 }
 
-bool SerialPort::open(const std::string &deviceName, int speed)
+bool SerialPort::open(const std::string &deviceName, int speed, bool reset)
 {
+    unsigned long startTime = currentMillis();
     close();
     fd = ::open(deviceName.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK, 0);
     if (fd < 0) {
@@ -55,24 +108,11 @@ bool SerialPort::open(const std::string &deviceName, int speed)
     }
     ::memcpy(&prevParams, &params, sizeof(params));
     speed_t speedval;
-    switch (speed) {
-    case 9600:      speedval = B9600; break;
-    case 19200:     speedval = B19200; break;
-    case 38400:     speedval = B38400; break;
-#ifdef B57600
-    case 57600:     speedval = B57600; break;
-#endif
-#ifdef B115200
-    case 115200:    speedval = B115200; break;
-#endif
-#ifdef B230400
-    case 230400:    speedval = B230400; break;
-#endif
-    default:
-        fprintf(stderr, "%s: invalid speed %d\n", deviceName.c_str(), speed);
-        ::close(fd);
-        fd = -1;
-        return false;
+    bool custom = false;
+    if (!standardSpeed(speed, &speedval)) {
+        // Non-standard speeds are set once the other parameters are.
+        speedval = B9600;
+        custom = true;
     }
     params.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP |
                         INLCR | IGNCR | ICRNL | IXON);
@@ -90,42 +130,31 @@ bool SerialPort::open(const std::string &deviceName, int speed)
         fd = -1;
         return false;
     }
+    if (custom && !setSpeed(speed)) {
+        fprintf(stderr, "%s: invalid speed %d\n", deviceName.c_str(), speed);
+        ::tcsetattr(fd, TCSANOW, &prevParams);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    currentSpeed = speed;
     ::ioctl(fd, TIOCCBRK, 0);
     int lines = 0;
-    if (::ioctl(fd, TIOCMGET, &lines) >= 0) {
+    if (reset && ::ioctl(fd, TIOCMGET, &lines) >= 0) {
         lines |= TIOCM_DTR | TIOCM_RTS;
         ::ioctl(fd, TIOCMSET, &lines);
     }
+    ::tcflush(fd, TCIFLUSH);
+    buflen = 0;
+    bufposn = 0;
 
     // At this point, the Arduino may auto-reset so we have to wait for
-    // it to come back up again.  Poll the "PROGRAM_PIC_VERSION" command
-    // once a second until we get a response.  Give up after 5 seconds.
-    int retry = 5;
-    int saveTimeout = timeoutSecs;
-    timeoutSecs = 1;
-    while (retry > 0) {
-        write("PROGRAM_PIC_VERSION\n", 20);
-        std::string response = readLine();
-        if (!response.empty()) {
-            if (response.find("ProgramPIC 1.") == 0) {
-                // We've found a version 1 sketch, which we can talk to.
-                break;
-            } else if (response.find("ProgramPIC ") == 0) {
-                // Version 2 or higher sketch - cannot talk to this.
-                retry = 0;
-                break;
-            }
-        }
-        --retry;
-    }
-    timeoutSecs = saveTimeout;
-    if (retry > 0)
+    // it to come back up again.
+    if (attach(deviceName, startTime))
         return true;
     ::tcsetattr(fd, TCSANOW, &prevParams);
     ::close(fd);
     fd = -1;
-    fprintf(stderr, "%s: did not find a compatible PIC programmer\n",
-            deviceName.c_str());
     return false;
 }
 
@@ -143,14 +172,69 @@ void SerialPort::close()
     }
 }
 
+// Changes the speed of the serial port once all pending output has been
+// sent, and discards any input that arrived at the old speed.
+bool SerialPort::setSpeed(int speed)
+{
+    speed_t speedval;
+    ::tcdrain(fd);
+    if (standardSpeed(speed, &speedval)) {
+        struct termios params;
+        if (::tcgetattr(fd, &params) < 0)
+            return false;
+        cfsetispeed(&params, speedval);
+        cfsetospeed(&params, speedval);
+        if (::tcsetattr(fd, TCSANOW, &params) < 0)
+            return false;
+    } else {
+#ifdef SERIAL_TERMIOS2
+        struct termios2 params;
+        if (::ioctl(fd, TCGETS2, &params) < 0)
+            return false;
+        params.c_cflag &= ~(CBAUD | (CBAUD << 16));
+        params.c_cflag |= BOTHER;
+        params.c_ispeed = (speed_t)speed;
+        params.c_ospeed = (speed_t)speed;
+        if (::ioctl(fd, TCSETS2, &params) < 0)
+            return false;
+#else
+        return false;
+#endif
+    }
+    ::tcflush(fd, TCIFLUSH);
+    buflen = 0;
+    bufposn = 0;
+    return true;
+}
+
+// Returns the value of a monotonic clock in milliseconds.
+unsigned long SerialPort::currentMillis()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)(ts.tv_nsec / 1000000);
+}
+
+// Returns the value of a monotonic clock in microseconds.
+unsigned long long SerialPort::currentMicros()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL +
+           (unsigned long long)(ts.tv_nsec / 1000);
+}
+
+// Fills the input buffer, waiting until the current deadline for data.
+// Returns false on timeout or if the device has gone away.
 bool SerialPort::fillBuffer()
 {
     ssize_t len;
-    fd_set readSet;
-    struct timeval timeout;
+    struct pollfd pfd;
+    bool hangup = false;
     for (;;) {
         len = ::read(fd, buffer, sizeof(buffer));
         if (len > 0) {
+            counters.bytesReceived += (unsigned long)len;
             buflen = (int)len;
             bufposn = 0;
             return true;
@@ -160,12 +244,24 @@ bool SerialPort::fillBuffer()
             else if (errno != EAGAIN)
                 break;
         }
-        FD_ZERO(&readSet);
-        FD_SET(fd, &readSet);
-        timeout.tv_sec = timeoutSecs;
-        timeout.tv_usec = 0;
-        if (::select(fd + 1, &readSet, (fd_set *)0, (fd_set *)0, &timeout) <= 0)
+        if (hangup)
+            break;      // Unplugged or the other end of a pty has closed.
+        int remaining = remainingMillis();
+        if (remaining <= 0)
             break;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int result = ::poll(&pfd, 1, remaining);
+        if (result < 0) {
+            if (errno != EINTR)
+                break;
+        } else if (result == 0) {
+            break;
+        } else if ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+            // Read whatever is left in the buffer and then give up.
+            hangup = true;
+        }
     }
     buflen = 0;
     bufposn = 0;
@@ -182,6 +278,7 @@ void SerialPort::write(const char *data, size_t len)
         } else if (!written) {
             break;
         } else {
+            counters.bytesSent += (unsigned long)written;
             data += written;
             len -= written;
         }
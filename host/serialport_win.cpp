@@ -16,18 +16,20 @@
  */
 
 #include "serialport.h"
+#include <stdlib.h>
 
 void SerialPort::init()
 {
     handle = INVALID_HANDLE_VALUE;
     ::memset(&timeouts, 0, sizeof(timeouts));
-    lastTimeoutSecs = -1;
+    lastTimeoutMillis = -1;
 }
 
-bool SerialPort::open(const std::string &deviceName, int speed)
+bool SerialPort::open(const std::string &deviceName, int speed, bool reset)
 {
+    unsigned long startTime = currentMillis();
     close();
-    lastTimeoutSecs = -1;
+    lastTimeoutMillis = -1;
 
     // Open the COM port.
     std::string dev(deviceName);
@@ -56,42 +58,28 @@ bool SerialPort::open(const std::string &deviceName, int speed)
     dcb.ByteSize = 8;
     dcb.StopBits = ONESTOPBIT;
     dcb.Parity = NOPARITY;
-    dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    if (reset)
+        dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    else
+        dcb.fDtrControl = DTR_CONTROL_DISABLE;
     if (!::SetCommState(handle, &dcb)) {
         fprintf(stderr, "%s: Could not set serial parameters\n", deviceName.c_str());
         ::CloseHandle(handle);
         handle = INVALID_HANDLE_VALUE;
         return false;
     }
+    currentSpeed = speed;
+
+    ::PurgeComm(handle, PURGE_RXCLEAR);
+    buflen = 0;
+    bufposn = 0;
 
     // At this point, the Arduino may auto-reset so we have to wait for
-    // it to come back up again.  Poll the "PROGRAM_PIC_VERSION" command
-    // once a second until we get a response.  Give up after 5 seconds.
-    int retry = 5;
-    int saveTimeout = timeoutSecs;
-    timeoutSecs = 1;
-    while (retry > 0) {
-        write("PROGRAM_PIC_VERSION\n", 20);
-        std::string response = readLine();
-        if (!response.empty()) {
-            if (response.find("ProgramPIC 1.") == 0) {
-                // We've found a version 1 sketch, which we can talk to.
-                break;
-            } else if (response.find("ProgramPIC ") == 0) {
-                // Version 2 or higher sketch - cannot talk to this.
-                retry = 0;
-                break;
-            }
-        }
-        --retry;
-    }
-    timeoutSecs = saveTimeout;
-    if (retry > 0)
+    // it to come back up again.
+    if (attach(deviceName, startTime))
         return true;
     ::CloseHandle(handle);
     handle = INVALID_HANDLE_VALUE;
-    fprintf(stderr, "%s: did not find a compatible PIC programmer\n",
-            deviceName.c_str());
     return false;
 }
 
@@ -107,6 +95,41 @@ void SerialPort::close()
     }
 }
 
+// Changes the speed of the serial port once all pending output has been
+// sent, and discards any input that arrived at the old speed.
+bool SerialPort::setSpeed(int speed)
+{
+    DCB dcb;
+    ::FlushFileBuffers(handle);
+    if (!::GetCommState(handle, &dcb))
+        return false;
+    dcb.BaudRate = speed;
+    if (!::SetCommState(handle, &dcb))
+        return false;
+    ::PurgeComm(handle, PURGE_RXCLEAR);
+    buflen = 0;
+    bufposn = 0;
+    return true;
+}
+
+// Returns the value of a monotonic clock in milliseconds.
+unsigned long SerialPort::currentMillis()
+{
+    return ::GetTickCount();
+}
+
+// Returns the value of a monotonic clock in microseconds.
+unsigned long long SerialPort::currentMicros()
+{
+    LARGE_INTEGER count, frequency;
+    ::QueryPerformanceCounter(&count);
+    ::QueryPerformanceFrequency(&frequency);
+    // Split the conversion so that count * 1000000 cannot overflow.
+    unsigned long long c = (unsigned long long)count.QuadPart;
+    unsigned long long f = (unsigned long long)frequency.QuadPart;
+    return (c / f) * 1000000ULL + (c % f) * 1000000ULL / f;
+}
+
 bool SerialPort::fillBuffer()
 {
     DWORD errors;
@@ -122,19 +145,24 @@ bool SerialPort::fillBuffer()
             size = status.cbInQue;
         if (::ReadFile(handle, buffer, size, &bytesRead, NULL) && bytesRead != 0) {
             buflen = (int)bytesRead;
+            counters.bytesReceived += bytesRead;
             return true;
         }
     } else {
-        // Set the desired timeout and then read.
-        if (lastTimeoutSecs != timeoutSecs) {
+        // Wait for the time remaining until the current deadline.
+        int remaining = remainingMillis();
+        if (remaining <= 0)
+            return false;
+        if (lastTimeoutMillis != remaining) {
             timeouts.ReadIntervalTimeout = MAXDWORD;
-            timeouts.ReadTotalTimeoutConstant = timeoutSecs * 1000;
+            timeouts.ReadTotalTimeoutConstant = remaining;
             timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
             ::SetCommTimeouts(handle, &timeouts);
-            lastTimeoutSecs = timeoutSecs;
+            lastTimeoutMillis = remaining;
         }
         if (::ReadFile(handle, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead != 0) {
             buflen = (int)bytesRead;
+            counters.bytesReceived += bytesRead;
             return true;
         }
     }
@@ -143,10 +171,12 @@ bool SerialPort::fillBuffer()
 
 void SerialPort::write(const char *data, size_t len)
 {
-    DWORD written;
+    DWORD written = 0;
     if (!::WriteFile(handle, data, len, &written, NULL)) {
         DWORD errors;
         COMSTAT status;
         ::ClearCommError(handle, &errors, &status);
+        return;
     }
+    counters.bytesSent += written;
 }
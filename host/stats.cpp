@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include <string.h>
+
+static const char * const phaseNames[] = {
+    "attach",
+    "detect",
+    "load",
+    "erase",
+    "program",
+    "data",
+    "config",
+    "verify",
+    "readback",
+    "save"
+};
+
+Stats::Stats(const SerialPort *port, int format)
+    : port(port)
+    , format(format)
+    , pagesReported(false)
+    , pagesWritten(0)
+    , pagesSkipped(0)
+    , current(-1)
+    , startMicros(0)
+{
+    memset(phases, 0, sizeof(phases));
+    memset(&startCounters, 0, sizeof(startCounters));
+}
+
+// The summary is printed on the way out of main(), whichever way it exits.
+Stats::~Stats()
+{
+    if (format != STATS_NONE)
+        print(stderr);
+}
+
+void Stats::begin(Phase phase)
+{
+    end();
+    current = phase;
+    startMicros = SerialPort::currentMicros();
+    startCounters = port->stats();
+}
+
+// Ends the current phase, adding "words" to the words it has handled.
+void Stats::end(unsigned long words)
+{
+    if (current < 0)
+        return;
+    const SerialStats &counters = port->stats();
+    PhaseStats &phase = phases[current];
+    phase.used = true;
+    phase.micros += SerialPort::currentMicros() - startMicros;
+    phase.words += words;
+    phase.bytesSent += counters.bytesSent - startCounters.bytesSent;
+    phase.bytesReceived += counters.bytesReceived - startCounters.bytesReceived;
+    phase.roundTrips += counters.roundTrips - startCounters.roundTrips;
+    current = -1;
+}
+
+// Adds the EEPROM pages that the programmer wrote and skipped.
+void Stats::addPages(unsigned long written, unsigned long skipped)
+{
+    pagesReported = true;
+    pagesWritten += written;
+    pagesSkipped += skipped;
+}
+
+void Stats::print(FILE *file)
+{
+    end();
+    fflush(stdout);
+    if (format == STATS_JSON)
+        printJSON(file);
+    else
+        printTable(file);
+}
+
+void Stats::printTable(FILE *file) const
+{
+    PhaseStats total;
+    memset(&total, 0, sizeof(total));
+    fprintf(file, "\nphase        time (ms)     words      sent  received  round trips\n");
+    for (int index = 0; index < PhaseCount; ++index) {
+        const PhaseStats &phase = phases[index];
+        if (!phase.used)
+            continue;
+        fprintf(file, "%-10s %11.1f %9lu %9lu %9lu %12lu\n", phaseNames[index],
+                phase.micros / 1000.0, phase.words, phase.bytesSent,
+                phase.bytesReceived, phase.roundTrips);
+        total.micros += phase.micros;
+        total.bytesSent += phase.bytesSent;
+        total.bytesReceived += phase.bytesReceived;
+        total.roundTrips += phase.roundTrips;
+    }
+    fprintf(file, "%-10s %11.1f %9s %9lu %9lu %12lu\n", "total",
+            total.micros / 1000.0, "", total.bytesSent,
+            total.bytesReceived, total.roundTrips);
+    fprintf(file, "attach latency: %lu ms\n", port->attachTime());
+    if (pagesReported) {
+        fprintf(file, "EEPROM pages: %lu written, %lu skipped as unchanged\n",
+                pagesWritten, pagesSkipped);
+    }
+
+    const SerialStats &counters = port->stats();
+    if (!counters.acks)
+        return;
+    fprintf(file, "WRITEBIN acknowledgements: %lu, mean %.2f ms, max %.2f ms\n",
+            counters.acks, counters.ackMicros / (counters.acks * 1000.0),
+            counters.ackMaxMicros / 1000.0);
+    fprintf(file, "  %-19s %9s\n", "latency (us)", "count");
+    for (int bucket = 0; bucket < SERIAL_ACK_BUCKETS; ++bucket) {
+        if (!counters.ackHistogram[bucket])
+            continue;
+        unsigned long low = bucket ? (64UL << bucket) : 0;
+        if (bucket < (SERIAL_ACK_BUCKETS - 1)) {
+            fprintf(file, "  %8lu - %-8lu %9lu\n", low, 128UL << bucket,
+                    counters.ackHistogram[bucket]);
+        } else {
+            fprintf(file, "  %8lu+%-10s %9lu\n", low, "",
+                    counters.ackHistogram[bucket]);
+        }
+    }
+}
+
+void Stats::printJSON(FILE *file) const
+{
+    fprintf(file, "{\"phases\": {");
+    bool first = true;
+    for (int index = 0; index < PhaseCount; ++index) {
+        const PhaseStats &phase = phases[index];
+        if (!phase.used)
+            continue;
+        fprintf(file, "%s\n  \"%s\": {\"ms\": %.3f, \"words\": %lu, "
+                      "\"bytesSent\": %lu, \"bytesReceived\": %lu, "
+                      "\"roundTrips\": %lu}",
+                first ? "" : ",", phaseNames[index], phase.micros / 1000.0,
+                phase.words, phase.bytesSent, phase.bytesReceived,
+                phase.roundTrips);
+        first = false;
+    }
+    const SerialStats &counters = port->stats();
+    fprintf(file, "},\n \"attachMs\": %lu,\n", port->attachTime());
+    if (pagesReported) {
+        fprintf(file, " \"pages\": {\"written\": %lu, \"skipped\": %lu},\n",
+                pagesWritten, pagesSkipped);
+    }
+    fprintf(file, " \"acks\": {\"count\": %lu, \"meanMs\": %.3f, \"maxMs\": %.3f, "
+                  "\"histogram\": [",
+            counters.acks,
+            counters.acks ? counters.ackMicros / (counters.acks * 1000.0) : 0.0,
+            counters.ackMaxMicros / 1000.0);
+    for (int bucket = 0; bucket < SERIAL_ACK_BUCKETS; ++bucket) {
+        // "maxUs" is exclusive; the last bucket has no upper bound.
+        if (bucket < (SERIAL_ACK_BUCKETS - 1)) {
+            fprintf(file, "%s{\"maxUs\": %lu, \"count\": %lu}",
+                    bucket ? ", " : "", 128UL << bucket,
+                    counters.ackHistogram[bucket]);
+        } else {
+            fprintf(file, ", {\"maxUs\": null, \"count\": %lu}",
+                    counters.ackHistogram[bucket]);
+        }
+    }
+    fprintf(file, "]}}\n");
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2012 Southern Storm Software, Pty Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "serialport.h"
+#include <stdio.h>
+
+#define STATS_NONE          0
+#define STATS_TABLE         1
+#define STATS_JSON          2
+
+// Collects the time, words, and serial traffic for each phase of a run
+// for "--stats".  The traffic figures are the differences between the
+// port's counters at the start and end of each phase.  A phase may be
+// entered more than once, in which case the figures are added together.
+class Stats
+{
+public:
+    enum Phase
+    {
+        Attach,
+        Detect,
+        Load,
+        Erase,
+        ProgramBurn,
+        DataBurn,
+        ConfigBurn,
+        Verify,
+        Readback,
+        Save,
+        PhaseCount
+    };
+
+    Stats(const SerialPort *port, int format);
+    ~Stats();
+
+    void begin(Phase phase);
+    void end(unsigned long words = 0);
+    void addPages(unsigned long written, unsigned long skipped);
+
+    void print(FILE *file);
+
+private:
+    struct PhaseStats
+    {
+        bool used;
+        unsigned long long micros;
+        unsigned long words;
+        unsigned long bytesSent;
+        unsigned long bytesReceived;
+        unsigned long roundTrips;
+    };
+
+    const SerialPort *port;
+    int format;
+    PhaseStats phases[PhaseCount];
+    bool pagesReported;
+    unsigned long pagesWritten;
+    unsigned long pagesSkipped;
+    int current;
+    unsigned long long startMicros;
+    SerialStats startCounters;
+
+    void printTable(FILE *file) const;
+    void printJSON(FILE *file) const;
+};
+
+#endif